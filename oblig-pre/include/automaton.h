@@ -0,0 +1,69 @@
+#ifndef AUTOMATON_H
+#define AUTOMATON_H
+
+#include "set.h"
+
+#include <stddef.h>
+
+/*
+ * The type of spamword automata.  An automaton is a DFA compiled from a
+ * spamword set, that finds the spamwords in text in one pass over its
+ * bytes, without tokenizing it into words first.
+ *
+ * Matching follows the tokenizer exactly: only whole words match, words
+ * are compared ignoring case, and words longer than 100 characters are
+ * matched as pieces of 100 characters.
+ *
+ * An automaton is never changed after it is created, so several threads
+ * may scan with it at once, each through a scanner of its own.
+ */
+typedef struct automaton automaton_t;
+
+/*
+ * Compiles the given spamword set, which must hold lower-cased strings,
+ * into a new automaton.
+ */
+automaton_t *automaton_create(set_t *spamwords);
+
+/*
+ * Destroys the given automaton.
+ */
+void automaton_destroy(automaton_t *automaton);
+
+/*
+ * The type of automaton scanners.  A scanner runs an automaton over a
+ * mail, which may be fed to it in pieces, and counts the distinct
+ * spamwords found.  Scanning allocates no memory.
+ */
+typedef struct scanner scanner_t;
+
+/*
+ * Creates a scanner for the given automaton.
+ */
+scanner_t *scanner_create(automaton_t *automaton);
+
+/*
+ * Destroys the given scanner.
+ */
+void scanner_destroy(scanner_t *scanner);
+
+/*
+ * Scans the next len bytes of the mail.  A word may be split between
+ * two pieces.
+ */
+void scanner_feed(scanner_t *scanner, const char *buf, size_t len);
+
+/*
+ * Returns the number of distinct spamwords found so far in the mail.
+ * A word that runs to the end of the last piece is not counted until
+ * the mail is finished.
+ */
+int scanner_hits(scanner_t *scanner);
+
+/*
+ * Ends the mail, and returns the number of distinct spamwords in it.
+ * The scanner may then be fed the next mail.
+ */
+int scanner_finish(scanner_t *scanner);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef BAYES_H
+#define BAYES_H
+
+#include "set.h"
+
+/*
+ * The type of naive Bayes classifiers.  A classifier keeps, for every
+ * word it has seen, the number of spam mails and the number of nonspam
+ * mails containing it (the word's document frequencies), in a hash map.
+ *
+ * A mail is scored by summing, over its unique words, the log of the
+ * ratio between the (Laplace smoothed) probability of seeing the word
+ * in a spam mail and of seeing it in a nonspam mail, plus the log of the
+ * ratio between the numbers of spam and nonspam mails.  A positive score
+ * means the mail is more likely spam than not.
+ */
+typedef struct bayes bayes_t;
+
+/*
+ * Creates a new classifier that has seen no mails.
+ */
+bayes_t *bayes_create(void);
+
+/*
+ * Destroys the given classifier.
+ */
+void bayes_destroy(bayes_t *bayes);
+
+/*
+ * Counts one training mail, given as its set of unique words.  The words
+ * must be strings, and are copied as needed.
+ */
+void bayes_add(bayes_t *bayes, set_t *words, int spam);
+
+/*
+ * Adds the counts of the second classifier to the first, and destroys
+ * the second.  Used to combine classifiers trained on separate mails.
+ */
+void bayes_merge(bayes_t *bayes, bayes_t *other);
+
+/*
+ * Adds the given counts for one word, as if that many spam and nonspam
+ * mails containing it had been counted.  Used to restore saved counts.
+ */
+void bayes_addcounts(bayes_t *bayes, const char *word, int spam, int ham);
+
+/*
+ * Adds to the numbers of spam and nonspam mails counted, without
+ * counting any words.  Used to restore saved counts.
+ */
+void bayes_addmails(bayes_t *bayes, int spam, int ham);
+
+/*
+ * The type of functions passed the counts of each word.
+ */
+typedef void (*bayesfunc_t)(const char *word, int spam, int ham, void *ctx);
+
+/*
+ * Calls fn with the counts of every word, in no particular order.
+ */
+void bayes_foreach(bayes_t *bayes, bayesfunc_t fn, void *ctx);
+
+/*
+ * Returns the number of spam mails, or nonspam mails, counted.
+ */
+int bayes_mails(bayes_t *bayes, int spam);
+
+/*
+ * Returns the number of distinct words counted.
+ */
+int bayes_words(bayes_t *bayes);
+
+/*
+ * Returns the score of a mail, given as its set of unique words, which
+ * must be strings.
+ *
+ * The per-word log ratios are computed once, by the first call after
+ * the counts change, so that scoring a mail only takes one lookup per
+ * word.  Scoring is therefore only safe from several threads at once
+ * after the first call.
+ */
+double bayes_score(bayes_t *bayes, set_t *words);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "set.h"
+
+/*
+ * The type of manifest caches.  A manifest cache remembers, for every
+ * file it has seen, the file's modification time, size and content
+ * hash together with the set of unique words in it, and keeps this on
+ * disk between runs.  A file is only read again when its modification
+ * time or size has changed, and only tokenized again when its content
+ * has.
+ *
+ * cache_words() may be called from several threads at once.
+ */
+typedef struct cache cache_t;
+
+/*
+ * Opens the manifest cache stored in the given file.  If the file does
+ * not exist, or is not a valid cache, the cache starts out empty.
+ *
+ * Returns the cache, or NULL if the operation failed.
+ */
+cache_t *cache_open(char *filename);
+
+/*
+ * Writes the given cache back to its file, if it has changed.  Entries
+ * for files that no longer exist are dropped.
+ * Returns 1 on success, and 0 if the cache could not be written.
+ */
+int cache_save(cache_t *cache);
+
+/*
+ * Destroys the given cache without saving it.  The words handed out by
+ * the cache are destroyed too.
+ */
+void cache_close(cache_t *cache);
+
+/*
+ * Returns a new set holding the unique words in the given file, taken
+ * from the cache if the file is unchanged.  The words are lower-cased,
+ * and the set compares them using compare_strings().  The caller owns
+ * the set, but the words belong to the cache and stay valid until the
+ * cache is closed.
+ *
+ * Returns NULL if the file could not be read.
+ */
+set_t *cache_words(cache_t *cache, char *path);
+
+#endif
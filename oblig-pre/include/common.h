@@ -7,12 +7,29 @@
 #include <ctype.h>
 
 struct list;
+struct scheduler;
 
 /*
  * The type of comparison functions.
  */
 typedef int (*cmpfunc_t)(void *, void *);
 
+/*
+ * The type of functions that receive words from the tokenizer.
+ * The word is not NUL-terminated; it is len characters long.
+ */
+typedef void (*tokenfunc_t)(const char *word, size_t len, void *ctx);
+
+/*
+ * A word that refers to characters in a buffer owned by someone else,
+ * such as a memory-mapped file, instead of holding its own copy.
+ */
+typedef struct wordview
+{
+    const char *word;
+    size_t len;
+} wordview_t;
+
 
 /*
  * Reads the given file, and parses it into words (tokens).
@@ -25,15 +42,146 @@ typedef int (*cmpfunc_t)(void *, void *);
  */
 void tokenize_file(FILE *file, struct list *list);
 
+/*
+ * Tokenizer options, for the *_opt() variants of the tokenizer functions.
+ *
+ * TOKENIZE_FOLDCASE lower-cases every word once, as it is produced, so
+ * that the words can be compared with a plain byte comparison such as
+ * compare_strings() instead of a case-insensitive one.
+ *
+ * TOKENIZE_SCALAR scans with the portable scalar code even on CPUs that
+ * have a SIMD scanner, so that the two can be compared.
+ */
+#define TOKENIZE_FOLDCASE 0x1
+#define TOKENIZE_SCALAR 0x2
+
+/*
+ * Like tokenize_file(), but with the given tokenizer options.
+ */
+void tokenize_file_opt(FILE *file, struct list *list, int options);
+
+/*
+ * Reads the given file and parses it into words, like tokenize_file(),
+ * but passes each word to emit as soon as it is found instead of
+ * collecting the words in a list.  The word is only valid for the
+ * duration of the call; emit must copy it if it wants to keep it.
+ */
+void tokenize_file_cb(FILE *file, tokenfunc_t emit, void *ctx);
+
+/*
+ * Like tokenize_file_cb(), but with the given tokenizer options.
+ */
+void tokenize_file_cb_opt(FILE *file, tokenfunc_t emit, void *ctx, int options);
+
+/*
+ * Parses the len characters at buf into words, the same way as
+ * tokenize_file(), and passes each word to emit in order.  The words
+ * point into buf; nothing is copied.
+ */
+void tokenize_buffer(const char *buf, size_t len, tokenfunc_t emit, void *ctx);
+
+/*
+ * Like tokenize_buffer(), but with the given tokenizer options.  With
+ * TOKENIZE_FOLDCASE the words are folded in place, changing buf.
+ */
+void tokenize_buffer_opt(char *buf, size_t len, tokenfunc_t emit, void *ctx, int options);
+
+/*
+ * Like tokenize_buffer_opt(), but splits a large buffer into chunks at
+ * non-word characters and tokenizes the chunks as tasks of the given
+ * scheduler.  The words of all chunks are then passed to emit in the
+ * calling thread, in the order they occur in buf, so emit sees exactly
+ * what tokenize_buffer_opt() would pass it.  Small buffers, and
+ * schedulers of a single thread, are tokenized in one piece.
+ */
+void tokenize_buffer_parallel(char *buf, size_t len, tokenfunc_t emit, void *ctx, int options,
+                              struct scheduler *scheduler);
+
+/*
+ * The type of incremental tokenizers.  An incremental tokenizer parses
+ * text that arrives in pieces, such as the lines of a stream, the same
+ * way as tokenize_buffer() parses it in one piece: a word that is split
+ * between two pieces is still produced as one word.
+ */
+typedef struct tokenizer tokenizer_t;
+
+/*
+ * Creates an incremental tokenizer that passes each word it finds to
+ * emit, with the given tokenizer options.
+ */
+tokenizer_t *tokenizer_create(tokenfunc_t emit, void *ctx, int options);
+
+/*
+ * Parses the next len characters of the text.  Words that end in this
+ * piece are passed to emit before the call returns; a word that runs to
+ * the end of the piece is held until it ends.  With TOKENIZE_FOLDCASE
+ * the words are folded in place, changing buf.
+ */
+void tokenizer_feed(tokenizer_t *tokenizer, char *buf, size_t len);
+
+/*
+ * Ends the text, passing any word that is still held to emit.  The
+ * tokenizer may then be fed a new text.
+ */
+void tokenizer_finish(tokenizer_t *tokenizer);
+
+/*
+ * Destroys the given tokenizer.  A word that is still held is dropped.
+ */
+void tokenizer_destroy(tokenizer_t *tokenizer);
+
+/*
+ * Reads the whole of the given file into memory, and stores its length
+ * in size.  The contents are followed by one spare byte.
+ *
+ * Returns the contents, which the caller must free, or NULL if the file
+ * could not be read.
+ */
+char *read_file(char *path, size_t *size);
+
 /*
  * Recursively finds the names of all files under the given root directory.
- * Returns the file names as a list of strings.
+ * Returns the file names as a list of strings, sorted with strcmp().
+ *
+ * Only regular files are returned.  Symbolic links to files are
+ * included, but symbolic links to directories are not followed.
  */
 struct list *find_files(char *root);
 
+/*
+ * The type of directory walkers.  A walker reads a directory tree with
+ * a pool of threads, and hands out the names of the regular files in
+ * it as they are discovered, in no particular order.
+ */
+typedef struct walker walker_t;
+
+/*
+ * Starts walking the tree under the given root directory, using the
+ * given number of threads.
+ */
+walker_t *walk_start(char *root, int nthreads);
+
+/*
+ * Returns the next file name found by the given walker, waiting for
+ * one if necessary, or NULL once the whole tree has been walked.
+ * The caller owns the returned string.
+ */
+char *walk_next(walker_t *walker);
+
+/*
+ * Stops the given walker, if it is still running, and destroys it.
+ */
+void walk_destroy(walker_t *walker);
+
 /* 
  * Compares two strings using strcmp().
  */
 int compare_strings(void *a, void *b);
 
+/*
+ * Compares two word views, ignoring case.  Orders words the same way
+ * as strcasecmp() does for NUL-terminated words.
+ */
+int compare_views(void *a, void *b);
+
 #endif
@@ -0,0 +1,101 @@
+#ifndef CSET_H
+#define CSET_H
+
+#include "set.h"
+
+/*
+ * The type of concurrent sets.  A concurrent set holds a snapshot: a
+ * plain set_t that is never changed once it is published.  Any number
+ * of threads may read the current snapshot without locking, while a
+ * writer changes a copy of it and then swaps the copy in (read-copy-
+ * update).  A replaced snapshot is destroyed once the last reader that
+ * may still see it is done with it.
+ *
+ * Readers only touch a counter of their own, so reads scale with the
+ * number of threads; writers copy the whole set, so concurrent sets
+ * suit sets that are read far more often than they change, such as the
+ * spamwords of a model being served.
+ *
+ * A snapshot may carry data along with it, such as what was compiled
+ * from the set, so that readers get a set and its data that belong
+ * together, and the data is only destroyed with the snapshot.
+ */
+typedef struct cset cset_t;
+
+/*
+ * The type of functions that destroy the data of a snapshot.
+ */
+typedef void (*cset_freefunc_t)(void *data);
+
+/*
+ * Creates a concurrent set whose first snapshot is the given set, which
+ * the concurrent set takes over.
+ */
+cset_t *cset_create(set_t *set);
+
+/*
+ * Like cset_create(), but the first snapshot carries the given data.
+ * The data of every snapshot is passed to destroy, unless it is NULL,
+ * once no reader can see the snapshot any more.
+ */
+cset_t *cset_create_data(set_t *set, void *data, cset_freefunc_t destroy);
+
+/*
+ * Destroys the given concurrent set and its snapshot.  No thread may
+ * be reading it.
+ */
+void cset_destroy(cset_t *cset);
+
+/*
+ * Starts reading the given concurrent set, and returns its current
+ * snapshot.  The snapshot, and iterators over it, may be used until
+ * cset_release() is called with the token stored in token.  Reads may
+ * be nested, but must be released in reverse order.
+ */
+set_t *cset_acquire(cset_t *cset, int *token);
+
+/*
+ * Stops reading a snapshot acquired with cset_acquire().
+ */
+void cset_release(cset_t *cset, int token);
+
+/*
+ * Like cset_acquire(), but also stores the data of the snapshot in data.
+ */
+set_t *cset_acquire_data(cset_t *cset, int *token, void **data);
+
+/*
+ * Returns 1 if the given element is contained in the current snapshot
+ * of the given concurrent set, 0 otherwise.
+ */
+int cset_contains(cset_t *cset, void *elem);
+
+/*
+ * Returns the size of the current snapshot of the given concurrent set.
+ */
+int cset_size(cset_t *cset);
+
+/*
+ * Adds the given element to the given concurrent set, by publishing a
+ * copy of the current snapshot with the element added.  Readers see
+ * either the old snapshot or the new one.  Like cset_swap(), it waits
+ * for readers, so the calling thread must not be reading the set.  The
+ * new snapshot carries the data of the old one.
+ */
+void cset_add(cset_t *cset, void *elem);
+
+/*
+ * Replaces the snapshot of the given concurrent set with the given set,
+ * which the concurrent set takes over.  Returns once no reader can see
+ * the old snapshot any more, after destroying it.  The new snapshot
+ * carries the data of the old one.
+ */
+void cset_swap(cset_t *cset, set_t *set);
+
+/*
+ * Like cset_swap(), but the new snapshot carries the given data, and the
+ * data of the old one is destroyed with it.
+ */
+void cset_swap_data(cset_t *cset, set_t *set, void *data);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "set.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The type of deduplication caches.  A deduplication cache remembers
+ * the spamword counts of recently classified mails by the XXH64 hash of
+ * their content, so that a mail seen before is answered without being
+ * scanned again.  Once the cache is full, the least recently used mail
+ * is forgotten.
+ *
+ * The counts depend on the spamword set they were taken with, so a
+ * cache is tied to one set; a saved cache is only reused with the set
+ * it was made with.
+ *
+ * dedup_get() and dedup_put() may be called from several threads at
+ * once.
+ */
+typedef struct dedup dedup_t;
+
+/*
+ * Creates a deduplication cache holding up to capacity mails, for counts
+ * taken with the given spamword set.  If filename is not NULL, the cache
+ * starts out with the mails saved in that file, if it exists and was
+ * made with the same spamword set, and dedup_save() writes it back.
+ *
+ * Returns the cache, or NULL if the operation failed.
+ */
+dedup_t *dedup_open(char *filename, int capacity, set_t *spamwords);
+
+/*
+ * Writes the given cache back to its file, if it has one and has
+ * changed.  Returns 1 on success, and 0 if the cache could not be
+ * written.
+ */
+int dedup_save(dedup_t *dedup);
+
+/*
+ * Destroys the given cache without saving it.
+ */
+void dedup_destroy(dedup_t *dedup);
+
+/*
+ * Returns the hash a mail with the given content is known by.
+ */
+uint64_t dedup_hash(const void *data, size_t len);
+
+/*
+ * Looks up the mail with the given hash.  Returns 1 and stores its
+ * spamword count in count if the mail is in the cache, and 0 otherwise.
+ */
+int dedup_get(dedup_t *dedup, uint64_t hash, int *count);
+
+/*
+ * Remembers the spamword count of the mail with the given hash.
+ */
+void dedup_put(dedup_t *dedup, uint64_t hash, int count);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef DOCUMENT_H
+#define DOCUMENT_H
+
+#include "set.h"
+
+/*
+ * The type of documents.  A document is a memory-mapped file together
+ * with the set of unique words in it.  The words are wordview_t's that
+ * point straight into the mapping, so the words stay valid for exactly
+ * as long as the document does.
+ */
+typedef struct document document_t;
+
+/*
+ * Memory-maps the given file and tokenizes it.  The word set of the
+ * returned document compares its elements using compare_views().
+ *
+ * Returns NULL if the file could not be opened or mapped.
+ */
+document_t *document_map(char *filename);
+
+/*
+ * Destroys the given document, along with its word set and the views
+ * in it, and unmaps the file.  Sets that share elements with the
+ * document's word set must not be used afterwards.
+ */
+void document_destroy(document_t *doc);
+
+/*
+ * Returns the set of unique words in the given document.
+ */
+set_t *document_words(document_t *doc);
+
+#endif
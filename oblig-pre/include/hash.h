@@ -0,0 +1,24 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The type of hash functions.
+ */
+typedef uint64_t (*hashfunc_t)(void *);
+
+/*
+ * Returns the 64-bit xxHash (XXH64) of the len bytes at data, computed
+ * with the given seed.  This is a fast, non-cryptographic hash, fit for
+ * hash tables and for telling whether a file's content has changed.
+ */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+/*
+ * Hashes a NUL-terminated string.
+ */
+uint64_t hash_string(void *str);
+
+#endif
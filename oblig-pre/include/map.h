@@ -0,0 +1,84 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "common.h"
+#include "hash.h"
+
+/*
+ * The type of maps.  A map is a hash table that associates keys with
+ * values.
+ */
+typedef struct map map_t;
+
+/*
+ * Creates a new, empty map.  The hash function is used to hash keys,
+ * and the comparison function to check keys for equality; it returns
+ * 0 if the keys are equal.
+ *
+ * Returns the new map, or NULL if the operation failed.
+ */
+map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc);
+
+/*
+ * Destroys the given map.  The keys and values are not destroyed.
+ */
+void map_destroy(map_t *map);
+
+/*
+ * Returns the number of keys in the given map.
+ */
+int map_size(map_t *map);
+
+/*
+ * Associates the given value with the given key, replacing any value
+ * the key had.  If the key was already in the map, the key originally
+ * stored is kept.
+ */
+void map_put(map_t *map, void *key, void *value);
+
+/*
+ * Returns the value associated with the given key, or NULL if the key
+ * is not in the map.
+ */
+void *map_get(map_t *map, void *key);
+
+/*
+ * Returns 1 if the given key is in the given map, 0 otherwise.
+ */
+int map_haskey(map_t *map, void *key);
+
+/*
+ * Removes the given key from the given map.  Returns the key as it was
+ * stored in the map, or NULL if the key was not in the map.
+ */
+void *map_remove(map_t *map, void *key);
+
+/*
+ * The type of map iterators.  Iterators visit the keys of a map in no
+ * particular order.  The map must not be changed while it is iterated.
+ */
+typedef struct map_iter map_iter_t;
+
+/*
+ * Creates a new map iterator for iterating over the given map.
+ */
+map_iter_t *map_createiter(map_t *map);
+
+/*
+ * Destroys the given map iterator.
+ */
+void map_destroyiter(map_iter_t *iter);
+
+/*
+ * Returns 0 if the given map iterator has reached the end of the map,
+ * or 1 otherwise.
+ */
+int map_hasnext(map_iter_t *iter);
+
+/*
+ * Returns the next key in the sequence represented by the given map
+ * iterator.
+ */
+void *map_next(map_iter_t *iter);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef MBOX_H
+#define MBOX_H
+
+#include "common.h"
+
+#include <stdio.h>
+
+/*
+ * The type of functions called at the end of each message of an mbox.
+ * The message is numbered from 1.
+ */
+typedef void (*mboxfunc_t)(int message, void *ctx);
+
+/*
+ * Reads the given mbox stream, and tokenizes the messages in it one at
+ * a time, with the given tokenizer options.  Messages start at lines
+ * beginning with "From "; the "From " line itself is not part of the
+ * message.  Text before the first such line, if any, is taken as a
+ * message of its own, so that a single mail without a "From " line is
+ * read as one message.
+ *
+ * The words of each message are passed to emit, and done is called as
+ * soon as the message ends.  The stream is read in blocks of fixed
+ * size, so memory use does not depend on the size of the stream or of
+ * its messages.
+ *
+ * Messages are tokenized one after another on the calling thread.  An
+ * mbox is not split into tasks for the scheduler, however large it is:
+ * neither here nor by tokenize_buffer_parallel(), which only the
+ * trainer uses.
+ *
+ * Returns the number of messages read.
+ */
+int mbox_tokenize(FILE *file, tokenfunc_t emit, mboxfunc_t done, void *ctx, int options);
+
+#endif
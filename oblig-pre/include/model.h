@@ -0,0 +1,92 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include "bayes.h"
+#include "set.h"
+
+/*
+ * The type of trained models.  A model holds the word counts of the
+ * training mails: for every (lower-cased) word, the number of spam mails
+ * and the number of nonspam mails that contain it.  The refined
+ * spamword set follows from the counts: the words found in every spam
+ * mail and in no nonspam mail.
+ *
+ * Models are saved to, and loaded from, a compact model file, so that
+ * mails can be classified without retraining, and so that new training
+ * mails can be counted without recounting the old ones.
+ */
+typedef struct model model_t;
+
+/*
+ * Writes the given word counts to the given model file, replacing it.
+ * Returns 1 on success, and 0 if the file could not be written, in
+ * which case any old file is left as it was.
+ */
+int model_save(char *filename, bayes_t *counts);
+
+/*
+ * Loads the model in the given file.
+ *
+ * Returns the model, or NULL if the file could not be read or is not a
+ * valid model.  Model files written before the counts were kept hold
+ * only the refined spamword set, and are still loaded.
+ */
+model_t *model_load(char *filename);
+
+/*
+ * Destroys the given model, along with its spamword set.
+ */
+void model_destroy(model_t *model);
+
+/*
+ * Returns the refined spamword set of the given model, as it was when
+ * the model was loaded.  The set compares its words using
+ * compare_strings().
+ */
+set_t *model_spamwords(model_t *model);
+
+/*
+ * Returns the word counts of the given model, or NULL if its file holds
+ * only a spamword set.  The counts may be changed and saved again with
+ * model_save().
+ */
+bayes_t *model_counts(model_t *model);
+
+/*
+ * The type of spamword counters.  A counter is fed the words of a mail
+ * as they are tokenized, and counts the distinct spamwords among them
+ * without keeping the mail's other words.
+ */
+typedef struct spamcount spamcount_t;
+
+/*
+ * Creates a counter for the given spamword set, which must compare
+ * lower-cased strings using compare_strings().
+ */
+spamcount_t *spamcount_create(set_t *spamwords);
+
+/*
+ * Counts the given word; a tokenfunc_t taking the counter as its
+ * context.  The word must be lower-cased and at most 100 characters
+ * long, as produced by the tokenizer with TOKENIZE_FOLDCASE.
+ */
+void spamcount_word(const char *word, size_t len, void *counter);
+
+/*
+ * Returns the number of distinct spamwords counted since the counter
+ * was created or last reset.
+ */
+int spamcount_hits(spamcount_t *counter);
+
+/*
+ * Returns the number of distinct spamwords counted since the counter
+ * was created or last reset, and resets it for the next mail.
+ */
+int spamcount_reset(spamcount_t *counter);
+
+/*
+ * Destroys the given counter.
+ */
+void spamcount_destroy(spamcount_t *counter);
+
+#endif
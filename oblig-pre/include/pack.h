@@ -0,0 +1,54 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include "list.h"
+#include "set.h"
+
+/*
+ * The type of corpus packs.  A pack is a single file holding a whole
+ * corpus in pre-tokenized form: a dictionary of all the (lower-cased)
+ * words in the corpus, and for each document its name and the sorted
+ * IDs of the unique words in it.  Packs are memory-mapped when opened,
+ * so reading a document needs neither a file open nor tokenization.
+ */
+typedef struct pack pack_t;
+
+/*
+ * Tokenizes the given files and writes them to a new pack in the given
+ * file.  Returns 1 on success, and 0 if the pack could not be written.
+ */
+int pack_write(char *filename, list_t *files);
+
+/*
+ * Opens and memory-maps the given pack file.
+ *
+ * Returns the pack, or NULL if the file could not be opened or is not
+ * a valid pack.
+ */
+pack_t *pack_open(char *filename);
+
+/*
+ * Closes the given pack.  Words taken from the pack must not be used
+ * afterwards.
+ */
+void pack_close(pack_t *pack);
+
+/*
+ * Returns the number of documents in the given pack.
+ */
+int pack_size(pack_t *pack);
+
+/*
+ * Returns the name of the given document, that is, the name of the
+ * file it was made from.
+ */
+char *pack_docname(pack_t *pack, int doc);
+
+/*
+ * Returns a new set holding the unique words in the given document.
+ * The set compares its words using compare_strings(); the words point
+ * into the pack and stay valid until the pack is closed.
+ */
+set_t *pack_docwords(pack_t *pack, int doc);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "automaton.h"
+#include "dedup.h"
+
+/*
+ * Thread counts for the stages of the classification pipeline, and the
+ * number of mails that may wait between two stages.
+ */
+typedef struct pipeline_config
+{
+    int walkers;  /* Threads walking the directory tree */
+    int readers;  /* Threads reading mails into memory */
+    int scanners; /* Threads scanning mails for spamwords */
+    int depth;    /* Capacity of the queues between the stages */
+} pipeline_config_t;
+
+/*
+ * The type of functions that are handed the verdict on one mail.  With
+ * partial set, the mail was not scanned to the end, and count is only a
+ * lower bound.
+ */
+typedef void (*resultfunc_t)(char *path, int count, int partial, void *ctx);
+
+/*
+ * Classifies the mails under the given directory in a pipeline of
+ * stages connected by bounded queues:
+ *
+ *   walk -> read -> scan -> output
+ *
+ * The walkers find the mails, the readers read each one into memory, and
+ * the scanners count its spamwords with the automaton; every stage runs
+ * in its own threads, and a full queue holds back the stage feeding it.
+ * The output stage runs in the calling thread, and passes the count of
+ * each mail to done as soon as it is known, so mails are reported in no
+ * particular order.
+ *
+ * Mails found in the dedup cache, if not NULL, are not scanned.  With
+ * threshold greater than 0, a mail is only scanned until that many
+ * spamwords are found.
+ */
+void pipeline_classify(char *root, automaton_t *automaton, dedup_t *dedup, int threshold,
+                       pipeline_config_t *config, resultfunc_t done, void *ctx);
+
+#endif
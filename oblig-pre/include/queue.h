@@ -0,0 +1,48 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/*
+ * The type of queues.  A queue is a FIFO of elements that may be shared
+ * between threads.  Bounded queues are lock-free rings: threads only
+ * take a lock to sleep while the queue is full or empty.  Unbounded
+ * queues lock the queue in every operation.
+ */
+typedef struct queue queue_t;
+
+/*
+ * Creates a new, empty queue holding at most capacity elements.
+ * A capacity of 0 means that the queue is unbounded; bounded queues
+ * hold at least two elements.
+ *
+ * Returns the new queue, or NULL if the operation failed.
+ */
+queue_t *queue_create(int capacity);
+
+/*
+ * Destroys the given queue.  Elements still in the queue are not
+ * destroyed.  No thread may be using the queue.
+ */
+void queue_destroy(queue_t *queue);
+
+/*
+ * Adds the given element to the end of the given queue, waiting for
+ * room if the queue is full.  The element must not be NULL.
+ * Returns 1 on success, and 0 if the queue has been closed.
+ */
+int queue_push(queue_t *queue, void *elem);
+
+/*
+ * Removes and returns the first element of the given queue, waiting
+ * for one to arrive if the queue is empty.  Returns NULL once the queue
+ * has been closed and is empty.
+ */
+void *queue_pop(queue_t *queue);
+
+/*
+ * Closes the given queue.  Elements already in the queue can still be
+ * popped, but no more elements can be pushed, and threads waiting on
+ * an empty queue are woken up.
+ */
+void queue_close(queue_t *queue);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stddef.h>
+
+/*
+ * The type of file readers.  A reader reads a list of files into memory
+ * with many reads in flight at once, and hands out each file's contents
+ * as soon as they have been read, in no particular order.
+ *
+ * Reads go through io_uring where the kernel allows it, and through a
+ * pool of threads doing blocking reads otherwise.  Add -DNO_IO_URING to
+ * CFLAGS to always use the threads.
+ */
+typedef struct reader reader_t;
+
+/*
+ * The contents of one file, as handed out by a reader.
+ */
+typedef struct readbuf
+{
+    int index;  /* Index of the file in the list given to the reader */
+    char *data; /* The contents, owned by the caller; NULL on failure */
+    size_t len;
+    int error;  /* errno value when the file could not be read */
+} readbuf_t;
+
+/*
+ * Starts reading the given files, keeping up to depth reads in flight.
+ * The list of names must outlive the reader.
+ */
+reader_t *reader_start(char **files, int nfiles, int depth);
+
+/*
+ * Waits for the next file to be read, and stores it in buf.  Returns 1,
+ * or 0 once every file has been handed out.  May be called from several
+ * threads at once.
+ */
+int reader_next(reader_t *reader, readbuf_t *buf);
+
+/*
+ * Stops the given reader and destroys it.  Files not yet handed out are
+ * dropped.
+ */
+void reader_destroy(reader_t *reader);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/*
+ * The type of work-stealing schedulers.  A scheduler runs tasks on a
+ * pool of threads, each with its own deque of tasks (a Chase-Lev
+ * deque): a thread pushes the tasks it spawns onto its own deque and
+ * takes them back newest first, and a thread that runs dry steals the
+ * oldest task of another.  Large jobs that split themselves into
+ * subtasks are thus spread over idle threads as they need it.
+ */
+typedef struct scheduler scheduler_t;
+
+/*
+ * The type of task groups.  A task group counts the tasks spawned into
+ * it that have not finished yet, so that they can be waited for.
+ */
+typedef struct taskgroup taskgroup_t;
+
+/*
+ * The type of tasks.
+ */
+typedef void (*taskfunc_t)(void *arg);
+
+/*
+ * Creates a scheduler that runs tasks on nthreads threads: nthreads - 1
+ * threads of its own, and the thread waiting for them.  With nthreads
+ * of 1, tasks only run while they are waited for.
+ *
+ * Returns the new scheduler, or NULL if the operation failed.
+ */
+scheduler_t *scheduler_create(int nthreads);
+
+/*
+ * Stops the threads of the given scheduler and destroys it.  All tasks
+ * must have been waited for.
+ */
+void scheduler_destroy(scheduler_t *scheduler);
+
+/*
+ * Returns the number of threads the given scheduler runs tasks on.
+ */
+int scheduler_threads(scheduler_t *scheduler);
+
+/*
+ * Creates a new, empty task group.
+ */
+taskgroup_t *taskgroup_create(void);
+
+/*
+ * Destroys the given task group.  Its tasks must have been waited for.
+ */
+void taskgroup_destroy(taskgroup_t *group);
+
+/*
+ * Spawns a task that calls func(arg) into the given group.  Tasks may
+ * be spawned from any thread, including from running tasks.
+ */
+void scheduler_spawn(scheduler_t *scheduler, taskgroup_t *group, taskfunc_t func, void *arg);
+
+/*
+ * Waits until every task spawned into the given group has finished,
+ * running tasks of the group that no other thread has taken yet in the
+ * meantime.  Tasks of other groups are left to the scheduler's threads.
+ * Tasks must be waited for by the thread that spawned them, before any
+ * task it runs returns.
+ */
+void scheduler_wait(scheduler_t *scheduler, taskgroup_t *group);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "dedup.h"
+#include "set.h"
+
+/*
+ * Runs the classification daemon: listens on a Unix domain socket at
+ * the given path, and classifies mails sent by clients against the
+ * given spamword set, which must compare lower-cased strings using
+ * compare_strings().  Up to nthreads clients are served at once.
+ *
+ * Clients send one request per line, and get one line back:
+ *
+ *   FILE <path>           classify the mail in the given file
+ *   MAIL <name> <length>  classify the <length> bytes following the line
+ *   STATS                 report the request count, p50/p99 latency and
+ *                         the number of spamwords
+ *   QUIT                  close the connection
+ *
+ * Verdicts have the same format as spamfilter-expected.txt, such as
+ * "mail/mail3.txt: 1 spam word(s) -> SPAM"; a mail with at least
+ * threshold spamwords is spam.  Failed requests are answered with a
+ * line starting with "ERROR".  Only the owner of the process may
+ * connect to the socket, since FILE reads whatever the server can.
+ *
+ * If dedup is not NULL, mails already classified are answered from it.
+ *
+ * If modelfile is not NULL, the spamwords were loaded from it, and the
+ * model is loaded again when the process gets SIGHUP.  Clients are
+ * served without interruption: mails being classified finish with the
+ * old model, and later ones use the new one.  If the file is not a
+ * valid model, the old one is kept.  The dedup cache is not used after
+ * a reload, since its counts depend on the spamwords.
+ *
+ * Returns when the process gets SIGINT or SIGTERM, after cutting off
+ * the clients still connected, waiting for the threads serving them,
+ * and printing the latency statistics.  Returns 0 on a clean shutdown,
+ * and 1 if the socket could not be set up.
+ */
+int server_run(char *socketpath, char *modelfile, set_t *spamwords, int threshold, dedup_t *dedup,
+               int nthreads);
+
+#endif
@@ -3,6 +3,7 @@
 #define SET_H
 
 #include "common.h"
+#include "scheduler.h"
 
 /*
  * The type of sets.
@@ -64,6 +65,21 @@ set_t *set_difference(set_t *a, set_t *b);
  */
 set_t *set_copy(set_t *set);
 
+/*
+ * Returns 1 if this set implementation lets several threads call
+ * set_add() and set_contains() on the same set at once, 0 otherwise.
+ */
+int set_threadsafe(void);
+
+/*
+ * Lets set operations on large sets run as tasks on the given scheduler,
+ * if this set implementation can split them, or makes them run on the
+ * calling thread only if scheduler is NULL, as they do by default.  The
+ * scheduler is owned by the caller, and must not be destroyed while it
+ * is in use.
+ */
+void set_usescheduler(scheduler_t *scheduler);
+
 /*
  * The type of set iterators.
  */
@@ -0,0 +1,96 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Instrumentation: named timers and counters for the stages of a run,
+ * reported at the end of it.  Everything is off until stats_enable() is
+ * called; until then, the macros below cost one predictable branch.
+ *
+ * Timers and counters may be updated from several threads at once.  A
+ * timer that runs in several threads adds up their time, so it may
+ * exceed the elapsed time of the run.
+ */
+
+/*
+ * Timers.  Each keeps the number of calls timed and their total time.
+ */
+typedef enum stat_timer
+{
+    TIMER_FIND_FILES,
+    TIMER_TOKENIZE,
+    TIMER_UNION,
+    TIMER_INTERSECTION,
+    TIMER_DIFFERENCE,
+    TIMER_TRAIN,
+    TIMER_CLASSIFY,
+    NUM_TIMERS
+} stat_timer_t;
+
+/*
+ * Counters.
+ */
+typedef enum stat_counter
+{
+    COUNTER_FILES,       /* Files found by find_files() */
+    COUNTER_BYTES,       /* Bytes read by the tokenizer and scanners */
+    COUNTER_TOKENS,      /* Words produced by the tokenizer */
+    COUNTER_SET_ADD,     /* Calls to set_add() */
+    COUNTER_COMPARISONS, /* Calls to the comparison functions */
+    COUNTER_MAILS,       /* Mails classified */
+    COUNTER_DEDUP_HITS,  /* Mails answered by the deduplication cache */
+    NUM_COUNTERS
+} stat_counter_t;
+
+/*
+ * Set once instrumentation is enabled.
+ */
+extern int stats_enabled;
+
+/*
+ * Turns instrumentation on.  Must be called before any other threads
+ * are started.
+ */
+void stats_enable(void);
+
+/*
+ * Adds n to the given counter.
+ */
+void stats_add(stat_counter_t counter, uint64_t n);
+
+/*
+ * Returns the time to pass to stats_stop(), in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/*
+ * Adds the time since start, as returned by stats_now(), to the given
+ * timer, and counts one call.
+ */
+void stats_stop(stat_timer_t timer, uint64_t start);
+
+/*
+ * Writes every timer and counter to the given stream, either as a table
+ * or, with json set, as a JSON object.
+ */
+void stats_print(FILE *out, int json);
+
+#define STATS_COUNT(counter, n)          \
+    do                                   \
+    {                                    \
+        if (stats_enabled)               \
+            stats_add((counter), (n));   \
+    } while (0)
+
+#define STATS_START() (stats_enabled ? stats_now() : 0)
+
+#define STATS_STOP(timer, start)          \
+    do                                    \
+    {                                     \
+        if (stats_enabled)                \
+            stats_stop((timer), (start)); \
+    } while (0)
+
+#endif
@@ -0,0 +1,354 @@
+#include "automaton.h"
+#include "common.h"
+#include "list.h"
+#include "printing.h"
+#include "set.h"
+
+#include <stdlib.h>
+
+/*
+ * Parameters for the test cases:
+ * TEST_CORPUS is the directory of mails to scan; the mails under
+ * TEST_CORPUS/spam and TEST_CORPUS/nonspam train spamwords the way
+ * spamfilter does
+ * TEST_PIECES are the sizes of the pieces a mail is fed to a scanner in,
+ * where 0 feeds the mail in one piece
+ * TEST_NPIECES is the number of sizes in TEST_PIECES
+ */
+
+#define TEST_CORPUS "data"
+#define TEST_PIECES {0, 1, 7, 100, 101, 4096}
+#define TEST_NPIECES 6
+
+/*
+ * A mail of the corpus: its text, as read from the file, and the set of
+ * words the tokenizer finds in it.
+ */
+typedef struct mail
+{
+    char *filename;
+    char *text;
+    size_t len;
+    set_t *words;
+} mail_t;
+
+static mail_t *mails;
+static int nmails;
+
+/*
+ * Adds a word to the word set, unless it is already there.
+ */
+static void addword(const char *word, size_t len, void *ctx)
+{
+    set_t *wordset = ctx;
+    char buf[101];
+    char *copy;
+
+    memcpy(buf, word, len);
+    buf[len] = 0;
+    if (!set_contains(wordset, buf))
+    {
+        copy = strdup(buf);
+        if (copy == NULL)
+            ERROR_PRINT("out of memory\n");
+        set_add(wordset, copy);
+    }
+}
+
+/*
+ * Returns the set of lower-cased words the tokenizer finds in the given
+ * text.  The text itself is left as it was.
+ */
+static set_t *tokenize_text(const char *text, size_t len)
+{
+    set_t *words = set_create(compare_strings);
+    char *copy = malloc(len + 1);
+
+    if (copy == NULL)
+        ERROR_PRINT("out of memory\n");
+    memcpy(copy, text, len);
+    tokenize_buffer_opt(copy, len, addword, words, TOKENIZE_FOLDCASE);
+    free(copy);
+    return words;
+}
+
+/*
+ * Destroys a word set made by tokenize_text(), and its words.
+ */
+static void destroy_words(set_t *words)
+{
+    set_iter_t *iter = set_createiter(words);
+
+    while (set_hasnext(iter))
+        free(set_next(iter));
+    set_destroyiter(iter);
+    set_destroy(words);
+}
+
+/*
+ * Returns the number of words in the given set that are spamwords,
+ * counted the way spamfilter counts them without an automaton.
+ */
+static int count_spamwords(set_t *words, set_t *spamwords)
+{
+    set_iter_t *iter = set_createiter(words);
+    int count = 0;
+
+    while (set_hasnext(iter))
+    {
+        if (set_contains(spamwords, set_next(iter)))
+            count++;
+    }
+    set_destroyiter(iter);
+    return count;
+}
+
+/*
+ * Scans the given text with the scanner, fed in pieces of the given size,
+ * or in one piece if size is 0.  Returns the number of distinct
+ * spamwords found, or -1 if the scanner counted more spamwords before
+ * the end of the text than after it.
+ */
+static int scan(scanner_t *scanner, const char *text, size_t len, size_t size)
+{
+    size_t pos, n;
+    int hits, count;
+
+    if (size == 0)
+        size = len;
+    for (pos = 0; pos < len; pos += n)
+    {
+        n = len - pos < size ? len - pos : size;
+        scanner_feed(scanner, text + pos, n);
+    }
+    hits = scanner_hits(scanner);
+    count = scanner_finish(scanner);
+    return hits > count ? -1 : count;
+}
+
+/*
+ * Validates that an automaton compiled from the given spamwords counts
+ * the same spamwords in each text as set_contains() does on the words
+ * of the text, however the text is split into pieces.  One scanner scans
+ * every text, so that it is also checked to start each mail afresh.
+ */
+static void check_automaton(char *name, set_t *spamwords, mail_t *texts, int ntexts)
+{
+    size_t pieces[TEST_NPIECES] = TEST_PIECES;
+    automaton_t *automaton = automaton_create(spamwords);
+    scanner_t *scanner;
+    int i, j, expected, count;
+
+    if (automaton == NULL)
+        ERROR_PRINT("automaton_create does not return a valid memory address\n");
+    scanner = scanner_create(automaton);
+    if (scanner == NULL)
+        ERROR_PRINT("scanner_create does not return a valid memory address\n");
+
+    for (i = 0; i < TEST_NPIECES; i++)
+    {
+        for (j = 0; j < ntexts; j++)
+        {
+            expected = count_spamwords(texts[j].words, spamwords);
+            count = scan(scanner, texts[j].text, texts[j].len, pieces[i]);
+            if (count != expected)
+                ERROR_PRINT("Scanning %s for %s spamwords in pieces of %zu found %d, expected %d, check scanner_feed\n",
+                            texts[j].filename, name, pieces[i], count, expected);
+        }
+    }
+    scanner_destroy(scanner);
+    automaton_destroy(automaton);
+}
+
+/*
+ * Reads every mail under the corpus directory, and tokenizes it.
+ */
+static void load_corpus(void)
+{
+    list_t *files = find_files(TEST_CORPUS);
+    int i;
+
+    if (files == NULL || list_size(files) == 0)
+        ERROR_PRINT("No mails under %s, run the test from the top directory\n", TEST_CORPUS);
+    nmails = list_size(files);
+    mails = malloc(nmails * sizeof(mail_t));
+    if (mails == NULL)
+        ERROR_PRINT("out of memory\n");
+    for (i = 0; i < nmails; i++)
+    {
+        mails[i].filename = list_popfirst(files);
+        mails[i].text = read_file(mails[i].filename, &mails[i].len);
+        if (mails[i].text == NULL)
+            ERROR_PRINT("Could not read %s\n", mails[i].filename);
+        mails[i].words = tokenize_text(mails[i].text, mails[i].len);
+    }
+    list_destroy(files);
+}
+
+static void unload_corpus(void)
+{
+    int i;
+
+    for (i = 0; i < nmails; i++)
+    {
+        free(mails[i].filename);
+        free(mails[i].text);
+        destroy_words(mails[i].words);
+    }
+    free(mails);
+}
+
+/*
+ * Returns the spamwords trained from the spam and nonspam mails of the
+ * corpus: the words in every spam mail and in no nonspam mail.
+ * The words belong to the mails.
+ */
+static set_t *train_spamwords(void)
+{
+    set_t *spamwords = NULL, *nonspamwords = set_create(compare_strings), *tmp;
+    char *spam = TEST_CORPUS "/spam/", *nonspam = TEST_CORPUS "/nonspam/";
+    int i;
+
+    for (i = 0; i < nmails; i++)
+    {
+        if (strncmp(mails[i].filename, spam, strlen(spam)) == 0)
+        {
+            tmp = spamwords;
+            spamwords = spamwords == NULL ? set_copy(mails[i].words)
+                                          : set_intersection(spamwords, mails[i].words);
+            if (tmp != NULL)
+                set_destroy(tmp);
+        }
+        else if (strncmp(mails[i].filename, nonspam, strlen(nonspam)) == 0)
+        {
+            tmp = nonspamwords;
+            nonspamwords = set_union(nonspamwords, mails[i].words);
+            set_destroy(tmp);
+        }
+    }
+    if (spamwords == NULL)
+        ERROR_PRINT("No spam mails under %s\n", spam);
+
+    tmp = spamwords;
+    spamwords = set_difference(spamwords, nonspamwords);
+    set_destroy(tmp);
+    set_destroy(nonspamwords);
+    return spamwords;
+}
+
+/*
+ * Returns every nth word of the corpus, starting with word first.  The
+ * words belong to the mails.
+ */
+static set_t *every_nth_word(int n, int first)
+{
+    set_t *vocabulary = set_create(compare_strings), *words = set_create(compare_strings), *tmp;
+    set_iter_t *iter;
+    int i;
+
+    for (i = 0; i < nmails; i++)
+    {
+        tmp = vocabulary;
+        vocabulary = set_union(vocabulary, mails[i].words);
+        set_destroy(tmp);
+    }
+    iter = set_createiter(vocabulary);
+    for (i = 0; set_hasnext(iter); i++)
+    {
+        void *word = set_next(iter);
+
+        if (i % n == first)
+            set_add(words, word);
+    }
+    set_destroyiter(iter);
+    set_destroy(vocabulary);
+    return words;
+}
+
+/*
+ * Validates that automata count the spamwords of every mail in the
+ * corpus like set_contains() does, for spamword sets from empty, to
+ * trained, to every word of the corpus
+ */
+
+void validate_corpus(void)
+{
+    set_t *spamwords;
+
+    spamwords = set_create(compare_strings);
+    check_automaton("no", spamwords, mails, nmails);
+    set_destroy(spamwords);
+
+    spamwords = train_spamwords();
+    if (set_size(spamwords) == 0)
+        ERROR_PRINT("No spamwords trained from %s\n", TEST_CORPUS);
+    check_automaton("trained", spamwords, mails, nmails);
+    set_destroy(spamwords);
+
+    spamwords = every_nth_word(2, 1);
+    check_automaton("every other", spamwords, mails, nmails);
+    set_destroy(spamwords);
+
+    spamwords = every_nth_word(1, 0);
+    check_automaton("all", spamwords, mails, nmails);
+    set_destroy(spamwords);
+}
+
+/*
+ * Validates the corners of matching on a made-up mail: case, words
+ * within words, punctuation, and words longer than 100 characters,
+ * which the tokenizer splits into pieces of 100
+ */
+
+void validate_words(void)
+{
+    char *spamwords_text = "viagra free 4u cheap-pills cash";
+    char text[1024];
+    set_t *spamwords;
+    mail_t mail;
+    size_t len;
+    int i;
+
+    len = (size_t)snprintf(text, sizeof(text), "Buy VIAGRA now!! ViAgRa,viagras xviagra; FREE\r\n4U\t");
+    for (i = 0; i < 250; i++)
+        text[len++] = i < 200 ? 'c' : 'C';
+    len += (size_t)snprintf(text + len, sizeof(text) - len, " cash%c%ccash\n\xe2\x82\xac""cash free", 0, 0xff);
+
+    /* The spamwords are the 'c' pieces, and the words of spamwords_text */
+    spamwords = tokenize_text(spamwords_text, strlen(spamwords_text));
+    for (i = 0; i < 2; i++)
+    {
+        char *piece = malloc(101);
+
+        if (piece == NULL)
+            ERROR_PRINT("out of memory\n");
+        memset(piece, 'c', i == 0 ? 100 : 50);
+        piece[i == 0 ? 100 : 50] = 0;
+        set_add(spamwords, piece);
+    }
+
+    mail.filename = "a made-up mail";
+    mail.text = text;
+    mail.len = len;
+    mail.words = tokenize_text(text, len);
+    if (count_spamwords(mail.words, spamwords) < 6)
+        ERROR_PRINT("The made-up mail has too few spamwords to test with\n");
+    check_automaton("made-up", spamwords, &mail, 1);
+    destroy_words(mail.words);
+    destroy_words(spamwords);
+}
+
+int main()
+{
+    DEBUG_PRINT("Running a series of tests to validate the spamword automaton:\n");
+
+    DEBUG_PRINT("Validating matching of whole words...\n");
+    validate_words();
+
+    DEBUG_PRINT("Validating spamword counts of the mails under " TEST_CORPUS "...\n");
+    load_corpus();
+    validate_corpus();
+    unload_corpus();
+
+    return 0;
+}
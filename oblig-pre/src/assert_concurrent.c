@@ -0,0 +1,415 @@
+#include "cset.h"
+#include "printing.h"
+#include "queue.h"
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Parameters for the test cases:
+ * TEST_THREADS is the number of threads reading or producing at once
+ * TEST_UPDATES is the number of times a writer changes a shared structure
+ * TEST_SWAP_EVERY is how often the concurrent set is replaced instead of
+ * added to
+ * TEST_ITEMS is the number of elements each producer puts in a queue
+ * TEST_TASKS is the number of tasks each thread spawns into a scheduler
+ * TEST_FIB is the size of the trees of nested tasks
+ */
+
+#define TEST_THREADS 4
+#define TEST_UPDATES 2000
+#define TEST_SWAP_EVERY 64
+#define TEST_ITEMS 20000
+#define TEST_TASKS 2000
+#define TEST_FIB 16
+
+/*
+ * Elements are small positive integers stored in the pointers themselves.
+ */
+static int compare_values(void *a, void *b)
+{
+    intptr_t x = (intptr_t)a, y = (intptr_t)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * The concurrent set under test.  Every snapshot it ever holds is
+ * {1, ..., n} for some n, so a reader can tell a torn or freed snapshot
+ * from a valid one.  A snapshot carries the n it was swapped in with as
+ * its data, and sets only grow until the next swap.
+ */
+static cset_t *cset;
+static atomic_int cset_done;
+static atomic_long cset_reads;
+static atomic_long cset_errors;
+static atomic_long cset_freed;
+
+static intptr_t *new_data(intptr_t n)
+{
+    intptr_t *data = malloc(sizeof(intptr_t));
+
+    if (data == NULL)
+        ERROR_PRINT("out of memory\n");
+    *data = n;
+    return data;
+}
+
+static void free_data(void *data)
+{
+    atomic_fetch_add(&cset_freed, 1);
+    free(data);
+}
+
+static void *cset_reader(void *arg)
+{
+    set_iter_t *iter;
+    intptr_t expected;
+    set_t *snapshot;
+    void *data;
+    int token;
+
+    (void)arg;
+    while (!atomic_load(&cset_done))
+    {
+        snapshot = cset_acquire_data(cset, &token, &data);
+        expected = 1;
+        iter = set_createiter(snapshot);
+        while (set_hasnext(iter))
+        {
+            if ((intptr_t)set_next(iter) != expected++)
+                atomic_fetch_add(&cset_errors, 1);
+        }
+        set_destroyiter(iter);
+        if (expected - 1 != set_size(snapshot) || !set_contains(snapshot, (void *)1) ||
+            *(intptr_t *)data > set_size(snapshot))
+            atomic_fetch_add(&cset_errors, 1);
+        cset_release(cset, token);
+
+        if (!cset_contains(cset, (void *)1))
+            atomic_fetch_add(&cset_errors, 1);
+        atomic_fetch_add(&cset_reads, 1);
+        sched_yield();
+    }
+    return NULL;
+}
+
+static set_t *first_values(intptr_t n)
+{
+    set_t *set = set_create(compare_values);
+    intptr_t i;
+
+    for (i = 1; i <= n; i++)
+        set_add(set, (void *)i);
+    return set;
+}
+
+/*
+ * Validates that readers of a concurrent set always see a whole snapshot,
+ * with the data it was swapped in with, while a writer adds to it and
+ * swaps it, and that the data of every snapshot is destroyed once
+ */
+
+void validate_cset(void)
+{
+    pthread_t readers[TEST_THREADS];
+    intptr_t next = 2, n = 1;
+    long reads, swaps = 1;
+    int i;
+
+    atomic_init(&cset_done, 0);
+    atomic_init(&cset_reads, 0);
+    atomic_init(&cset_errors, 0);
+    atomic_init(&cset_freed, 0);
+    cset = cset_create_data(first_values(1), new_data(1), free_data);
+    for (i = 0; i < TEST_THREADS; i++)
+    {
+        if (pthread_create(&readers[i], NULL, cset_reader, NULL) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+
+    for (i = 0; i < TEST_UPDATES; i++)
+    {
+        if (i % (2 * TEST_SWAP_EVERY) == TEST_SWAP_EVERY - 1)
+        {
+            /* A new set with new data */
+            n = i % 7 + 1;
+            cset_swap_data(cset, first_values(n), new_data(n));
+            next = n + 1;
+            swaps++;
+        }
+        else if (i % (2 * TEST_SWAP_EVERY) == 2 * TEST_SWAP_EVERY - 1)
+        {
+            /* A new set that keeps the data */
+            cset_swap(cset, first_values(n));
+            next = n + 1;
+        }
+        else
+        {
+            cset_add(cset, (void *)next++);
+        }
+        /* Let the readers see every snapshot, even on a single core */
+        reads = atomic_load(&cset_reads);
+        while (atomic_load(&cset_reads) == reads)
+            sched_yield();
+    }
+
+    atomic_store(&cset_done, 1);
+    for (i = 0; i < TEST_THREADS; i++)
+        pthread_join(readers[i], NULL);
+    if (atomic_load(&cset_errors) != 0)
+        ERROR_PRINT("Readers saw an invalid snapshot, check cset_acquire and cset_swap\n");
+    if (cset_size(cset) != next - 1)
+        ERROR_PRINT("Invalid size, check cset_add\n");
+    if (atomic_load(&cset_freed) != swaps - 1)
+        ERROR_PRINT("Data of live snapshots was destroyed, check cset_swap\n");
+    cset_destroy(cset);
+    if (atomic_load(&cset_freed) != swaps)
+        ERROR_PRINT("Data was destroyed %ld times for %ld swaps, check cset_destroy\n",
+                    atomic_load(&cset_freed), swaps);
+}
+
+/*
+ * The queue under test.  Producer p pushes (p, 0), (p, 1), ... encoded
+ * as p * TEST_ITEMS + i + 1, and every consumer checks that it gets the
+ * elements of each producer in the order they were pushed.
+ */
+static queue_t *queue;
+static atomic_int producers;
+static atomic_char popped[TEST_THREADS * TEST_ITEMS];
+static atomic_long queue_errors;
+
+static void *queue_producer(void *arg)
+{
+    intptr_t p = (intptr_t)arg, i;
+
+    for (i = 0; i < TEST_ITEMS; i++)
+    {
+        if (!queue_push(queue, (void *)(p * TEST_ITEMS + i + 1)))
+            atomic_fetch_add(&queue_errors, 1);
+    }
+    /* The last producer to finish closes the queue */
+    if (atomic_fetch_sub(&producers, 1) == 1)
+        queue_close(queue);
+    return NULL;
+}
+
+static void *queue_consumer(void *arg)
+{
+    intptr_t last[TEST_THREADS], value;
+    void *elem;
+    int p;
+
+    (void)arg;
+    for (p = 0; p < TEST_THREADS; p++)
+        last[p] = -1;
+    while ((elem = queue_pop(queue)) != NULL)
+    {
+        value = (intptr_t)elem - 1;
+        p = value / TEST_ITEMS;
+        if (value < 0 || p >= TEST_THREADS || value % TEST_ITEMS <= last[p] ||
+            atomic_fetch_add(&popped[value], 1) != 0)
+        {
+            atomic_fetch_add(&queue_errors, 1);
+            continue;
+        }
+        last[p] = value % TEST_ITEMS;
+    }
+    return NULL;
+}
+
+/*
+ * Validates that a queue of the given capacity hands every element to
+ * exactly one of several consumers, in order, while several producers
+ * fill it
+ */
+
+void validate_queue(int capacity)
+{
+    pthread_t threads[2 * TEST_THREADS];
+    int i;
+
+    queue = queue_create(capacity);
+    if (queue == NULL)
+        ERROR_PRINT("queue_create does not return a valid memory address\n");
+    atomic_init(&producers, TEST_THREADS);
+    atomic_init(&queue_errors, 0);
+    for (i = 0; i < TEST_THREADS * TEST_ITEMS; i++)
+        atomic_init(&popped[i], 0);
+
+    for (i = 0; i < TEST_THREADS; i++)
+    {
+        if (pthread_create(&threads[i], NULL, queue_consumer, NULL) != 0 ||
+            pthread_create(&threads[TEST_THREADS + i], NULL, queue_producer, (void *)(intptr_t)i) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+    for (i = 0; i < 2 * TEST_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    if (atomic_load(&queue_errors) != 0)
+        ERROR_PRINT("Elements were lost, repeated or reordered, check queue_push and queue_pop\n");
+    for (i = 0; i < TEST_THREADS * TEST_ITEMS; i++)
+    {
+        if (atomic_load(&popped[i]) != 1)
+            ERROR_PRINT("Element %d was never popped\n", i);
+    }
+    if (queue_push(queue, (void *)1) || queue_pop(queue) != NULL)
+        ERROR_PRINT("A closed queue accepts elements, check queue_close\n");
+    queue_destroy(queue);
+}
+
+/*
+ * The scheduler under test.  Every task marks its slot in runs, so that
+ * tasks run twice or never are found, and fib() splits itself into a
+ * tree of tasks that wait for each other.  Each producer spawns into a
+ * group of its own.
+ */
+static scheduler_t *scheduler;
+static taskgroup_t *groups[TEST_THREADS];
+static atomic_int runs[TEST_THREADS * TEST_TASKS];
+static atomic_long scheduler_errors;
+
+/*
+ * The group the current thread is waiting for, if any.  A thread that
+ * waits for a group may only run tasks of that group meanwhile.
+ */
+static _Thread_local taskgroup_t *waiting_for;
+
+static void wait_for(taskgroup_t *group)
+{
+    taskgroup_t *outer = waiting_for;
+
+    waiting_for = group;
+    scheduler_wait(scheduler, group);
+    waiting_for = outer;
+}
+
+static void check_group(taskgroup_t *group)
+{
+    if (waiting_for != NULL && waiting_for != group)
+        atomic_fetch_add(&scheduler_errors, 1);
+}
+
+typedef struct fib
+{
+    int n;
+    int result;
+    taskgroup_t *group; /* The group the task was spawned into */
+} fib_t;
+
+static void fib(void *arg)
+{
+    fib_t *f = arg, left = {f->n - 1, 0, NULL}, right = {f->n - 2, 0, f->group};
+
+    check_group(f->group);
+    if (f->n < 2)
+    {
+        f->result = f->n;
+        return;
+    }
+    left.group = taskgroup_create();
+    scheduler_spawn(scheduler, left.group, fib, &left);
+    fib(&right);
+    wait_for(left.group);
+    taskgroup_destroy(left.group);
+    f->result = left.result + right.result;
+}
+
+static int fib_expected(int n)
+{
+    return n < 2 ? n : fib_expected(n - 1) + fib_expected(n - 2);
+}
+
+static void mark_run(void *arg)
+{
+    check_group(groups[(intptr_t)arg / TEST_TASKS]);
+    atomic_fetch_add(&runs[(intptr_t)arg], 1);
+    /* Let the other threads steal and wait meanwhile, even on a single core */
+    sched_yield();
+}
+
+/*
+ * Spawns flat tasks and a tree of nested tasks into a group of its own,
+ * from outside the scheduler's threads, and waits for them.
+ */
+static void *scheduler_producer(void *arg)
+{
+    intptr_t p = (intptr_t)arg, i;
+    fib_t f = {TEST_FIB, 0, groups[p]};
+
+    for (i = 0; i < TEST_TASKS; i++)
+    {
+        scheduler_spawn(scheduler, groups[p], mark_run, (void *)(p * TEST_TASKS + i));
+        if (i == TEST_TASKS / 2)
+            scheduler_spawn(scheduler, groups[p], fib, &f);
+    }
+    wait_for(groups[p]);
+    if (f.result != fib_expected(TEST_FIB))
+        ERROR_PRINT("Nested tasks computed %d, check scheduler_wait\n", f.result);
+    return NULL;
+}
+
+/*
+ * Validates that a scheduler with the given number of threads runs every
+ * task exactly once while several threads spawn and wait at once, and
+ * that waiting threads only help with the groups they wait for
+ */
+
+void validate_scheduler(int nthreads)
+{
+    pthread_t producers[TEST_THREADS];
+    int i;
+
+    scheduler = scheduler_create(nthreads);
+    if (scheduler == NULL)
+        ERROR_PRINT("scheduler_create does not return a valid memory address\n");
+    for (i = 0; i < TEST_THREADS * TEST_TASKS; i++)
+        atomic_init(&runs[i], 0);
+    atomic_init(&scheduler_errors, 0);
+
+    for (i = 0; i < TEST_THREADS; i++)
+    {
+        groups[i] = taskgroup_create();
+        if (pthread_create(&producers[i], NULL, scheduler_producer, (void *)(intptr_t)i) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+    for (i = 0; i < TEST_THREADS; i++)
+    {
+        pthread_join(producers[i], NULL);
+        taskgroup_destroy(groups[i]);
+    }
+
+    if (atomic_load(&scheduler_errors) != 0)
+        ERROR_PRINT("Waiting ran the tasks of another group, check scheduler_wait\n");
+
+    for (i = 0; i < TEST_THREADS * TEST_TASKS; i++)
+    {
+        if (atomic_load(&runs[i]) != 1)
+            ERROR_PRINT("Task %d ran %d times, check scheduler_spawn\n", i, atomic_load(&runs[i]));
+    }
+    scheduler_destroy(scheduler);
+}
+
+int main()
+{
+    DEBUG_PRINT("Running a series of tests to validate the concurrent structures:\n");
+
+    DEBUG_PRINT("Validating concurrent set readers and writers...\n");
+    validate_cset();
+
+    /* Bounded queues are rings, and unbounded ones are locked lists */
+    DEBUG_PRINT("Validating queues with many producers and consumers...\n");
+    validate_queue(2);
+    validate_queue(64);
+    validate_queue(0);
+
+    DEBUG_PRINT("Validating schedulers with many spawning threads...\n");
+    validate_scheduler(1);
+    validate_scheduler(TEST_THREADS);
+
+    return 0;
+}
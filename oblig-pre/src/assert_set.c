@@ -1,5 +1,6 @@
 /* Author: Magnus Stenhaug <magnus.stenhaug@uit.no> */
 #include "printing.h"
+#include "scheduler.h"
 #include "set.h"
 
 #include <stdlib.h>
@@ -20,6 +21,19 @@
 #define TEST_PRINT_SET 0
 #define TEST_RUNS 1000
 
+/*
+ * Parameters for the test case on large sets:
+ * TEST_LARGE_RANGE is the number of values that may be in either set;
+ * each is in one set or both, so that set operations on the two are
+ * large enough to be split into tasks
+ * TEST_LARGE_THREADS is the number of threads set operations may use
+ * TEST_LARGE_RUNS number of times the test is run
+ */
+
+#define TEST_LARGE_RANGE 8000
+#define TEST_LARGE_THREADS 4
+#define TEST_LARGE_RUNS 8
+
 int compare_ints(void *a, void *b)
 {
     int *ia = a;
@@ -346,8 +360,111 @@ void validate_set_operations(unsigned int seed)
     delete_generated_set(testset);
 }
 
+/*
+ * Checks that the given set holds exactly the values of the given range
+ * that are marked in members
+ */
+
+int check_set_members(set_t *set, char *members)
+{
+    set_iter_t *iter;
+    int i, count = 0;
+
+    if (!check_set_integrity(set))
+        return 0;
+
+    iter = set_createiter(set);
+    while (set_hasnext(iter))
+    {
+        i = *(int *)set_next(iter);
+        if (i < 0 || i >= TEST_LARGE_RANGE || !members[i])
+        {
+            set_destroyiter(iter);
+            return 0;
+        }
+    }
+    set_destroyiter(iter);
+
+    /* With no duplicates, the set holds them all if it has their number */
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+        count += members[i];
+    return set_size(set) == count;
+}
+
+/*
+ * Validates the set operations on sets large enough that they may be
+ * split into tasks, and that the operations leave their operands and
+ * copies of them as they were
+ */
+
+void validate_large_set_operations(unsigned int seed)
+{
+    char in_a[TEST_LARGE_RANGE], in_b[TEST_LARGE_RANGE], expected[TEST_LARGE_RANGE];
+    set_t *a, *b, *copy, *res_union, *res_inter, *res_diff;
+    int *values, i, r;
+
+    values = malloc(TEST_LARGE_RANGE * sizeof(int));
+    if (values == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    /* Each value is in a only, in b only, or in both */
+    a = set_create(compare_ints);
+    b = set_create(compare_ints);
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+    {
+        values[i] = i;
+        r = rand_r(&seed) % 3;
+        in_a[i] = r != 1;
+        in_b[i] = r != 0;
+        if (in_a[i])
+            set_add(a, &values[i]);
+        if (in_b[i])
+            set_add(b, &values[i]);
+    }
+    copy = set_copy(a);
+
+    res_union = set_union(a, b);
+    res_inter = set_intersection(a, b);
+    res_diff = set_difference(a, b);
+
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+        expected[i] = in_a[i] || in_b[i];
+    if (!check_set_members(res_union, expected))
+        ERROR_PRINT("Set union of large sets is not correct\n");
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+        expected[i] = in_a[i] && in_b[i];
+    if (!check_set_members(res_inter, expected))
+        ERROR_PRINT("Set intersection of large sets is not correct\n");
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+        expected[i] = in_a[i] && !in_b[i];
+    if (!check_set_members(res_diff, expected))
+        ERROR_PRINT("Set difference of large sets is not correct\n");
+
+    /* Changing a copy must leave the set it was made from alone */
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+    {
+        if (!in_a[i])
+            set_add(copy, &values[i]);
+    }
+    if (!check_set_members(a, in_a) || !check_set_members(b, in_b))
+        ERROR_PRINT("Set operations changed their operands\n");
+    for (i = 0; i < TEST_LARGE_RANGE; i++)
+        expected[i] = 1;
+    if (!check_set_members(copy, expected))
+        ERROR_PRINT("Invalid copy, check set_copy and set_add\n");
+
+    set_destroy(res_diff);
+    set_destroy(res_inter);
+    set_destroy(res_union);
+    set_destroy(copy);
+    set_destroy(b);
+    set_destroy(a);
+    free(values);
+}
+
 int main()
 {
+    scheduler_t *scheduler;
     int i;
 
     srand(1);
@@ -373,5 +490,14 @@ int main()
     for (i = 0; i < TEST_RUNS; i++)
         validate_set_operations(i);
 
+    /* Validating set operations that may run as tasks */
+    DEBUG_PRINT("Validating set operations on large sets...\n");
+    scheduler = scheduler_create(TEST_LARGE_THREADS);
+    set_usescheduler(scheduler);
+    for (i = 0; i < TEST_LARGE_RUNS; i++)
+        validate_large_set_operations(i);
+    set_usescheduler(NULL);
+    scheduler_destroy(scheduler);
+
     return 0;
 }
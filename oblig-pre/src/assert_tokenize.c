@@ -0,0 +1,346 @@
+#include "common.h"
+#include "list.h"
+#include "printing.h"
+#include "scheduler.h"
+
+#include <stdlib.h>
+
+/*
+ * Parameters for the test cases:
+ * TEST_CORPUS is the directory of mails to tokenize
+ * TEST_SEED_VALUE is the initial seed to randomly generate buffers
+ * TEST_RUNS is the number of random buffers
+ * TEST_BUFFER_SIZE is the size of a random buffer; it spans several of
+ * the blocks tokenize_file() reads, so words are carried across them
+ * TEST_PIECES are the sizes of the pieces an incremental tokenizer is
+ * fed, and TEST_NPIECES the number of sizes
+ * TEST_LONG_WORD is the length of a word that spans several of the
+ * blocks tokenize_file() reads
+ * TEST_CHUNK is the size tokenize_buffer_parallel() cuts buffers of up
+ * to four chunks per thread into
+ * TEST_PARALLEL_SIZES are the sizes of the buffers tokenized in
+ * parallel, and TEST_NPARALLEL the number of sizes
+ * TEST_THREADS are the numbers of threads of the schedulers, and
+ * TEST_NTHREADS the number of schedulers
+ */
+
+#define TEST_CORPUS "data"
+#define TEST_SEED_VALUE 0xabcd
+#define TEST_RUNS 16
+#define TEST_BUFFER_SIZE (300 * 1000)
+#define TEST_PIECES {1, 31, 32, 33, 4096}
+#define TEST_NPIECES 5
+#define TEST_LONG_WORD (150 * 1000 + 7)
+#define TEST_CHUNK (1 << 20)
+#define TEST_PARALLEL_SIZES {2 * TEST_CHUNK, 2 * TEST_CHUNK + 4097, 7 * TEST_CHUNK + 33}
+#define TEST_NPARALLEL 3
+#define TEST_THREADS {2, 4}
+#define TEST_NTHREADS 2
+
+/*
+ * The words a tokenizer produced, each followed by a newline, which is
+ * never part of a word.
+ */
+typedef struct tokens
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+} tokens_t;
+
+static void add_token(const char *word, size_t len, void *ctx)
+{
+    tokens_t *t = ctx;
+
+    if (t->len + len + 1 > t->capacity)
+    {
+        t->capacity = (t->len + len + 1) * 2;
+        t->data = realloc(t->data, t->capacity);
+        if (t->data == NULL)
+            ERROR_PRINT("out of memory\n");
+    }
+    memcpy(t->data + t->len, word, len);
+    t->data[t->len + len] = '\n';
+    t->len += len + 1;
+}
+
+/*
+ * Returns a copy of the given text, since folding changes the text.
+ */
+static char *copy_text(const char *text, size_t len)
+{
+    char *copy = malloc(len + 1);
+
+    if (copy == NULL)
+        ERROR_PRINT("out of memory\n");
+    memcpy(copy, text, len);
+    return copy;
+}
+
+/*
+ * Tokenizes the text in one buffer with the given options.
+ */
+static tokens_t buffer_tokens(const char *text, size_t len, int options)
+{
+    tokens_t t = {NULL, 0, 0};
+    char *copy = copy_text(text, len);
+
+    tokenize_buffer_opt(copy, len, add_token, &t, options);
+    free(copy);
+    return t;
+}
+
+/*
+ * Tokenizes the text as a file, read in blocks, with the given options.
+ */
+static tokens_t file_tokens(const char *text, size_t len, int options)
+{
+    tokens_t t = {NULL, 0, 0};
+    FILE *f = tmpfile();
+
+    if (f == NULL || fwrite(text, 1, len, f) != len)
+        ERROR_PRINT("Could not write a temporary file\n");
+    rewind(f);
+    tokenize_file_cb_opt(f, add_token, &t, options);
+    fclose(f);
+    return t;
+}
+
+/*
+ * Tokenizes the text with an incremental tokenizer fed pieces of the
+ * given size, with the given options.
+ */
+static tokens_t piece_tokens(const char *text, size_t len, size_t size, int options)
+{
+    tokens_t t = {NULL, 0, 0};
+    tokenizer_t *tokenizer = tokenizer_create(add_token, &t, options);
+    char *copy = copy_text(text, len);
+    size_t pos, n;
+
+    for (pos = 0; pos < len; pos += n)
+    {
+        n = len - pos < size ? len - pos : size;
+        tokenizer_feed(tokenizer, copy + pos, n);
+    }
+    tokenizer_finish(tokenizer);
+    tokenizer_destroy(tokenizer);
+    free(copy);
+    return t;
+}
+
+/*
+ * Tokenizes the text in one buffer, cut into chunks for the given
+ * scheduler, with the given options.
+ */
+static tokens_t parallel_tokens(const char *text, size_t len, scheduler_t *scheduler, int options)
+{
+    tokens_t t = {NULL, 0, 0};
+    char *copy = copy_text(text, len);
+
+    tokenize_buffer_parallel(copy, len, add_token, &t, options, scheduler);
+    free(copy);
+    return t;
+}
+
+/*
+ * Checks that the given tokens are the expected ones, and frees them.
+ * Against says where the expected tokens come from.
+ */
+static void check_tokens(char *name, char *how, char *against, tokens_t *expected, tokens_t got)
+{
+    size_t i;
+
+    if (got.len != expected->len || memcmp(got.data, expected->data, got.len) != 0)
+    {
+        for (i = 0; i < got.len && i < expected->len && got.data[i] == expected->data[i]; i++)
+            ;
+        ERROR_PRINT("Tokenizing %s %s differs from %s at token byte %zu\n", name, how, against, i);
+    }
+    free(got.data);
+}
+
+/*
+ * Validates that the default scanner, which is the AVX2 one on CPUs that
+ * have it, produces the same words as the scalar scanner, through every
+ * tokenizer function and with and without folding
+ */
+
+#define SCALAR "the scalar scanner, check scan_avx2"
+
+void validate_scanners(char *name, const char *text, size_t len)
+{
+    size_t pieces[TEST_NPIECES] = TEST_PIECES;
+    int options[2] = {0, TOKENIZE_FOLDCASE};
+    tokens_t expected;
+    int i, j;
+
+    for (i = 0; i < 2; i++)
+    {
+        expected = buffer_tokens(text, len, options[i] | TOKENIZE_SCALAR);
+        check_tokens(name, "as a buffer", SCALAR, &expected, buffer_tokens(text, len, options[i]));
+        check_tokens(name, "as a file with the scalar scanner", SCALAR, &expected,
+                     file_tokens(text, len, options[i] | TOKENIZE_SCALAR));
+        check_tokens(name, "as a file", SCALAR, &expected, file_tokens(text, len, options[i]));
+        for (j = 0; j < TEST_NPIECES; j++)
+        {
+            check_tokens(name, "in pieces with the scalar scanner", SCALAR, &expected,
+                         piece_tokens(text, len, pieces[j], options[i] | TOKENIZE_SCALAR));
+            check_tokens(name, "in pieces", SCALAR, &expected, piece_tokens(text, len, pieces[j], options[i]));
+        }
+        free(expected.data);
+    }
+}
+
+/*
+ * Returns a random buffer of the given size.  Words of up to 350
+ * characters, so that many are split into pieces of 100, alternate
+ * with runs of other bytes, including bytes above 127 that some SIMD
+ * comparisons treat as negative.
+ */
+static char *random_text(unsigned int *seed, size_t len)
+{
+    static const char word[] = "abcxyzABCXYZ0189'_";
+    static const char other[] = " \t\r\n.,:;!?-@`[{/\x80\xc3\xa9\xff";
+    char *text = malloc(len + 1);
+    size_t pos = 0, n;
+
+    if (text == NULL)
+        ERROR_PRINT("out of memory\n");
+    while (pos < len)
+    {
+        n = rand_r(seed) % 8 == 0 ? rand_r(seed) % 350 + 1 : rand_r(seed) % 12 + 1;
+        while (n-- > 0 && pos < len)
+            text[pos++] = word[rand_r(seed) % (sizeof(word) - 1)];
+        n = rand_r(seed) % 8 == 0 ? rand_r(seed) % 100 + 1 : rand_r(seed) % 3 + 1;
+        while (n-- > 0 && pos < len)
+            text[pos++] = rand_r(seed) % 4 == 0 ? (char)(rand_r(seed) % 256)
+                                                : other[rand_r(seed) % (sizeof(other) - 1)];
+    }
+    return text;
+}
+
+/*
+ * Overwrites the text around the places tokenize_buffer_parallel() cuts
+ * it, given that it is cut into chunks of TEST_CHUNK bytes.  Cuts land
+ * in turn inside a word of 250 characters, which moves the cut to the
+ * end of the word, and inside a run of non-word bytes.
+ */
+static void plant_cuts(char *text, size_t len)
+{
+    size_t cut = TEST_CHUNK;
+    int inword = 1;
+
+    while (cut + 200 < len)
+    {
+        if (inword)
+        {
+            text[cut - 121] = ' ';
+            memset(text + cut - 120, 'L', 250);
+            text[cut + 130] = ' ';
+            cut += 130;
+        }
+        else
+            memset(text + cut - 100, '.', 200);
+        cut += TEST_CHUNK;
+        inword = !inword;
+    }
+}
+
+/*
+ * Validates that tokenizing a buffer in parallel produces the same
+ * words, in the same order, as tokenizing it in one piece, with and
+ * without folding
+ */
+
+void validate_parallel(char *name, const char *text, size_t len, scheduler_t *scheduler)
+{
+    int options[2] = {0, TOKENIZE_FOLDCASE};
+    tokens_t expected;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        expected = buffer_tokens(text, len, options[i]);
+        check_tokens(name, "in parallel", "one piece, check tokenize_buffer_parallel", &expected,
+                     parallel_tokens(text, len, scheduler, options[i]));
+        free(expected.data);
+    }
+}
+
+/*
+ * Validates the scanners on every mail under the corpus directory
+ */
+
+void validate_corpus(void)
+{
+    list_t *files = find_files(TEST_CORPUS);
+    char *filename, *text;
+    size_t len;
+
+    if (files == NULL || list_size(files) == 0)
+        ERROR_PRINT("No mails under %s, run the test from the top directory\n", TEST_CORPUS);
+    while (list_size(files) > 0)
+    {
+        filename = list_popfirst(files);
+        text = read_file(filename, &len);
+        if (text == NULL)
+            ERROR_PRINT("Could not read %s\n", filename);
+        validate_scanners(filename, text, len);
+        free(text);
+        free(filename);
+    }
+    list_destroy(files);
+}
+
+int main()
+{
+    unsigned int seed = TEST_SEED_VALUE;
+    size_t sizes[TEST_NPARALLEL] = TEST_PARALLEL_SIZES;
+    int threads[TEST_NTHREADS] = TEST_THREADS;
+    scheduler_t *scheduler;
+    char name[64];
+    char *text;
+    int i, j;
+
+    DEBUG_PRINT("Running a series of tests to validate the tokenizer:\n");
+
+    DEBUG_PRINT("Validating the scanners on the mails under " TEST_CORPUS "...\n");
+    validate_corpus();
+
+    DEBUG_PRINT("Validating the scanners on random buffers...\n");
+    for (i = 0; i < TEST_RUNS; i++)
+    {
+        /* Some buffers are not a multiple of 32 bytes long */
+        snprintf(name, sizeof(name), "random buffer %d", i);
+        text = random_text(&seed, TEST_BUFFER_SIZE - i);
+        validate_scanners(name, text, TEST_BUFFER_SIZE - i);
+        free(text);
+    }
+
+    DEBUG_PRINT("Validating the scanners on a word longer than a file block...\n");
+    text = malloc(TEST_LONG_WORD + 4);
+    if (text == NULL)
+        ERROR_PRINT("out of memory\n");
+    memcpy(text, "a, ", 3);
+    memset(text + 3, 'W', TEST_LONG_WORD);
+    text[TEST_LONG_WORD + 3] = '!';
+    validate_scanners("a long word", text, TEST_LONG_WORD + 4);
+    free(text);
+
+    DEBUG_PRINT("Validating tokenizing in parallel...\n");
+    for (i = 0; i < TEST_NTHREADS; i++)
+    {
+        scheduler = scheduler_create(threads[i]);
+        for (j = 0; j < TEST_NPARALLEL; j++)
+        {
+            snprintf(name, sizeof(name), "a buffer of %zu bytes with %d threads", sizes[j], threads[i]);
+            text = random_text(&seed, sizes[j]);
+            plant_cuts(text, sizes[j]);
+            validate_parallel(name, text, sizes[j], scheduler);
+            free(text);
+        }
+        scheduler_destroy(scheduler);
+    }
+
+    return 0;
+}
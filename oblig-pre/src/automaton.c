@@ -0,0 +1,236 @@
+#include "automaton.h"
+#include "printing.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Matches are anchored at the start of words, so the automaton is a
+ * trie with a full transition table: a character that leaves the trie
+ * leads to the dead state, where the rest of the word is skipped.
+ * Unlike Aho-Corasick, no failure links are needed, since a spamword
+ * can never start in the middle of a word.
+ */
+
+/*
+ * Words longer than this are matched in pieces, as the tokenizer splits
+ * them.
+ */
+#define MAX_WORD_LENGTH 100
+
+/*
+ * Characters are mapped to classes: one for each word character, with
+ * upper and lower case letters sharing a class, and NONWORD for all
+ * other characters.
+ */
+#define NCLASSES 38 /* a-z, 0-9, apostrophe and underscore */
+#define NONWORD 0xff
+
+#define ROOT 0
+#define DEAD 1
+
+struct automaton
+{
+    uint8_t class[256];
+    uint32_t *next;  /* next[state * NCLASSES + class] */
+    uint32_t *word;  /* Spamword ending in each state, plus 1; 0 if none */
+    uint32_t nstates;
+    uint32_t capacity;
+    uint32_t nwords;
+};
+
+struct scanner
+{
+    automaton_t *automaton;
+    uint32_t state;
+    uint32_t depth;  /* Characters of the current word piece so far */
+    uint32_t mail;   /* Number of the current mail, starting at 1 */
+    uint32_t *seen;  /* Mail in which each spamword was last found */
+    int hits;
+};
+
+static void init_classes(automaton_t *a)
+{
+    int c, n = 0;
+
+    memset(a->class, NONWORD, sizeof(a->class));
+    for (c = 'a'; c <= 'z'; c++)
+    {
+        a->class[c] = n;
+        a->class[c - 'a' + 'A'] = n++;
+    }
+    for (c = '0'; c <= '9'; c++)
+        a->class[c] = n++;
+    a->class['\''] = n++;
+    a->class['_'] = n;
+}
+
+static uint32_t add_state(automaton_t *a)
+{
+    uint32_t i;
+
+    if (a->nstates == a->capacity)
+    {
+        a->capacity *= 2;
+        a->next = realloc(a->next, (size_t)a->capacity * NCLASSES * sizeof(uint32_t));
+        a->word = realloc(a->word, (size_t)a->capacity * sizeof(uint32_t));
+        if (a->next == NULL || a->word == NULL)
+            ERROR_PRINT("out of memory\n");
+    }
+    for (i = 0; i < NCLASSES; i++)
+        a->next[(size_t)a->nstates * NCLASSES + i] = DEAD;
+    a->word[a->nstates] = 0;
+    return a->nstates++;
+}
+
+/*
+ * Adds a spamword to the trie.  Words that the tokenizer could not have
+ * produced are skipped.
+ */
+static void add_word(automaton_t *a, const char *word)
+{
+    size_t i, len = strlen(word);
+    uint32_t state = ROOT, added;
+    size_t edge;
+
+    if (len == 0 || len > MAX_WORD_LENGTH)
+        return;
+    for (i = 0; i < len; i++)
+    {
+        if (a->class[(unsigned char)word[i]] == NONWORD)
+            return;
+    }
+    for (i = 0; i < len; i++)
+    {
+        edge = (size_t)state * NCLASSES + a->class[(unsigned char)word[i]];
+        if (a->next[edge] == DEAD)
+        {
+            /* add_state() may move the table, so look the edge up again */
+            added = add_state(a);
+            a->next[edge] = added;
+        }
+        state = a->next[edge];
+    }
+    if (a->word[state] == 0)
+        a->word[state] = ++a->nwords;
+}
+
+automaton_t *automaton_create(set_t *spamwords)
+{
+    automaton_t *a = malloc(sizeof(automaton_t));
+    set_iter_t *it;
+
+    if (a == NULL)
+        ERROR_PRINT("out of memory\n");
+    init_classes(a);
+    a->nstates = 0;
+    a->capacity = 64;
+    a->nwords = 0;
+    a->next = malloc((size_t)a->capacity * NCLASSES * sizeof(uint32_t));
+    a->word = malloc((size_t)a->capacity * sizeof(uint32_t));
+    if (a->next == NULL || a->word == NULL)
+        ERROR_PRINT("out of memory\n");
+    add_state(a); /* ROOT */
+    add_state(a); /* DEAD, which only leads back to itself */
+
+    it = set_createiter(spamwords);
+    while (set_hasnext(it))
+        add_word(a, set_next(it));
+    set_destroyiter(it);
+    return a;
+}
+
+void automaton_destroy(automaton_t *a)
+{
+    free(a->next);
+    free(a->word);
+    free(a);
+}
+
+scanner_t *scanner_create(automaton_t *automaton)
+{
+    scanner_t *s = malloc(sizeof(scanner_t));
+
+    if (s == NULL)
+        ERROR_PRINT("out of memory\n");
+    s->automaton = automaton;
+    s->state = ROOT;
+    s->depth = 0;
+    s->mail = 1;
+    s->hits = 0;
+    s->seen = calloc(automaton->nwords + 1, sizeof(uint32_t));
+    if (s->seen == NULL)
+        ERROR_PRINT("out of memory\n");
+    return s;
+}
+
+void scanner_destroy(scanner_t *s)
+{
+    free(s->seen);
+    free(s);
+}
+
+/*
+ * Ends the current word piece, counting it if it is a spamword not yet
+ * found in this mail.
+ */
+static inline void end_piece(scanner_t *s, const uint32_t *word)
+{
+    uint32_t w = word[s->state];
+
+    if (w != 0 && s->seen[w] != s->mail)
+    {
+        s->seen[w] = s->mail;
+        s->hits++;
+    }
+    s->state = ROOT;
+    s->depth = 0;
+}
+
+void scanner_feed(scanner_t *s, const char *buf, size_t len)
+{
+    const automaton_t *a = s->automaton;
+    const uint32_t *next = a->next, *word = a->word;
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t i;
+    uint8_t c;
+
+    for (i = 0; i < len; i++)
+    {
+        c = a->class[p[i]];
+        if (c == NONWORD)
+        {
+            if (s->depth > 0)
+                end_piece(s, word);
+            continue;
+        }
+        if (s->depth == MAX_WORD_LENGTH)
+            end_piece(s, word);
+        s->state = next[(size_t)s->state * NCLASSES + c];
+        s->depth++;
+    }
+}
+
+int scanner_hits(scanner_t *s)
+{
+    return s->hits;
+}
+
+int scanner_finish(scanner_t *s)
+{
+    int hits;
+
+    if (s->depth > 0)
+        end_piece(s, s->automaton->word);
+    hits = s->hits;
+    s->hits = 0;
+    s->mail++;
+    if (s->mail == 0)
+    {
+        /* The mail numbers wrapped around; forget the old ones */
+        memset(s->seen, 0, (s->automaton->nwords + 1) * sizeof(uint32_t));
+        s->mail = 1;
+    }
+    return hits;
+}
@@ -0,0 +1,207 @@
+#include "bayes.h"
+#include "map.h"
+#include "printing.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * What the classifier knows about one word.  The word itself is stored
+ * after the entry, in the same allocation, and serves as the map key.
+ */
+typedef struct entry
+{
+    uint32_t spam;  /* Spam mails containing the word */
+    uint32_t ham;   /* Nonspam mails containing the word */
+    double weight;  /* Log ratio, valid while the classifier is prepared */
+    char word[];
+} entry_t;
+
+struct bayes
+{
+    map_t *words; /* Maps words to their entries */
+    int spam;
+    int ham;
+    int prepared; /* Set while every weight matches the counts */
+    double prior;
+};
+
+bayes_t *bayes_create(void)
+{
+    bayes_t *bayes = malloc(sizeof(bayes_t));
+
+    if (bayes == NULL)
+        ERROR_PRINT("out of memory\n");
+    bayes->words = map_create(compare_strings, hash_string);
+    if (bayes->words == NULL)
+        ERROR_PRINT("out of memory\n");
+    bayes->spam = 0;
+    bayes->ham = 0;
+    bayes->prepared = 0;
+    return bayes;
+}
+
+void bayes_destroy(bayes_t *bayes)
+{
+    map_iter_t *it = map_createiter(bayes->words);
+
+    while (map_hasnext(it))
+        free(map_get(bayes->words, map_next(it)));
+    map_destroyiter(it);
+    map_destroy(bayes->words);
+    free(bayes);
+}
+
+static entry_t *entry_create(const char *word)
+{
+    size_t len = strlen(word);
+    entry_t *e = malloc(sizeof(entry_t) + len + 1);
+
+    if (e == NULL)
+        ERROR_PRINT("out of memory\n");
+    e->spam = 0;
+    e->ham = 0;
+    memcpy(e->word, word, len + 1);
+    return e;
+}
+
+void bayes_add(bayes_t *bayes, set_t *words, int spam)
+{
+    set_iter_t *it = set_createiter(words);
+    entry_t *e;
+    char *word;
+
+    while (set_hasnext(it))
+    {
+        word = set_next(it);
+        e = map_get(bayes->words, word);
+        if (e == NULL)
+        {
+            e = entry_create(word);
+            map_put(bayes->words, e->word, e);
+        }
+        if (spam)
+            e->spam++;
+        else
+            e->ham++;
+    }
+    set_destroyiter(it);
+    if (spam)
+        bayes->spam++;
+    else
+        bayes->ham++;
+    bayes->prepared = 0;
+}
+
+void bayes_merge(bayes_t *bayes, bayes_t *other)
+{
+    map_iter_t *it = map_createiter(other->words);
+    entry_t *e, *mine;
+
+    while (map_hasnext(it))
+    {
+        e = map_get(other->words, map_next(it));
+        mine = map_get(bayes->words, e->word);
+        if (mine == NULL)
+        {
+            /* Hand the entry over rather than copying it */
+            map_put(bayes->words, e->word, e);
+            continue;
+        }
+        mine->spam += e->spam;
+        mine->ham += e->ham;
+        free(e);
+    }
+    map_destroyiter(it);
+    bayes->spam += other->spam;
+    bayes->ham += other->ham;
+    bayes->prepared = 0;
+    map_destroy(other->words);
+    free(other);
+}
+
+void bayes_addcounts(bayes_t *bayes, const char *word, int spam, int ham)
+{
+    entry_t *e = map_get(bayes->words, (void *)word);
+
+    if (e == NULL)
+    {
+        e = entry_create(word);
+        map_put(bayes->words, e->word, e);
+    }
+    e->spam += spam;
+    e->ham += ham;
+    bayes->prepared = 0;
+}
+
+void bayes_addmails(bayes_t *bayes, int spam, int ham)
+{
+    bayes->spam += spam;
+    bayes->ham += ham;
+    bayes->prepared = 0;
+}
+
+void bayes_foreach(bayes_t *bayes, bayesfunc_t fn, void *ctx)
+{
+    map_iter_t *it = map_createiter(bayes->words);
+    entry_t *e;
+
+    while (map_hasnext(it))
+    {
+        e = map_get(bayes->words, map_next(it));
+        fn(e->word, e->spam, e->ham, ctx);
+    }
+    map_destroyiter(it);
+}
+
+int bayes_mails(bayes_t *bayes, int spam)
+{
+    return spam ? bayes->spam : bayes->ham;
+}
+
+int bayes_words(bayes_t *bayes)
+{
+    return map_size(bayes->words);
+}
+
+/*
+ * Computes the weight of every word, and the prior.
+ */
+static void prepare(bayes_t *bayes)
+{
+    map_iter_t *it = map_createiter(bayes->words);
+    double spam = bayes->spam + 2.0, ham = bayes->ham + 2.0;
+    entry_t *e;
+
+    while (map_hasnext(it))
+    {
+        e = map_get(bayes->words, map_next(it));
+        e->weight = log((e->spam + 1.0) / spam) - log((e->ham + 1.0) / ham);
+    }
+    map_destroyiter(it);
+    bayes->prior = log((bayes->spam + 1.0) / (bayes->ham + 1.0));
+    bayes->prepared = 1;
+}
+
+double bayes_score(bayes_t *bayes, set_t *words)
+{
+    set_iter_t *it;
+    double score;
+    entry_t *e;
+
+    if (!bayes->prepared)
+        prepare(bayes);
+    score = bayes->prior;
+    it = set_createiter(words);
+    while (set_hasnext(it))
+    {
+        /* Words never seen in training say nothing either way */
+        e = map_get(bayes->words, set_next(it));
+        if (e != NULL)
+            score += e->weight;
+    }
+    set_destroyiter(it);
+    return score;
+}
@@ -0,0 +1,474 @@
+#include "cache.h"
+#include "hash.h"
+#include "list.h"
+#include "map.h"
+#include "printing.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The cache file starts with a magic number and a version, followed by
+ * the number of entries.  Each entry is stored as
+ *
+ *   u32 path length, path
+ *   i64 mtime seconds, i64 mtime nanoseconds, u64 size, u64 hash
+ *   u32 number of words, u32 length of word data, word data
+ *
+ * where the word data is the file's unique words, sorted and each
+ * terminated by a NUL.  Numbers are stored in host byte order; the
+ * cache is not meant to be moved between machines.
+ */
+#define CACHE_MAGIC 0x434d4653 /* "SFMC" */
+#define CACHE_VERSION 1
+
+typedef struct entry entry_t;
+struct entry
+{
+    char *path;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t hash;
+    uint32_t nwords;
+    uint32_t nbytes;
+    char *words;
+    int seen;
+};
+
+struct cache
+{
+    char *filename;
+    map_t *entries;  /* Path -> entry_t */
+    list_t *retired; /* Word data replaced during this run */
+    int dirty;
+    int reused;
+    int tokenized;
+    pthread_mutex_t lock;
+};
+
+static void entry_destroy(entry_t *entry)
+{
+    free(entry->path);
+    free(entry->words);
+    free(entry);
+}
+
+/*
+ * Bounds-checked reads from a loaded cache file.
+ */
+struct reader
+{
+    const char *p;
+    const char *end;
+};
+
+static int getbytes(struct reader *r, void *dst, size_t n)
+{
+    if ((size_t)(r->end - r->p) < n)
+        return 0;
+    memcpy(dst, r->p, n);
+    r->p += n;
+    return 1;
+}
+
+static char *getstring(struct reader *r, size_t n)
+{
+    char *s;
+
+    if ((size_t)(r->end - r->p) < n)
+        return NULL;
+    s = malloc(n + 1);
+    if (s == NULL)
+        ERROR_PRINT("out of memory\n");
+    memcpy(s, r->p, n);
+    s[n] = 0;
+    r->p += n;
+    return s;
+}
+
+/*
+ * Returns 1 if the nbytes bytes of word data hold exactly nwords words,
+ * each terminated by a NUL, so that entry_words() stays within them.
+ */
+static int valid_words(const char *words, uint32_t nwords, uint32_t nbytes)
+{
+    uint32_t i, count = 0;
+
+    if (nbytes > 0 && words[nbytes - 1] != 0)
+        return 0;
+    for (i = 0; i < nbytes; i++)
+    {
+        if (words[i] == 0)
+            count++;
+    }
+    return count == nwords;
+}
+
+/*
+ * Parses the cache file image in buf into the cache.  Returns 1 on
+ * success, and 0 if the image is not a valid cache.
+ */
+static int load(cache_t *cache, const char *buf, size_t len)
+{
+    struct reader r = {buf, buf + len};
+    uint32_t magic, version, count, pathlen, i;
+    entry_t *entry;
+
+    if (!getbytes(&r, &magic, 4) || !getbytes(&r, &version, 4) || !getbytes(&r, &count, 4))
+        return 0;
+    if (magic != CACHE_MAGIC || version != CACHE_VERSION)
+        return 0;
+
+    for (i = 0; i < count; i++)
+    {
+        entry = calloc(1, sizeof(entry_t));
+        if (entry == NULL)
+            ERROR_PRINT("out of memory\n");
+        if (!getbytes(&r, &pathlen, 4) ||
+            (entry->path = getstring(&r, pathlen)) == NULL ||
+            !getbytes(&r, &entry->mtime_sec, 8) ||
+            !getbytes(&r, &entry->mtime_nsec, 8) ||
+            !getbytes(&r, &entry->size, 8) ||
+            !getbytes(&r, &entry->hash, 8) ||
+            !getbytes(&r, &entry->nwords, 4) ||
+            !getbytes(&r, &entry->nbytes, 4) ||
+            (entry->words = getstring(&r, entry->nbytes)) == NULL ||
+            !valid_words(entry->words, entry->nwords, entry->nbytes))
+        {
+            entry_destroy(entry);
+            return 0;
+        }
+        map_put(cache->entries, entry->path, entry);
+    }
+    return 1;
+}
+
+cache_t *cache_open(char *filename)
+{
+    cache_t *cache;
+    map_iter_t *it;
+    struct stat st;
+    char *buf;
+    FILE *f;
+
+    cache = malloc(sizeof(cache_t));
+    if (cache == NULL)
+        return NULL;
+    cache->filename = strdup(filename);
+    cache->entries = map_create(compare_strings, hash_string);
+    cache->retired = list_create(NULL);
+    cache->dirty = 0;
+    cache->reused = 0;
+    cache->tokenized = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+    if (cache->filename == NULL || cache->entries == NULL || cache->retired == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    f = fopen(filename, "rb");
+    if (f == NULL)
+        return cache;
+    if (fstat(fileno(f), &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL)
+    {
+        if (fread(buf, 1, st.st_size, f) != (size_t)st.st_size ||
+            !load(cache, buf, st.st_size))
+        {
+            /* Start over rather than trust a damaged cache */
+            DEBUG_PRINT("ignoring invalid cache file %s\n", filename);
+            it = map_createiter(cache->entries);
+            while (map_hasnext(it))
+                entry_destroy(map_get(cache->entries, map_next(it)));
+            map_destroyiter(it);
+            map_destroy(cache->entries);
+            cache->entries = map_create(compare_strings, hash_string);
+            cache->dirty = 1;
+        }
+        free(buf);
+    }
+    fclose(f);
+    return cache;
+}
+
+static int putbytes(FILE *f, const void *src, size_t n)
+{
+    return fwrite(src, 1, n, f) == n;
+}
+
+int cache_save(cache_t *cache)
+{
+    map_iter_t *it;
+    entry_t *entry;
+    struct stat st;
+    uint32_t magic = CACHE_MAGIC, version = CACHE_VERSION, count = 0, pathlen;
+    char *tmpname;
+    FILE *f;
+    int ok;
+
+    DEBUG_PRINT("cache: %d file(s) reused, %d file(s) tokenized\n", cache->reused, cache->tokenized);
+
+    /* Forget files that have disappeared since they were cached */
+    it = map_createiter(cache->entries);
+    while (map_hasnext(it))
+    {
+        entry = map_get(cache->entries, map_next(it));
+        if (entry->seen || stat(entry->path, &st) == 0)
+        {
+            count++;
+        }
+        else
+        {
+            entry->seen = -1;
+            cache->dirty = 1;
+        }
+    }
+    map_destroyiter(it);
+    if (!cache->dirty)
+        return 1;
+
+    /* Write a new file and move it into place, so that a crash never
+     * leaves a half-written cache behind */
+    tmpname = malloc(strlen(cache->filename) + 5);
+    if (tmpname == NULL)
+        ERROR_PRINT("out of memory\n");
+    strcpy(tmpname, cache->filename);
+    strcat(tmpname, ".tmp");
+    f = fopen(tmpname, "wb");
+    if (f == NULL)
+    {
+        free(tmpname);
+        return 0;
+    }
+
+    ok = putbytes(f, &magic, 4) && putbytes(f, &version, 4) && putbytes(f, &count, 4);
+    it = map_createiter(cache->entries);
+    while (ok && map_hasnext(it))
+    {
+        entry = map_get(cache->entries, map_next(it));
+        if (entry->seen < 0)
+            continue;
+        pathlen = strlen(entry->path);
+        ok = putbytes(f, &pathlen, 4) && putbytes(f, entry->path, pathlen) &&
+             putbytes(f, &entry->mtime_sec, 8) && putbytes(f, &entry->mtime_nsec, 8) &&
+             putbytes(f, &entry->size, 8) && putbytes(f, &entry->hash, 8) &&
+             putbytes(f, &entry->nwords, 4) && putbytes(f, &entry->nbytes, 4) &&
+             putbytes(f, entry->words, entry->nbytes);
+    }
+    map_destroyiter(it);
+
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmpname, cache->filename) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmpname);
+    else
+        cache->dirty = 0;
+    free(tmpname);
+    return ok;
+}
+
+void cache_close(cache_t *cache)
+{
+    map_iter_t *it;
+
+    it = map_createiter(cache->entries);
+    while (map_hasnext(it))
+        entry_destroy(map_get(cache->entries, map_next(it)));
+    map_destroyiter(it);
+    map_destroy(cache->entries);
+    while (list_size(cache->retired) > 0)
+        free(list_popfirst(cache->retired));
+    list_destroy(cache->retired);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->filename);
+    free(cache);
+}
+
+/*
+ * Adds a word to a set of words being collected, copying it if it is
+ * new to the set.
+ */
+static void addword(const char *word, size_t len, void *ctx)
+{
+    set_t *wordset = ctx;
+    char buf[101];
+    char *copy;
+
+    /* The tokenizer never produces words longer than 100 characters */
+    memcpy(buf, word, len);
+    buf[len] = 0;
+    if (!set_contains(wordset, buf))
+    {
+        copy = strdup(buf);
+        if (copy == NULL)
+            ERROR_PRINT("out of memory\n");
+        set_add(wordset, copy);
+    }
+}
+
+/*
+ * Tokenizes the size bytes at buf, and returns the unique words as
+ * word data for an entry.
+ */
+static char *collect_words(char *buf, size_t size, uint32_t *nwords, uint32_t *nbytes)
+{
+    set_t *wordset = set_create(compare_strings);
+    set_iter_t *it;
+    size_t total = 0, len;
+    char *words, *word, *p;
+
+    tokenize_buffer_opt(buf, size, addword, wordset, TOKENIZE_FOLDCASE);
+
+    it = set_createiter(wordset);
+    while (set_hasnext(it))
+        total += strlen(set_next(it)) + 1;
+    set_destroyiter(it);
+
+    words = p = malloc(total + 1);
+    if (words == NULL)
+        ERROR_PRINT("out of memory\n");
+    *nwords = set_size(wordset);
+    *nbytes = total;
+
+    it = set_createiter(wordset);
+    while (set_hasnext(it))
+    {
+        word = set_next(it);
+        len = strlen(word) + 1;
+        memcpy(p, word, len);
+        p += len;
+        free(word);
+    }
+    set_destroyiter(it);
+    set_destroy(wordset);
+    return words;
+}
+
+/*
+ * Reads the whole file into memory.  Returns the contents, or NULL if
+ * the file could not be read.
+ */
+static char *readfile(char *path, size_t *size)
+{
+    struct stat st;
+    ssize_t n;
+    size_t have = 0;
+    char *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (buf = malloc(st.st_size + 1)) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    while (have < (size_t)st.st_size && (n = read(fd, buf + have, st.st_size - have)) > 0)
+        have += n;
+    close(fd);
+    *size = have;
+    return buf;
+}
+
+/*
+ * Returns a new set of the entry's words.
+ */
+static set_t *entry_words(entry_t *entry)
+{
+    set_t *wordset = set_create(compare_strings);
+    char *word = entry->words;
+    uint32_t i;
+
+    /* The words are stored sorted; set.c appends those in constant time */
+    for (i = 0; i < entry->nwords; i++)
+    {
+        set_add(wordset, word);
+        word += strlen(word) + 1;
+    }
+    return wordset;
+}
+
+set_t *cache_words(cache_t *cache, char *path)
+{
+    entry_t *entry;
+    struct stat st;
+    set_t *wordset;
+    size_t size;
+    uint64_t hash, oldhash = 0, oldsize = 0;
+    uint32_t nwords = 0, nbytes = 0;
+    char *buf, *words = NULL;
+    int known = 0;
+
+    if (stat(path, &st) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = map_get(cache->entries, path);
+    if (entry != NULL &&
+        entry->mtime_sec == (int64_t)st.st_mtim.tv_sec &&
+        entry->mtime_nsec == (int64_t)st.st_mtim.tv_nsec &&
+        entry->size == (uint64_t)st.st_size)
+    {
+        cache->reused++;
+        entry->seen = 1;
+        wordset = entry_words(entry);
+        pthread_mutex_unlock(&cache->lock);
+        return wordset;
+    }
+    if (entry != NULL && entry->words != NULL)
+    {
+        known = 1;
+        oldhash = entry->hash;
+        oldsize = entry->size;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    /* The file may have changed; compare its content.  The file is read
+     * and tokenized without holding the lock, so that several threads
+     * can do this at once. */
+    buf = readfile(path, &size);
+    if (buf == NULL)
+        return NULL;
+    hash = hash_bytes(buf, size, 0);
+    if (!known || oldhash != hash || oldsize != size)
+        words = collect_words(buf, size, &nwords, &nbytes);
+    free(buf);
+
+    pthread_mutex_lock(&cache->lock);
+    entry = map_get(cache->entries, path);
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(entry_t));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL)
+            ERROR_PRINT("out of memory\n");
+        map_put(cache->entries, entry->path, entry);
+    }
+    if (words != NULL)
+    {
+        /* Sets handed out earlier may still point at the old words */
+        if (entry->words != NULL)
+            list_addlast(cache->retired, entry->words);
+        entry->words = words;
+        entry->nwords = nwords;
+        entry->nbytes = nbytes;
+        cache->tokenized++;
+    }
+    else
+    {
+        cache->reused++;
+    }
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+    entry->size = size;
+    entry->hash = hash;
+    entry->seen = 1;
+    cache->dirty = 1;
+    wordset = entry_words(entry);
+    pthread_mutex_unlock(&cache->lock);
+    return wordset;
+}
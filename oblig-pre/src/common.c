@@ -2,13 +2,21 @@
 #include "common.h"
 #include "list.h"
 #include "printing.h"
+#include "queue.h"
+#include "scheduler.h"
+#include "stats.h"
 
 #include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Define a platform-independent path separator.
 #ifdef _WIN32
@@ -23,110 +31,813 @@
 #define ERROR_FATAL
 #endif
 
+/*
+ * Words longer than this are split into several words, mirroring the
+ * "%100[...]" conversion the tokenizer used to be built on.
+ */
+#define MAX_WORD_LENGTH 100
+
+/*
+ * Number of bytes read from the file at a time.
+ */
+#define TOKENIZE_BUFSIZE 65536
+
+/*
+ * Smallest piece of a buffer that tokenize_buffer_parallel() hands to a
+ * task of its own.
+ */
+#define TOKENIZE_CHUNK (1 << 20)
+
+/*
+ * Character class table: nonzero for the characters a word may
+ * consist of (letters, digits, apostrophe and underscore).
+ */
+static const unsigned char wordchar[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/*
+ * The type of scanners.  A scanner passes every word in buf[0..len)
+ * that ends before the end of the buffer to fn, and returns the offset
+ * of the word still open at the end of the buffer, or len if the
+ * buffer ends outside a word.
+ */
+typedef size_t (*scanfunc_t)(const char *buf, size_t len, tokenfunc_t fn, void *ctx);
+
+/*
+ * Scalar, table-driven scanner.  Scans buf[pos..len); if inword is set,
+ * a word starting at offset start is already in progress.  Otherwise
+ * behaves like a scanfunc_t.
+ */
+static size_t scan_scalar_from(const char *buf, size_t pos, size_t len,
+                               size_t start, int inword,
+                               tokenfunc_t fn, void *ctx)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    while (pos < len)
+    {
+        if (!inword)
+        {
+            /* Skip non-word characters */
+            while (pos < len && !wordchar[p[pos]])
+                pos++;
+            if (pos == len)
+                break;
+            start = pos;
+            inword = 1;
+        }
+        /* Scan to the end of the word */
+        while (pos < len && wordchar[p[pos]])
+            pos++;
+        if (pos == len)
+            break;
+        fn(buf + start, pos - start, ctx);
+        inword = 0;
+    }
+    return inword ? start : len;
+}
+
+static size_t scan_scalar(const char *buf, size_t len, tokenfunc_t fn, void *ctx)
+{
+    return scan_scalar_from(buf, 0, len, 0, 0, fn, ctx);
+}
+
+#if !defined(NO_AVX2) && defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#include <stdint.h>
+
+/*
+ * Returns a bitmask with bit i set if c[i] is a word character.
+ */
+__attribute__((target("avx2")))
+static inline uint32_t wordmask_avx2(__m256i c)
+{
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i other = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\'')),
+                                    _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+
+    return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), other));
+}
+
+/*
+ * AVX2 scanner.  Classifies 32 bytes at a time and walks the word
+ * start/end transitions of the resulting bitmask.  Same contract as
+ * scan_scalar(); the tail of the buffer is handled by the scalar code.
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, tokenfunc_t fn, void *ctx)
+{
+    size_t pos, start = 0;
+    uint32_t inword = 0;
+
+    for (pos = 0; pos + 32 <= len; pos += 32)
+    {
+        uint32_t mask = wordmask_avx2(_mm256_loadu_si256((const __m256i *)(buf + pos)));
+        uint32_t prev = (mask << 1) | inword;
+        uint32_t events = (mask & ~prev) | (~mask & prev);
+
+        /* Bits where the class changes; starts and ends alternate */
+        while (events)
+        {
+            int i = __builtin_ctz(events);
+            if (mask & (1u << i))
+                start = pos + i;
+            else
+                fn(buf + start, pos + i - start, ctx);
+            events &= events - 1;
+        }
+        inword = mask >> 31;
+    }
+    return scan_scalar_from(buf, pos, len, start, inword, fn, ctx);
+}
+#endif
+
+/*
+ * The scanner to use on this CPU; chosen once, by select_scanner().
+ */
+static scanfunc_t scan_words;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static void select_scanner(void)
+{
+    scan_words = scan_scalar;
+#if !defined(NO_AVX2) && defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_words = scan_avx2;
+#endif
+}
+
+/*
+ * Returns the scanner to use on this CPU, with the given tokenizer
+ * options.
+ */
+static scanfunc_t scanner(int options)
+{
+    if (options & TOKENIZE_SCALAR)
+        return scan_scalar;
+    pthread_once(&scan_once, select_scanner);
+    return scan_words;
+}
+
+/*
+ * Where scan_file() sends its words.
+ */
+struct emitter
+{
+    tokenfunc_t fn;
+    void *ctx;
+    int options;
+    uint64_t tokens; /* Words emitted, for the instrumentation */
+};
+
+/*
+ * Lower-cases the given word in place.
+ */
+static void foldcase(char *word, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (word[i] >= 'A' && word[i] <= 'Z')
+            word[i] += 'a' - 'A';
+    }
+}
+
+/*
+ * Passes a word to the emitter, split into pieces of at most
+ * MAX_WORD_LENGTH characters.  With TOKENIZE_FOLDCASE the word is
+ * folded first, so the word must then be writable.
+ */
+static void emit_word(const char *word, size_t len, void *ctx)
+{
+    struct emitter *e = ctx;
+
+    if (e->options & TOKENIZE_FOLDCASE)
+        foldcase((char *)word, len);
+    while (len > MAX_WORD_LENGTH)
+    {
+        e->fn(word, MAX_WORD_LENGTH, e->ctx);
+        e->tokens++;
+        word += MAX_WORD_LENGTH;
+        len -= MAX_WORD_LENGTH;
+    }
+    e->fn(word, len, e->ctx);
+    e->tokens++;
+}
+
+/*
+ * Reads the file in blocks and feeds every word in it to fn.  A word
+ * that crosses a block boundary is moved to the start of the buffer
+ * and completed by the next read.
+ */
+static void scan_file(FILE *file, tokenfunc_t fn, void *ctx, int options)
+{
+    scanfunc_t scan = scanner(options);
+    struct emitter e = {fn, ctx, options, 0};
+    uint64_t start = STATS_START(), total = 0;
+    size_t have = 0, open, n;
+    char *buf;
+
+    buf = malloc(TOKENIZE_BUFSIZE);
+    if (buf == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    for (;;)
+    {
+        n = fread(buf + have, 1, TOKENIZE_BUFSIZE - have, file);
+        have += n;
+        total += n;
+        open = scan(buf, have, emit_word, &e);
+        if (have < TOKENIZE_BUFSIZE)
+        {
+            /* Short read; end of file */
+            if (open < have)
+                emit_word(buf + open, have - open, &e);
+            break;
+        }
+        /* Emit the whole pieces of an overlong word before carrying it */
+        n = (have - open) - (have - open) % MAX_WORD_LENGTH;
+        if (n > 0)
+        {
+            emit_word(buf + open, n, &e);
+            open += n;
+        }
+        have -= open;
+        memmove(buf, buf + open, have);
+    }
+    free(buf);
+    STATS_COUNT(COUNTER_BYTES, total);
+    STATS_COUNT(COUNTER_TOKENS, e.tokens);
+    STATS_STOP(TIMER_TOKENIZE, start);
+}
+
+static void add_to_list(const char *word, size_t len, void *ctx)
+{
+    char *copy = malloc(len + 1);
+    if (copy == NULL)
+        ERROR_PRINT("out of memory\n");
+    memcpy(copy, word, len);
+    copy[len] = 0;
+    list_addlast(ctx, copy);
+}
+
 void tokenize_file(FILE *file, list_t *list)
 {
-    char *word;
-    char buf[101];
-    buf[100] = 0;
+    scan_file(file, add_to_list, list, 0);
+}
+
+void tokenize_file_opt(FILE *file, list_t *list, int options)
+{
+    scan_file(file, add_to_list, list, options);
+}
+
+void tokenize_file_cb(FILE *file, tokenfunc_t emit, void *ctx)
+{
+    scan_file(file, emit, ctx, 0);
+}
+
+void tokenize_file_cb_opt(FILE *file, tokenfunc_t emit, void *ctx, int options)
+{
+    scan_file(file, emit, ctx, options);
+}
+
+void tokenize_buffer(const char *buf, size_t len, tokenfunc_t emit, void *ctx)
+{
+    struct emitter e = {emit, ctx, 0, 0};
+    uint64_t start = STATS_START();
+    size_t open;
+
+    open = scanner(0)(buf, len, emit_word, &e);
+    if (open < len)
+        emit_word(buf + open, len - open, &e);
+    STATS_COUNT(COUNTER_BYTES, len);
+    STATS_COUNT(COUNTER_TOKENS, e.tokens);
+    STATS_STOP(TIMER_TOKENIZE, start);
+}
+
+void tokenize_buffer_opt(char *buf, size_t len, tokenfunc_t emit, void *ctx, int options)
+{
+    struct emitter e = {emit, ctx, options, 0};
+    uint64_t start = STATS_START();
+    size_t open;
+
+    open = scanner(options)(buf, len, emit_word, &e);
+    if (open < len)
+        emit_word(buf + open, len - open, &e);
+    STATS_COUNT(COUNTER_BYTES, len);
+    STATS_COUNT(COUNTER_TOKENS, e.tokens);
+    STATS_STOP(TIMER_TOKENIZE, start);
+}
+
+/*
+ * One piece of a buffer tokenized by tokenize_buffer_parallel(), and
+ * the words found in it, in order.
+ */
+typedef struct chunk
+{
+    char *buf;
+    size_t len;
+    int options;
+    wordview_t *words;
+    size_t nwords;
+    size_t capacity;
+    uint64_t tokens;
+} chunk_t;
+
+static void add_view(const char *word, size_t len, void *ctx)
+{
+    chunk_t *c = ctx;
+
+    if (c->nwords == c->capacity)
+    {
+        c->capacity = c->capacity > 0 ? c->capacity * 2 : 1024;
+        c->words = realloc(c->words, c->capacity * sizeof(wordview_t));
+        if (c->words == NULL)
+            ERROR_PRINT("out of memory\n");
+    }
+    c->words[c->nwords].word = word;
+    c->words[c->nwords].len = len;
+    c->nwords++;
+}
+
+static void tokenize_chunk(void *arg)
+{
+    chunk_t *c = arg;
+    struct emitter e = {add_view, c, c->options, 0};
+    size_t open;
+
+    open = scanner(c->options)(c->buf, c->len, emit_word, &e);
+    if (open < c->len)
+        emit_word(c->buf + open, c->len - open, &e);
+    c->tokens = e.tokens;
+}
+
+void tokenize_buffer_parallel(char *buf, size_t len, tokenfunc_t emit, void *ctx, int options,
+                              scheduler_t *scheduler)
+{
+    int nthreads = scheduler != NULL ? scheduler_threads(scheduler) : 1;
+    size_t size, pos, end, i;
+    uint64_t start, tokens = 0;
+    int nchunks = 0, j;
+    chunk_t *chunks;
+    taskgroup_t *group;
+
+    if (nthreads < 2 || len < 2 * TOKENIZE_CHUNK)
+    {
+        tokenize_buffer_opt(buf, len, emit, ctx, options);
+        return;
+    }
+
+    start = STATS_START();
+    /* A few chunks per thread, so that the threads finish together */
+    size = len / (nthreads * 4);
+    if (size < TOKENIZE_CHUNK)
+        size = TOKENIZE_CHUNK;
+    chunks = calloc(len / size + 1, sizeof(chunk_t));
+    if (chunks == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    /* Chunks end at a non-word character, so no word spans two of them
+     * and every word is split and folded just as in one piece */
+    for (pos = 0; pos < len; pos = end)
+    {
+        end = len - pos > size ? pos + size : len;
+        while (end < len && wordchar[(unsigned char)buf[end]])
+            end++;
+        chunks[nchunks].buf = buf + pos;
+        chunks[nchunks].len = end - pos;
+        chunks[nchunks].options = options;
+        nchunks++;
+    }
+
+    group = taskgroup_create();
+    for (j = 0; j < nchunks; j++)
+        scheduler_spawn(scheduler, group, tokenize_chunk, &chunks[j]);
+    scheduler_wait(scheduler, group);
+    taskgroup_destroy(group);
 
-    while (!feof(file))
+    /* Pass the words on in the order they occur in the buffer */
+    for (j = 0; j < nchunks; j++)
     {
-        /* Skip non-letters */
-        fscanf(file, "%*[^a-zA-Z0-9'_]");
-        /* Scan up to 100 letters */
-        if (fscanf(file, "%100[a-zA-Z0-9'_]", buf) == 1)
+        for (i = 0; i < chunks[j].nwords; i++)
+            emit(chunks[j].words[i].word, chunks[j].words[i].len, ctx);
+        tokens += chunks[j].tokens;
+        free(chunks[j].words);
+    }
+    free(chunks);
+    STATS_COUNT(COUNTER_BYTES, len);
+    STATS_COUNT(COUNTER_TOKENS, tokens);
+    STATS_STOP(TIMER_TOKENIZE, start);
+}
+
+/*
+ * An incremental tokenizer holds the start of a word that ran to the end
+ * of the last piece.  A held part never reaches MAX_WORD_LENGTH
+ * characters, since a full piece of a long word can be passed on right
+ * away.
+ */
+struct tokenizer
+{
+    struct emitter e;
+    size_t held;
+    char word[MAX_WORD_LENGTH];
+};
+
+tokenizer_t *tokenizer_create(tokenfunc_t emit, void *ctx, int options)
+{
+    tokenizer_t *t = malloc(sizeof(tokenizer_t));
+
+    if (t == NULL)
+        ERROR_PRINT("out of memory\n");
+    t->e.fn = emit;
+    t->e.ctx = ctx;
+    t->e.options = options;
+    t->e.tokens = 0;
+    t->held = 0;
+    return t;
+}
+
+/*
+ * Adds the given characters, which continue the held word, to the held
+ * word, passing it on whenever it grows to a full piece.
+ */
+static void hold(tokenizer_t *t, const char *buf, size_t len)
+{
+    size_t n;
+
+    while (len > 0)
+    {
+        n = MAX_WORD_LENGTH - t->held;
+        if (n > len)
+            n = len;
+        memcpy(t->word + t->held, buf, n);
+        t->held += n;
+        buf += n;
+        len -= n;
+        if (t->held == MAX_WORD_LENGTH)
         {
-            word = strdup(buf);
-            if (word == NULL)
-                ERROR_PRINT("out of memory\n");
-            list_addlast(list, word);
+            emit_word(t->word, t->held, &t->e);
+            t->held = 0;
         }
     }
 }
 
-struct list *find_files(char *root)
+void tokenizer_feed(tokenizer_t *t, char *buf, size_t len)
 {
-    // Initialise the list of files we will return.
-    list_t *files;
-    files = list_create(compare_strings);
+    size_t i = 0, open;
 
-    // Initialise variables needed to iterate through the directory.
-    // PATH_MAX is a platform-independent constant from <limits.h>.
-    DIR *d;
+    STATS_COUNT(COUNTER_BYTES, len);
+
+    /* Finish the held word first */
+    if (t->held > 0)
+    {
+        while (i < len && wordchar[(unsigned char)buf[i]])
+            i++;
+        hold(t, buf, i);
+        if (i == len)
+            return;
+        if (t->held > 0)
+            emit_word(t->word, t->held, &t->e);
+        t->held = 0;
+    }
+
+    open = i + scanner(t->e.options)(buf + i, len - i, emit_word, &t->e);
+    hold(t, buf + open, len - open);
+}
+
+void tokenizer_finish(tokenizer_t *t)
+{
+    if (t->held > 0)
+        emit_word(t->word, t->held, &t->e);
+    t->held = 0;
+    STATS_COUNT(COUNTER_TOKENS, t->e.tokens);
+    t->e.tokens = 0;
+}
+
+void tokenizer_destroy(tokenizer_t *t)
+{
+    free(t);
+}
+
+/*
+ * Number of threads find_files() walks directory trees with.  Walking
+ * is mostly waiting on the file system, so this is not tied to the
+ * number of CPUs.
+ */
+#define WALK_THREADS 8
+
+/*
+ * Number of discovered paths that may wait in a walker's queue before
+ * its threads pause to let the reader catch up.
+ */
+#define WALK_QUEUE_SIZE 4096
+
+struct walker
+{
+    queue_t *dirs;  // Directories that have yet to be read
+    queue_t *files; // Paths of the regular files found so far
+    int pending;    // Directories that are queued or being read
+    pthread_mutex_t lock;
+    int nthreads;
+    pthread_t *threads;
+};
+
+/*
+ * Returns a newly allocated path naming the given entry of the given
+ * directory.
+ */
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path;
+
+    // Make room for a separator and the terminating NUL.
+    if (dir_len + name_len + 2 > PATH_MAX)
+    {
+        ERROR_PRINT("file name too long\n");
+    }
+    path = malloc(dir_len + name_len + 2);
+    if (path == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    memcpy(path, dir, dir_len);
+    if (dir_len > 0 && path[dir_len - 1] != PATH_SEPARATOR)
+    {
+        path[dir_len++] = PATH_SEPARATOR;
+    }
+    memcpy(path + dir_len, name, name_len + 1);
+    return path;
+}
+
+/*
+ * Reads one directory.  Regular files go to the walker's file queue,
+ * and subdirectories go back on its directory queue for any thread to
+ * pick up.
+ */
+static void walk_dir(walker_t *walker, char *dir_path)
+{
     struct dirent *ent;
-    char path[PATH_MAX];
-    char *final_path;
+    struct stat st;
+    char *path;
+    DIR *d;
+    int fd, type;
 
-    // Attempt to open the root dir.
-    if ((d = opendir(root)) != NULL)
+    fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || (d = fdopendir(fd)) == NULL)
     {
-        // To be on the safe side, check that the root dir name isn't
-        // too long. We add one because we know we'll have to add a
-        // tailing slash and filename later on.
-        size_t path_len = strlen(root);
-        if (path_len + 1 >= PATH_MAX)
+        // Skip subdirectories we may not read rather than giving up.
+        DEBUG_PRINT("could not open directory %s\n", dir_path);
+        if (fd >= 0)
         {
-            ERROR_PRINT("directory name too long\n");
+            close(fd);
         }
+        return;
+    }
 
-        // Start the file path with the root dir name.
-        strncpy(path, root, PATH_MAX - 1);
-
-        // Now add a trailing slash (forward- or backslash depending
-        // on platform).
-        if (path[path_len - 1] != PATH_SEPARATOR)
+    while ((ent = readdir(d)) != NULL)
+    {
+        // Skip current and parent directory.
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
         {
-            path[path_len] = PATH_SEPARATOR;
-            // path[path_len + 1] = '\0';
-            path_len++;
+            continue;
         }
 
-        // We're ready to iterate over the contents of the directory
-        while ((ent = readdir(d)) != NULL)
+        // Most file systems tell us the type of the entry directly;
+        // otherwise ask for it. Symbolic links are followed to files,
+        // but not to directories, so that link cycles cannot trap us.
+        type = ent->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK)
         {
-            // Skip current and parent directory.
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            if (fstatat(dirfd(d), ent->d_name, &st, 0) < 0)
             {
                 continue;
             }
-
-            // Build complete path to current file. First check that
-            // the complete name wouldn't be too long.
-            size_t filename_length = strlen(ent->d_name);
-            if (path_len + filename_length + 1 >= PATH_MAX)
+            if (S_ISREG(st.st_mode))
             {
-                ERROR_PRINT("file name too long\n");
+                type = DT_REG;
             }
-            // Copy filename into the "path" string at the right
-            // location, that is, offset "path_len" bytes from the
-            // start of the string.
-            strncpy(path + path_len, ent->d_name, filename_length + 1);
-
-            // Duplicate the complete path and put it in the list.
-            final_path = strdup(path);
-            if (final_path == NULL)
+            else if (S_ISDIR(st.st_mode) && ent->d_type == DT_UNKNOWN)
             {
-                ERROR_PRINT("out of memory\n");
+                type = DT_DIR;
             }
-            list_addlast(files, final_path);
+        }
 
-            // NOTE: "ent" could be either a file or a directory; here
-            // we basically assume that there's only files in the
-            // "root" dir.
+        if (type == DT_REG)
+        {
+            path = join_path(dir_path, ent->d_name);
+            if (!queue_push(walker->files, path))
+            {
+                free(path);
+            }
+        }
+        else if (type == DT_DIR)
+        {
+            path = join_path(dir_path, ent->d_name);
+            pthread_mutex_lock(&walker->lock);
+            walker->pending++;
+            pthread_mutex_unlock(&walker->lock);
+            if (!queue_push(walker->dirs, path))
+            {
+                free(path);
+            }
         }
+    }
+
+    // Be a good citizen and close the directory.
+    closedir(d);
+}
+
+static void *walk_worker(void *arg)
+{
+    walker_t *walker = arg;
+    char *dir_path;
 
-        // Be a good citizen and close the directory.
-        closedir(d);
+    while ((dir_path = queue_pop(walker->dirs)) != NULL)
+    {
+        walk_dir(walker, dir_path);
+        free(dir_path);
+
+        // Subdirectories are counted before their parent is done, so
+        // the count only drops to zero once the whole tree is read.
+        pthread_mutex_lock(&walker->lock);
+        if (--walker->pending == 0)
+        {
+            queue_close(walker->dirs);
+            queue_close(walker->files);
+        }
+        pthread_mutex_unlock(&walker->lock);
     }
-    else
+    return NULL;
+}
+
+walker_t *walk_start(char *root, int nthreads)
+{
+    walker_t *walker;
+    struct stat st;
+    char *root_path;
+    int i;
+
+    if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
     {
         ERROR_PRINT("could not open directory\n");
+        return NULL;
+    }
+
+    walker = malloc(sizeof(walker_t));
+    root_path = strdup(root);
+    if (walker == NULL || root_path == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    walker->dirs = queue_create(0);
+    walker->files = queue_create(WALK_QUEUE_SIZE);
+    walker->pending = 1;
+    pthread_mutex_init(&walker->lock, NULL);
+    walker->nthreads = nthreads;
+    walker->threads = malloc(nthreads * sizeof(pthread_t));
+    if (walker->dirs == NULL || walker->files == NULL || walker->threads == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
     }
 
+    queue_push(walker->dirs, root_path);
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&walker->threads[i], NULL, walk_worker, walker) != 0)
+        {
+            ERROR_PRINT("pthread_create() failed\n");
+        }
+    }
+    return walker;
+}
+
+char *walk_next(walker_t *walker)
+{
+    return queue_pop(walker->files);
+}
+
+void walk_destroy(walker_t *walker)
+{
+    char *path;
+    int i;
+
+    // Stop the threads if the caller quit early, then drop the paths
+    // nobody asked for.
+    queue_close(walker->dirs);
+    queue_close(walker->files);
+    for (i = 0; i < walker->nthreads; i++)
+    {
+        pthread_join(walker->threads[i], NULL);
+    }
+    while ((path = queue_pop(walker->dirs)) != NULL)
+    {
+        free(path);
+    }
+    while ((path = queue_pop(walker->files)) != NULL)
+    {
+        free(path);
+    }
+
+    queue_destroy(walker->dirs);
+    queue_destroy(walker->files);
+    pthread_mutex_destroy(&walker->lock);
+    free(walker->threads);
+    free(walker);
+}
+
+char *read_file(char *path, size_t *size)
+{
+    struct stat st;
+    ssize_t n;
+    size_t have = 0;
+    char *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (buf = malloc(st.st_size + 1)) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    while (have < (size_t)st.st_size && (n = read(fd, buf + have, st.st_size - have)) > 0)
+        have += n;
+    close(fd);
+    *size = have;
+    return buf;
+}
+
+struct list *find_files(char *root)
+{
+    uint64_t start = STATS_START();
+    list_t *files;
+    walker_t *walker;
+    char *path;
+
+    files = list_create(compare_strings);
+    walker = walk_start(root, WALK_THREADS);
+    if (walker == NULL)
+    {
+        return files;
+    }
+    while ((path = walk_next(walker)) != NULL)
+    {
+        list_addlast(files, path);
+    }
+    walk_destroy(walker);
+
+    // The threads find files in no particular order; sort them so that
+    // every run sees the files in the same order.
+    list_sort(files);
+    STATS_COUNT(COUNTER_FILES, list_size(files));
+    STATS_STOP(TIMER_FIND_FILES, start);
     return files;
 }
 
 int compare_strings(void *a, void *b)
 {
+    STATS_COUNT(COUNTER_COMPARISONS, 1);
     return strcmp(a, b);
 }
+
+int compare_views(void *a, void *b)
+{
+    wordview_t *va = a;
+    wordview_t *vb = b;
+    size_t n = va->len < vb->len ? va->len : vb->len;
+    int c = strncasecmp(va->word, vb->word, n);
+
+    STATS_COUNT(COUNTER_COMPARISONS, 1);
+    if (c != 0)
+        return c;
+    return (va->len > vb->len) - (va->len < vb->len);
+}
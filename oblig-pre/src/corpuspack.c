@@ -0,0 +1,39 @@
+#include "common.h"
+#include "list.h"
+#include "pack.h"
+#include "printing.h"
+#include <time.h>
+
+/*
+ * Converts the files under a directory into a corpus pack, which
+ * spamfilter accepts in place of the directory.
+ */
+int main(int argc, char **argv)
+{
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    list_t *files;
+
+    if (argc != 3)
+    {
+        DEBUG_PRINT("usage: %s <dir> <packfile>\n", argv[0]);
+        return 1;
+    }
+
+    files = find_files(argv[1]);
+    if (!pack_write(argv[2], files))
+    {
+        perror(argv[2]);
+        ERROR_PRINT("pack_write() failed");
+    }
+    printf("Packed %d files into %s\n", list_size(files), argv[2]);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    double elapsed_time = (end_time.tv_sec - start_time.tv_sec) +
+                          (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+
+    printf("Elapsed time: %.9f seconds\n", elapsed_time);
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include "cset.h"
+#include "printing.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Number of reader counters per phase.  Threads are spread over them,
+ * so that readers on different cores rarely share a counter.
+ */
+#define CSET_STRIPES 16
+
+/*
+ * Size of a cache line, to keep the counters on lines of their own.
+ */
+#define CACHE_LINE 64
+
+typedef struct stripe
+{
+    _Alignas(CACHE_LINE) atomic_long readers;
+} stripe_t;
+
+/*
+ * A published snapshot: the set, and the data that goes with it.  Both
+ * are swapped at once by publishing a new snapshot_t.
+ */
+typedef struct snapshot
+{
+    set_t *set;
+    void *data;
+} snapshot_t;
+
+/*
+ * Readers announce themselves in a counter of the current phase, and
+ * check that the phase did not change meanwhile.  A writer publishes the
+ * new snapshot, starts the next phase, and waits for the counters of the
+ * previous phase to drain: any reader that could have seen the old
+ * snapshot is counted there.
+ */
+struct cset
+{
+    _Atomic(snapshot_t *) snapshot;
+    cset_freefunc_t destroy; /* Destroys the data of a snapshot, or NULL */
+    atomic_ulong phase;
+    stripe_t stripes[2][CSET_STRIPES];
+    pthread_mutex_t writer; /* Serializes writers */
+};
+
+/*
+ * The counter stripe of the current thread, or -1 if it has none yet.
+ */
+static _Thread_local int my_stripe = -1;
+static atomic_int next_stripe;
+
+static int stripe_of_thread(void)
+{
+    if (my_stripe < 0)
+        my_stripe = atomic_fetch_add(&next_stripe, 1) % CSET_STRIPES;
+    return my_stripe;
+}
+
+static snapshot_t *snapshot_create(set_t *set, void *data)
+{
+    snapshot_t *snapshot = malloc(sizeof(snapshot_t));
+
+    if (snapshot == NULL)
+        ERROR_PRINT("out of memory\n");
+    snapshot->set = set;
+    snapshot->data = data;
+    return snapshot;
+}
+
+/*
+ * Destroys a snapshot no reader can see, and its data unless the next
+ * snapshot carries the data on.
+ */
+static void snapshot_destroy(cset_t *cset, snapshot_t *snapshot, int keepdata)
+{
+    if (!keepdata && cset->destroy != NULL && snapshot->data != NULL)
+        cset->destroy(snapshot->data);
+    set_destroy(snapshot->set);
+    free(snapshot);
+}
+
+cset_t *cset_create(set_t *set)
+{
+    return cset_create_data(set, NULL, NULL);
+}
+
+cset_t *cset_create_data(set_t *set, void *data, cset_freefunc_t destroy)
+{
+    /* The stripes are only on lines of their own if the cset is */
+    cset_t *cset = aligned_alloc(CACHE_LINE, sizeof(cset_t));
+    int i;
+
+    if (cset == NULL)
+        ERROR_PRINT("out of memory\n");
+    memset(cset, 0, sizeof(cset_t));
+    atomic_init(&cset->snapshot, snapshot_create(set, data));
+    cset->destroy = destroy;
+    atomic_init(&cset->phase, 0);
+    for (i = 0; i < CSET_STRIPES; i++)
+    {
+        atomic_init(&cset->stripes[0][i].readers, 0);
+        atomic_init(&cset->stripes[1][i].readers, 0);
+    }
+    pthread_mutex_init(&cset->writer, NULL);
+    return cset;
+}
+
+void cset_destroy(cset_t *cset)
+{
+    snapshot_destroy(cset, atomic_load(&cset->snapshot), 0);
+    pthread_mutex_destroy(&cset->writer);
+    free(cset);
+}
+
+set_t *cset_acquire(cset_t *cset, int *token)
+{
+    void *data;
+
+    return cset_acquire_data(cset, token, &data);
+}
+
+set_t *cset_acquire_data(cset_t *cset, int *token, void **data)
+{
+    int stripe = stripe_of_thread();
+    unsigned long phase;
+    snapshot_t *snapshot;
+    stripe_t *s;
+
+    for (;;)
+    {
+        phase = atomic_load(&cset->phase);
+        s = &cset->stripes[phase & 1][stripe];
+        atomic_fetch_add(&s->readers, 1);
+        if (atomic_load(&cset->phase) == phase)
+            break;
+        /* A writer moved on; count in the new phase instead */
+        atomic_fetch_sub(&s->readers, 1);
+    }
+    *token = (phase & 1) * CSET_STRIPES + stripe;
+    snapshot = atomic_load(&cset->snapshot);
+    *data = snapshot->data;
+    return snapshot->set;
+}
+
+void cset_release(cset_t *cset, int token)
+{
+    atomic_fetch_sub_explicit(&cset->stripes[token / CSET_STRIPES][token % CSET_STRIPES].readers, 1,
+                              memory_order_release);
+}
+
+int cset_contains(cset_t *cset, void *elem)
+{
+    int token, found;
+
+    found = set_contains(cset_acquire(cset, &token), elem);
+    cset_release(cset, token);
+    return found;
+}
+
+int cset_size(cset_t *cset)
+{
+    int token, size;
+
+    size = set_size(cset_acquire(cset, &token));
+    cset_release(cset, token);
+    return size;
+}
+
+/*
+ * Waits until no reader is counted in the given phase.
+ */
+static void drain(cset_t *cset, unsigned long phase)
+{
+    int i;
+
+    for (i = 0; i < CSET_STRIPES; i++)
+    {
+        while (atomic_load_explicit(&cset->stripes[phase & 1][i].readers, memory_order_acquire) > 0)
+            sched_yield();
+    }
+}
+
+/*
+ * Publishes the given snapshot, and returns the old one once no reader
+ * can see it.  Called with the writer lock held.
+ */
+static snapshot_t *publish(cset_t *cset, snapshot_t *snapshot)
+{
+    snapshot_t *old = atomic_exchange(&cset->snapshot, snapshot);
+
+    drain(cset, atomic_fetch_add(&cset->phase, 1));
+    return old;
+}
+
+void cset_add(cset_t *cset, void *elem)
+{
+    snapshot_t *old;
+    set_t *copy;
+
+    pthread_mutex_lock(&cset->writer);
+    old = atomic_load(&cset->snapshot);
+    if (set_contains(old->set, elem))
+    {
+        pthread_mutex_unlock(&cset->writer);
+        return;
+    }
+    copy = set_copy(old->set);
+    set_add(copy, elem);
+    old = publish(cset, snapshot_create(copy, old->data));
+    pthread_mutex_unlock(&cset->writer);
+    snapshot_destroy(cset, old, 1);
+}
+
+void cset_swap(cset_t *cset, set_t *set)
+{
+    snapshot_t *old;
+
+    pthread_mutex_lock(&cset->writer);
+    old = publish(cset, snapshot_create(set, atomic_load(&cset->snapshot)->data));
+    pthread_mutex_unlock(&cset->writer);
+    snapshot_destroy(cset, old, 1);
+}
+
+void cset_swap_data(cset_t *cset, set_t *set, void *data)
+{
+    snapshot_t *old;
+
+    pthread_mutex_lock(&cset->writer);
+    old = publish(cset, snapshot_create(set, data));
+    pthread_mutex_unlock(&cset->writer);
+    snapshot_destroy(cset, old, old->data == data);
+}
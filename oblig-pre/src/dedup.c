@@ -0,0 +1,300 @@
+#include "dedup.h"
+#include "hash.h"
+#include "map.h"
+#include "printing.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The dedup file starts with a magic number and a version, followed by
+ * the hash of the spamword set the counts were taken with and the
+ * number of entries.  Each entry is stored as
+ *
+ *   u64 content hash, i32 spamword count
+ *
+ * most recently used first.  Numbers are stored in host byte order.
+ */
+#define DEDUP_MAGIC 0x44444653 /* "SFDD" */
+#define DEDUP_VERSION 1
+
+typedef struct entry entry_t;
+struct entry
+{
+    uint64_t hash; /* Key in the map; must come first */
+    int32_t count;
+    entry_t *prev; /* More recently used */
+    entry_t *next; /* Less recently used */
+};
+
+struct dedup
+{
+    char *filename;
+    map_t *entries; /* Content hash -> entry_t */
+    entry_t *head;  /* Most recently used */
+    entry_t *tail;  /* Least recently used */
+    int size;
+    int capacity;
+    uint64_t model; /* Hash of the spamword set */
+    int dirty;
+    pthread_mutex_t lock;
+};
+
+static int compare_hashes(void *a, void *b)
+{
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Keys are content hashes already.
+ */
+static uint64_t hash_key(void *key)
+{
+    return *(uint64_t *)key;
+}
+
+static void unlink_entry(dedup_t *dedup, entry_t *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        dedup->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        dedup->tail = entry->prev;
+}
+
+static void push_front(dedup_t *dedup, entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = dedup->head;
+    if (dedup->head != NULL)
+        dedup->head->prev = entry;
+    else
+        dedup->tail = entry;
+    dedup->head = entry;
+}
+
+static void push_back(dedup_t *dedup, entry_t *entry)
+{
+    entry->next = NULL;
+    entry->prev = dedup->tail;
+    if (dedup->tail != NULL)
+        dedup->tail->next = entry;
+    else
+        dedup->head = entry;
+    dedup->tail = entry;
+}
+
+/*
+ * Adds a new entry as the least recently used one, and returns it.
+ */
+static entry_t *add_entry(dedup_t *dedup, uint64_t hash, int count)
+{
+    entry_t *entry = malloc(sizeof(entry_t));
+
+    if (entry == NULL)
+        ERROR_PRINT("out of memory\n");
+    entry->hash = hash;
+    entry->count = count;
+    push_back(dedup, entry);
+    map_put(dedup->entries, &entry->hash, entry);
+    dedup->size++;
+    return entry;
+}
+
+/*
+ * Returns a hash of the words in the given set, in order.
+ */
+static uint64_t hash_set(set_t *words)
+{
+    set_iter_t *it = set_createiter(words);
+    uint64_t hash = 0;
+    char *word;
+
+    while (set_hasnext(it))
+    {
+        word = set_next(it);
+        hash = hash_bytes(word, strlen(word) + 1, hash);
+    }
+    set_destroyiter(it);
+    return hash;
+}
+
+/*
+ * Loads the entries saved in the given file, if it was made with the
+ * same spamword set.
+ */
+static void load(dedup_t *dedup, FILE *f)
+{
+    uint32_t magic, version, count, i;
+    uint64_t model, hash;
+    int32_t n;
+
+    if (fread(&magic, 4, 1, f) != 1 || fread(&version, 4, 1, f) != 1 ||
+        fread(&model, 8, 1, f) != 1 || fread(&count, 4, 1, f) != 1 ||
+        magic != DEDUP_MAGIC || version != DEDUP_VERSION || model != dedup->model)
+    {
+        dedup->dirty = 1;
+        return;
+    }
+    for (i = 0; i < count && dedup->size < dedup->capacity; i++)
+    {
+        if (fread(&hash, 8, 1, f) != 1 || fread(&n, 4, 1, f) != 1)
+        {
+            /* Keep what was read of a damaged file */
+            dedup->dirty = 1;
+            break;
+        }
+        if (!map_haskey(dedup->entries, &hash))
+            add_entry(dedup, hash, n);
+    }
+}
+
+dedup_t *dedup_open(char *filename, int capacity, set_t *spamwords)
+{
+    dedup_t *dedup = calloc(1, sizeof(dedup_t));
+    FILE *f;
+
+    if (dedup == NULL)
+        return NULL;
+    dedup->entries = map_create(compare_hashes, hash_key);
+    if (dedup->entries == NULL)
+        ERROR_PRINT("out of memory\n");
+    dedup->capacity = capacity;
+    dedup->model = hash_set(spamwords);
+    pthread_mutex_init(&dedup->lock, NULL);
+    if (filename == NULL)
+        return dedup;
+    dedup->filename = strdup(filename);
+    if (dedup->filename == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    f = fopen(filename, "rb");
+    if (f != NULL)
+    {
+        load(dedup, f);
+        fclose(f);
+    }
+    return dedup;
+}
+
+static int putbytes(FILE *f, const void *src, size_t n)
+{
+    return fwrite(src, 1, n, f) == n;
+}
+
+int dedup_save(dedup_t *dedup)
+{
+    uint32_t magic = DEDUP_MAGIC, version = DEDUP_VERSION, count = dedup->size;
+    entry_t *entry;
+    char *tmpname;
+    FILE *f;
+    int ok;
+
+    if (dedup->filename == NULL || !dedup->dirty)
+        return 1;
+
+    /* Write a new file and move it into place, as cache_save() does */
+    tmpname = malloc(strlen(dedup->filename) + 5);
+    if (tmpname == NULL)
+        ERROR_PRINT("out of memory\n");
+    sprintf(tmpname, "%s.tmp", dedup->filename);
+    f = fopen(tmpname, "wb");
+    if (f == NULL)
+    {
+        free(tmpname);
+        return 0;
+    }
+    ok = putbytes(f, &magic, 4) && putbytes(f, &version, 4) &&
+         putbytes(f, &dedup->model, 8) && putbytes(f, &count, 4);
+    for (entry = dedup->head; ok && entry != NULL; entry = entry->next)
+        ok = putbytes(f, &entry->hash, 8) && putbytes(f, &entry->count, 4);
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmpname, dedup->filename) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmpname);
+    else
+        dedup->dirty = 0;
+    free(tmpname);
+    return ok;
+}
+
+void dedup_destroy(dedup_t *dedup)
+{
+    entry_t *entry, *next;
+
+    for (entry = dedup->head; entry != NULL; entry = next)
+    {
+        next = entry->next;
+        free(entry);
+    }
+    map_destroy(dedup->entries);
+    pthread_mutex_destroy(&dedup->lock);
+    free(dedup->filename);
+    free(dedup);
+}
+
+uint64_t dedup_hash(const void *data, size_t len)
+{
+    return hash_bytes(data, len, 0);
+}
+
+int dedup_get(dedup_t *dedup, uint64_t hash, int *count)
+{
+    entry_t *entry;
+
+    pthread_mutex_lock(&dedup->lock);
+    entry = map_get(dedup->entries, &hash);
+    if (entry != NULL)
+    {
+        *count = entry->count;
+        if (entry != dedup->head)
+        {
+            unlink_entry(dedup, entry);
+            push_front(dedup, entry);
+            dedup->dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&dedup->lock);
+    return entry != NULL;
+}
+
+void dedup_put(dedup_t *dedup, uint64_t hash, int count)
+{
+    entry_t *entry;
+
+    if (dedup->capacity <= 0)
+        return;
+    pthread_mutex_lock(&dedup->lock);
+    entry = map_get(dedup->entries, &hash);
+    if (entry != NULL)
+    {
+        entry->count = count;
+        unlink_entry(dedup, entry);
+    }
+    else
+    {
+        if (dedup->size >= dedup->capacity)
+        {
+            /* Forget the least recently used mail */
+            entry = dedup->tail;
+            unlink_entry(dedup, entry);
+            map_remove(dedup->entries, &entry->hash);
+            free(entry);
+            dedup->size--;
+        }
+        entry = add_entry(dedup, hash, count);
+        unlink_entry(dedup, entry);
+    }
+    push_front(dedup, entry);
+    dedup->dirty = 1;
+    pthread_mutex_unlock(&dedup->lock);
+}
@@ -0,0 +1,126 @@
+#include "document.h"
+#include "printing.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Number of views allocated at a time.
+ */
+#define VIEWS_PER_BLOCK 1024
+
+/*
+ * Views are allocated in blocks, so that the views already handed to
+ * the word set never move.
+ */
+typedef struct viewblock viewblock_t;
+struct viewblock
+{
+    viewblock_t *next;
+    int used;
+    wordview_t views[VIEWS_PER_BLOCK];
+};
+
+struct document
+{
+    char *data;
+    size_t size;
+    set_t *words;
+    viewblock_t *blocks;
+};
+
+static wordview_t *newview(document_t *doc, const char *word, size_t len)
+{
+    viewblock_t *block = doc->blocks;
+
+    if (block == NULL || block->used == VIEWS_PER_BLOCK)
+    {
+        block = malloc(sizeof(viewblock_t));
+        if (block == NULL)
+            ERROR_PRINT("out of memory\n");
+        block->next = doc->blocks;
+        block->used = 0;
+        doc->blocks = block;
+    }
+    block->views[block->used].word = word;
+    block->views[block->used].len = len;
+    return &block->views[block->used++];
+}
+
+/*
+ * Adds a word to the document's word set, unless it is already there.
+ * Only the first occurrence of each word gets a view.
+ */
+static void addword(const char *word, size_t len, void *ctx)
+{
+    document_t *doc = ctx;
+    wordview_t view = {word, len};
+
+    if (!set_contains(doc->words, &view))
+        set_add(doc->words, newview(doc, word, len));
+}
+
+document_t *document_map(char *filename)
+{
+    document_t *doc;
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0)
+        goto error;
+
+    doc = malloc(sizeof(document_t));
+    if (doc == NULL)
+        goto error;
+    doc->data = NULL;
+    doc->size = st.st_size;
+    doc->blocks = NULL;
+    doc->words = set_create(compare_views);
+
+    /* Empty files cannot be mapped, but have no words either */
+    if (doc->size > 0)
+    {
+        doc->data = mmap(NULL, doc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (doc->data == MAP_FAILED)
+        {
+            set_destroy(doc->words);
+            free(doc);
+            goto error;
+        }
+        madvise(doc->data, doc->size, MADV_SEQUENTIAL);
+        tokenize_buffer(doc->data, doc->size, addword, doc);
+    }
+    close(fd);
+    return doc;
+
+error:
+    close(fd);
+    return NULL;
+}
+
+void document_destroy(document_t *doc)
+{
+    viewblock_t *block;
+
+    while (doc->blocks != NULL)
+    {
+        block = doc->blocks;
+        doc->blocks = block->next;
+        free(block);
+    }
+    set_destroy(doc->words);
+    if (doc->data != NULL)
+        munmap(doc->data, doc->size);
+    free(doc);
+}
+
+set_t *document_words(document_t *doc)
+{
+    return doc->words;
+}
@@ -0,0 +1,194 @@
+#include "map.h"
+#include "printing.h"
+
+#include <stdlib.h>
+
+/*
+ * The map is an open-addressing hash table with linear probing.  It
+ * is grown whenever it becomes more than half full.
+ */
+#define MAP_INITIAL_CAPACITY 16
+
+typedef struct mapentry mapentry_t;
+struct mapentry
+{
+    void *key;
+    void *value;
+    uint64_t hash;
+};
+
+struct map
+{
+    mapentry_t *entries;
+    size_t capacity; /* Always a power of two */
+    int size;
+    cmpfunc_t cmpfunc;
+    hashfunc_t hashfunc;
+};
+
+struct map_iter
+{
+    map_t *map;
+    size_t pos;
+};
+
+map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc)
+{
+    map_t *map = malloc(sizeof(map_t));
+    if (map == NULL)
+        return NULL;
+
+    map->entries = calloc(MAP_INITIAL_CAPACITY, sizeof(mapentry_t));
+    if (map->entries == NULL)
+    {
+        free(map);
+        return NULL;
+    }
+    map->capacity = MAP_INITIAL_CAPACITY;
+    map->size = 0;
+    map->cmpfunc = cmpfunc;
+    map->hashfunc = hashfunc;
+    return map;
+}
+
+void map_destroy(map_t *map)
+{
+    free(map->entries);
+    free(map);
+}
+
+int map_size(map_t *map)
+{
+    return map->size;
+}
+
+/*
+ * Returns the slot holding the given key, or the empty slot where it
+ * would be inserted.
+ */
+static mapentry_t *findslot(map_t *map, void *key, uint64_t hash)
+{
+    size_t mask = map->capacity - 1;
+    size_t i = hash & mask;
+
+    while (map->entries[i].key != NULL)
+    {
+        if (map->entries[i].hash == hash && map->cmpfunc(map->entries[i].key, key) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &map->entries[i];
+}
+
+static void grow(map_t *map)
+{
+    mapentry_t *old = map->entries;
+    size_t oldcapacity = map->capacity;
+    size_t i;
+
+    map->entries = calloc(oldcapacity * 2, sizeof(mapentry_t));
+    if (map->entries == NULL)
+        ERROR_PRINT("out of memory\n");
+    map->capacity = oldcapacity * 2;
+
+    for (i = 0; i < oldcapacity; i++)
+    {
+        if (old[i].key != NULL)
+            *findslot(map, old[i].key, old[i].hash) = old[i];
+    }
+    free(old);
+}
+
+void map_put(map_t *map, void *key, void *value)
+{
+    uint64_t hash = map->hashfunc(key);
+    mapentry_t *entry = findslot(map, key, hash);
+
+    if (entry->key == NULL)
+    {
+        if ((size_t)(map->size + 1) * 2 > map->capacity)
+        {
+            grow(map);
+            entry = findslot(map, key, hash);
+        }
+        entry->key = key;
+        entry->hash = hash;
+        map->size++;
+    }
+    entry->value = value;
+}
+
+void *map_get(map_t *map, void *key)
+{
+    mapentry_t *entry = findslot(map, key, map->hashfunc(key));
+    return entry->key != NULL ? entry->value : NULL;
+}
+
+int map_haskey(map_t *map, void *key)
+{
+    return findslot(map, key, map->hashfunc(key))->key != NULL;
+}
+
+void *map_remove(map_t *map, void *key)
+{
+    size_t mask = map->capacity - 1;
+    mapentry_t *entry = findslot(map, key, map->hashfunc(key));
+    void *stored = entry->key;
+    size_t hole, i, home;
+
+    if (stored == NULL)
+        return NULL;
+
+    /* Shift later entries of the probe sequence back into the hole, so
+     * that lookups never stop early at it. */
+    hole = entry - map->entries;
+    i = hole;
+    for (;;)
+    {
+        i = (i + 1) & mask;
+        if (map->entries[i].key == NULL)
+            break;
+        home = map->entries[i].hash & mask;
+        /* Move the entry unless its home lies cyclically in (hole, i] */
+        if ((i > hole && (home <= hole || home > i)) ||
+            (i < hole && (home <= hole && home > i)))
+        {
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+    map->entries[hole].key = NULL;
+    map->entries[hole].value = NULL;
+    map->size--;
+    return stored;
+}
+
+map_iter_t *map_createiter(map_t *map)
+{
+    map_iter_t *iter = malloc(sizeof(map_iter_t));
+    if (iter == NULL)
+        return NULL;
+
+    iter->map = map;
+    iter->pos = 0;
+    return iter;
+}
+
+void map_destroyiter(map_iter_t *iter)
+{
+    free(iter);
+}
+
+int map_hasnext(map_iter_t *iter)
+{
+    while (iter->pos < iter->map->capacity && iter->map->entries[iter->pos].key == NULL)
+        iter->pos++;
+    return iter->pos < iter->map->capacity;
+}
+
+void *map_next(map_iter_t *iter)
+{
+    if (!map_hasnext(iter))
+        return NULL;
+    return iter->map->entries[iter->pos++].key;
+}
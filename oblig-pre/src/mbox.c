@@ -0,0 +1,93 @@
+#define _GNU_SOURCE /* memmem(), memrchr() */
+#include "mbox.h"
+#include "printing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Number of bytes read from the stream at a time.
+ */
+#define MBOX_BUFSIZE 65536
+
+#define FROM_LINE "From "
+#define FROM_LENGTH 5
+
+int mbox_tokenize(FILE *file, tokenfunc_t emit, mboxfunc_t done, void *ctx, int options)
+{
+    tokenizer_t *tokenizer = tokenizer_create(emit, ctx, options);
+    size_t have = 0, pos = 0, n;
+    int linestart = 1; /* Is pos at the start of a line? */
+    int skipping = 0;  /* Is pos inside a "From " line? */
+    int message = 0;   /* Number of the current message, 0 before any text */
+    int eof = 0;
+    char *buf, *p;
+
+    buf = malloc(MBOX_BUFSIZE);
+    if (buf == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    for (;;)
+    {
+        /* Refill when the buffer is used up, or when a line starts too
+         * close to its end to tell whether it is a "From " line */
+        if (pos == have || (linestart && have - pos < FROM_LENGTH && !eof))
+        {
+            if (eof)
+                break;
+            have -= pos;
+            memmove(buf, buf + pos, have);
+            pos = 0;
+            n = fread(buf + have, 1, MBOX_BUFSIZE - have, file);
+            have += n;
+            if (n == 0)
+                eof = 1;
+            continue;
+        }
+
+        if (linestart && have - pos >= FROM_LENGTH &&
+            memcmp(buf + pos, FROM_LINE, FROM_LENGTH) == 0)
+        {
+            if (message > 0)
+            {
+                tokenizer_finish(tokenizer);
+                done(message, ctx);
+            }
+            message++;
+            skipping = 1;
+        }
+        else if (message == 0)
+        {
+            /* Text before any "From " line */
+            message = 1;
+        }
+
+        if (skipping)
+        {
+            p = memchr(buf + pos, '\n', have - pos);
+            linestart = p != NULL;
+            skipping = p == NULL;
+            pos = p != NULL ? (size_t)(p - buf) + 1 : have;
+            continue;
+        }
+
+        /* Feed everything up to the next line that may be a "From "
+         * line, or up to the last line start in the buffer */
+        p = memmem(buf + pos, have - pos, "\n" FROM_LINE, FROM_LENGTH + 1);
+        if (p == NULL)
+            p = memrchr(buf + pos, '\n', have - pos);
+        n = p != NULL ? (size_t)(p - buf) + 1 : have;
+        tokenizer_feed(tokenizer, buf + pos, n - pos);
+        linestart = p != NULL;
+        pos = n;
+    }
+
+    if (message > 0)
+    {
+        tokenizer_finish(tokenizer);
+        done(message, ctx);
+    }
+    tokenizer_destroy(tokenizer);
+    free(buf);
+    return message;
+}
@@ -0,0 +1,278 @@
+#include "model.h"
+#include "printing.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * A model file holds a header of six numbers: a magic number, the
+ * version, the number of words, the length of the word data, and the
+ * numbers of spam and nonspam mails counted.  The header is followed by
+ * two counts for each word, the spam mails and the nonspam mails that
+ * contain it, and then by the word data: the words, sorted and each
+ * terminated by a NUL, in the same order as their counts.  Numbers are
+ * stored in host byte order.
+ *
+ * Version 1 files hold a header of only the first four numbers,
+ * followed by the word data of the refined spamwords alone.
+ */
+#define MODEL_MAGIC 0x444d4653 /* "SFMD" */
+#define MODEL_VERSION 2
+
+struct model
+{
+    char *data;
+    set_t *spamwords;
+    bayes_t *counts; /* NULL for version 1 files */
+};
+
+struct spamcount
+{
+    set_t *spamwords;
+    set_t *hits; /* Copies of the spamwords seen in this mail */
+};
+
+/*
+ * A word and its counts, gathered for saving.
+ */
+typedef struct record
+{
+    const char *word;
+    uint32_t spam;
+    uint32_t ham;
+} record_t;
+
+typedef struct records
+{
+    record_t *records;
+    uint32_t nwords;
+    uint32_t nbytes;
+} records_t;
+
+static void gather(const char *word, int spam, int ham, void *ctx)
+{
+    records_t *r = ctx;
+    record_t *rec = &r->records[r->nwords++];
+
+    rec->word = word;
+    rec->spam = spam;
+    rec->ham = ham;
+    r->nbytes += strlen(word) + 1;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    return strcmp(((const record_t *)a)->word, ((const record_t *)b)->word);
+}
+
+static int putbytes(FILE *f, const void *src, size_t n)
+{
+    return fwrite(src, 1, n, f) == n;
+}
+
+int model_save(char *filename, bayes_t *counts)
+{
+    uint32_t header[6] = {MODEL_MAGIC, MODEL_VERSION, 0, 0, 0, 0};
+    records_t r = {NULL, 0, 0};
+    char *tmpname;
+    uint32_t i;
+    FILE *f;
+    int ok;
+
+    r.records = malloc((bayes_words(counts) + 1) * sizeof(record_t));
+    tmpname = malloc(strlen(filename) + 5);
+    if (r.records == NULL || tmpname == NULL)
+        ERROR_PRINT("out of memory\n");
+    bayes_foreach(counts, gather, &r);
+    qsort(r.records, r.nwords, sizeof(record_t), compare_records);
+    header[2] = r.nwords;
+    header[3] = r.nbytes;
+    header[4] = bayes_mails(counts, 1);
+    header[5] = bayes_mails(counts, 0);
+
+    /* Write a new file and move it into place, so that a failed update
+     * leaves the old model intact */
+    sprintf(tmpname, "%s.tmp", filename);
+    f = fopen(tmpname, "wb");
+    if (f == NULL)
+    {
+        free(tmpname);
+        free(r.records);
+        return 0;
+    }
+    ok = putbytes(f, header, sizeof(header));
+    for (i = 0; ok && i < r.nwords; i++)
+        ok = putbytes(f, &r.records[i].spam, sizeof(uint32_t)) &&
+             putbytes(f, &r.records[i].ham, sizeof(uint32_t));
+    for (i = 0; ok && i < r.nwords; i++)
+        ok = putbytes(f, r.records[i].word, strlen(r.records[i].word) + 1);
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmpname, filename) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmpname);
+    free(tmpname);
+    free(r.records);
+    return ok;
+}
+
+model_t *model_load(char *filename)
+{
+    uint32_t header[6] = {0}, *wordcounts = NULL, i, nspam;
+    model_t *model;
+    char *word, *end;
+    struct stat st;
+    uint64_t need;
+    size_t size;
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (f == NULL)
+        return NULL;
+    if (fread(header, sizeof(uint32_t), 4, f) != 4 || header[0] != MODEL_MAGIC ||
+        (header[1] != 1 && header[1] != MODEL_VERSION) ||
+        (header[1] == MODEL_VERSION && fread(header + 4, sizeof(uint32_t), 2, f) != 2))
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    /* Nothing is allocated for counts or word data the file cannot hold,
+     * so a damaged header is rejected like any other damaged file */
+    need = (uint64_t)(header[1] == MODEL_VERSION ? 6 : 4) * sizeof(uint32_t) + header[3];
+    if (header[1] == MODEL_VERSION)
+        need += (uint64_t)header[2] * 2 * sizeof(uint32_t);
+    if (fstat(fileno(f), &st) < 0 || (uint64_t)st.st_size < need)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    model = malloc(sizeof(model_t));
+    if (model == NULL || (model->data = malloc(header[3] + 1)) == NULL)
+        ERROR_PRINT("out of memory\n");
+    if (header[1] == MODEL_VERSION)
+    {
+        size = (size_t)header[2] * 2;
+        wordcounts = malloc(size * sizeof(uint32_t) + 1);
+        if (wordcounts == NULL)
+            ERROR_PRINT("out of memory\n");
+        if (fread(wordcounts, sizeof(uint32_t), size, f) != size)
+            header[3] = (uint32_t)-1;
+    }
+    if (header[3] == (uint32_t)-1 || fread(model->data, 1, header[3], f) != header[3])
+    {
+        fclose(f);
+        free(wordcounts);
+        free(model->data);
+        free(model);
+        return NULL;
+    }
+    fclose(f);
+    /* Make sure the last word is terminated, even in a damaged file */
+    model->data[header[3]] = 0;
+
+    /* The words are stored sorted; set.c appends those in constant time */
+    model->spamwords = set_create(compare_strings);
+    model->counts = wordcounts != NULL ? bayes_create() : NULL;
+    nspam = header[4];
+    word = model->data;
+    end = model->data + header[3];
+    for (i = 0; i < header[2] && word < end; i++)
+    {
+        if (wordcounts == NULL)
+        {
+            set_add(model->spamwords, word);
+        }
+        else
+        {
+            bayes_addcounts(model->counts, word, wordcounts[2 * i], wordcounts[2 * i + 1]);
+            /* Found in every spam mail, and in no nonspam mail */
+            if (nspam > 0 && wordcounts[2 * i] == nspam && wordcounts[2 * i + 1] == 0)
+                set_add(model->spamwords, word);
+        }
+        word += strlen(word) + 1;
+    }
+    if (model->counts != NULL)
+        bayes_addmails(model->counts, header[4], header[5]);
+    free(wordcounts);
+    return model;
+}
+
+void model_destroy(model_t *model)
+{
+    set_destroy(model->spamwords);
+    if (model->counts != NULL)
+        bayes_destroy(model->counts);
+    free(model->data);
+    free(model);
+}
+
+set_t *model_spamwords(model_t *model)
+{
+    return model->spamwords;
+}
+
+bayes_t *model_counts(model_t *model)
+{
+    return model->counts;
+}
+
+spamcount_t *spamcount_create(set_t *spamwords)
+{
+    spamcount_t *counter = malloc(sizeof(spamcount_t));
+
+    if (counter == NULL)
+        ERROR_PRINT("out of memory\n");
+    counter->spamwords = spamwords;
+    counter->hits = set_create(compare_strings);
+    return counter;
+}
+
+void spamcount_word(const char *word, size_t len, void *ctx)
+{
+    spamcount_t *counter = ctx;
+    char buf[101];
+    char *copy;
+
+    memcpy(buf, word, len);
+    buf[len] = 0;
+    if (set_contains(counter->spamwords, buf) && !set_contains(counter->hits, buf))
+    {
+        copy = strdup(buf);
+        if (copy == NULL)
+            ERROR_PRINT("out of memory\n");
+        set_add(counter->hits, copy);
+    }
+}
+
+int spamcount_hits(spamcount_t *counter)
+{
+    return set_size(counter->hits);
+}
+
+int spamcount_reset(spamcount_t *counter)
+{
+    int count = set_size(counter->hits);
+    set_iter_t *it;
+
+    if (count == 0)
+        return 0;
+    it = set_createiter(counter->hits);
+    while (set_hasnext(it))
+        free(set_next(it));
+    set_destroyiter(it);
+    set_destroy(counter->hits);
+    counter->hits = set_create(compare_strings);
+    return count;
+}
+
+void spamcount_destroy(spamcount_t *counter)
+{
+    spamcount_reset(counter);
+    set_destroy(counter->hits);
+    free(counter);
+}
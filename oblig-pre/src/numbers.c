@@ -1,14 +1,17 @@
 /* Author: Steffen Viken Valvaag <steffenv@cs.uit.no> */
 #include "set.h"
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "printing.h"
+#include "stats.h"
 
 static int compare_ints(void *a, void *b)
 {
     int *ia = a;
     int *ib = b;
 
+    STATS_COUNT(COUNTER_COMPARISONS, 1);
     return (*ia) - (*ib);
 }
 
@@ -46,11 +49,26 @@ static void dumpset(char *prefix, set_t *set)
     set_destroy(set);
 }
 
-int main()
+int main(int argc, char **argv)
 {
     struct timespec start_time, end_time;
     clock_gettime(CLOCK_MONOTONIC, &start_time);
 
+    /* --stats, --stats=table or --stats=json prints timers and counters
+     * to stderr; nothing else is accepted */
+    int stats_json = 0;
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "--stats") != 0 &&
+                     strcmp(argv[1], "--stats=table") != 0 && strcmp(argv[1], "--stats=json") != 0))
+    {
+        DEBUG_PRINT("usage: %s [--stats[=table|json]]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2)
+    {
+        stats_enable();
+        stats_json = strcmp(argv[1], "--stats=json") == 0;
+    }
+
     set_t *all, *evens, *odds, *nonprimes, *primes;
     int i, j, n = 50;
     int **numbers;
@@ -143,4 +161,8 @@ int main()
                           (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
 
     printf("Elapsed time: %.9f seconds\n", elapsed_time);
+    if (stats_enabled)
+    {
+        stats_print(stderr, stats_json);
+    }
 }
@@ -0,0 +1,365 @@
+#include "pack.h"
+#include "hash.h"
+#include "map.h"
+#include "printing.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A pack file is laid out as follows; all numbers are in host byte
+ * order, and every section starts on an 8-byte boundary.
+ *
+ *   header   the packheader struct below
+ *   dict     u32 offset of each word in the strings section, by ID
+ *   strings  the words, sorted and NUL-terminated
+ *   docs     a packdoc struct for each document
+ *   ids      u32 word IDs, each document's IDs sorted
+ *   names    the document names, NUL-terminated
+ *
+ * Word IDs are assigned in sorted word order, so a document's sorted
+ * IDs also list its words in sorted order.
+ */
+#define PACK_MAGIC 0x4b504653 /* "SFPK" */
+#define PACK_VERSION 1
+
+struct packheader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nwords;
+    uint32_t ndocs;
+    uint64_t dict;
+    uint64_t strings;
+    uint64_t docs;
+    uint64_t ids;
+    uint64_t names;
+    uint64_t size;
+};
+
+struct packdoc
+{
+    uint64_t first; /* Index of the document's first ID */
+    uint32_t nids;
+    uint32_t name;  /* Offset of the name in the names section */
+};
+
+struct pack
+{
+    char *data;
+    size_t size;
+    struct packheader *header;
+    uint32_t *dict;
+    char *strings;
+    struct packdoc *docs;
+    uint32_t *ids;
+    char *names;
+};
+
+/*
+ * A word of the corpus being packed.
+ */
+typedef struct packword packword_t;
+struct packword
+{
+    char *word;
+    uint32_t id;
+};
+
+/*
+ * A document of the corpus being packed; its unique words, in order.
+ */
+typedef struct packentry packentry_t;
+struct packentry
+{
+    char *name;
+    packword_t **words;
+    uint32_t nwords;
+};
+
+struct collect
+{
+    map_t *dictionary; /* Word -> packword_t */
+    set_t *docwords;   /* The packword_t's of the current document */
+};
+
+static int compare_packwords(void *a, void *b)
+{
+    return strcmp(((packword_t *)a)->word, ((packword_t *)b)->word);
+}
+
+/*
+ * Interns a word in the dictionary and adds it to the current document.
+ */
+static void addword(const char *word, size_t len, void *ctx)
+{
+    struct collect *c = ctx;
+    packword_t *pw;
+    char buf[101];
+
+    /* The tokenizer never produces words longer than 100 characters */
+    memcpy(buf, word, len);
+    buf[len] = 0;
+    pw = map_get(c->dictionary, buf);
+    if (pw == NULL)
+    {
+        pw = malloc(sizeof(packword_t));
+        if (pw == NULL || (pw->word = strdup(buf)) == NULL)
+            ERROR_PRINT("out of memory\n");
+        map_put(c->dictionary, pw->word, pw);
+    }
+    set_add(c->docwords, pw);
+}
+
+static int compare_wordptrs(const void *a, const void *b)
+{
+    return strcmp((*(packword_t *const *)a)->word, (*(packword_t *const *)b)->word);
+}
+
+static int putbytes(FILE *f, const void *src, size_t n)
+{
+    return fwrite(src, 1, n, f) == n;
+}
+
+/*
+ * Pads the file with zeroes up to the next 8-byte boundary, and returns
+ * the resulting offset.
+ */
+static uint64_t align(FILE *f, uint64_t offset)
+{
+    static const char zeroes[8];
+    size_t pad = (8 - offset % 8) % 8;
+
+    putbytes(f, zeroes, pad);
+    return offset + pad;
+}
+
+int pack_write(char *filename, list_t *files)
+{
+    struct collect c;
+    struct packheader header;
+    struct packdoc pd;
+    packentry_t *entries;
+    packword_t **words;
+    list_iter_t *lit;
+    set_iter_t *sit;
+    map_iter_t *mit;
+    uint64_t offset, first;
+    uint32_t i, j, ndocs, nwords, stroff, nameoff;
+    FILE *in, *out;
+    int ok;
+
+    /* Tokenize every document, interning its words */
+    c.dictionary = map_create(compare_strings, hash_string);
+    ndocs = list_size(files);
+    entries = calloc(ndocs + 1, sizeof(packentry_t));
+    if (c.dictionary == NULL || entries == NULL)
+        ERROR_PRINT("out of memory\n");
+
+    lit = list_createiter(files);
+    for (i = 0; list_hasnext(lit); i++)
+    {
+        entries[i].name = list_next(lit);
+        in = fopen(entries[i].name, "r");
+        if (in == NULL)
+        {
+            perror(entries[i].name);
+            list_destroyiter(lit);
+            return 0;
+        }
+        c.docwords = set_create(compare_packwords);
+        tokenize_file_cb_opt(in, addword, &c, TOKENIZE_FOLDCASE);
+        fclose(in);
+
+        entries[i].nwords = set_size(c.docwords);
+        entries[i].words = malloc((entries[i].nwords + 1) * sizeof(packword_t *));
+        if (entries[i].words == NULL)
+            ERROR_PRINT("out of memory\n");
+        sit = set_createiter(c.docwords);
+        for (j = 0; set_hasnext(sit); j++)
+            entries[i].words[j] = set_next(sit);
+        set_destroyiter(sit);
+        set_destroy(c.docwords);
+    }
+    list_destroyiter(lit);
+
+    /* Number the words in sorted order */
+    nwords = map_size(c.dictionary);
+    words = malloc((nwords + 1) * sizeof(packword_t *));
+    if (words == NULL)
+        ERROR_PRINT("out of memory\n");
+    mit = map_createiter(c.dictionary);
+    for (i = 0; map_hasnext(mit); i++)
+        words[i] = map_get(c.dictionary, map_next(mit));
+    map_destroyiter(mit);
+    qsort(words, nwords, sizeof(packword_t *), compare_wordptrs);
+    for (i = 0; i < nwords; i++)
+        words[i]->id = i;
+
+    out = fopen(filename, "wb");
+    if (out == NULL)
+        return 0;
+
+    /* Write the sections, leaving room for the header */
+    memset(&header, 0, sizeof(header));
+    header.magic = PACK_MAGIC;
+    header.version = PACK_VERSION;
+    header.nwords = nwords;
+    header.ndocs = ndocs;
+    ok = putbytes(out, &header, sizeof(header));
+    offset = sizeof(header);
+
+    header.dict = offset;
+    for (i = 0, stroff = 0; ok && i < nwords; i++)
+    {
+        ok = putbytes(out, &stroff, 4);
+        stroff += strlen(words[i]->word) + 1;
+    }
+    offset = align(out, offset + 4 * (uint64_t)nwords);
+
+    header.strings = offset;
+    for (i = 0; ok && i < nwords; i++)
+        ok = putbytes(out, words[i]->word, strlen(words[i]->word) + 1);
+    offset = align(out, offset + stroff);
+
+    header.docs = offset;
+    for (i = 0, first = 0, nameoff = 0; ok && i < ndocs; i++)
+    {
+        pd.first = first;
+        pd.nids = entries[i].nwords;
+        pd.name = nameoff;
+        ok = putbytes(out, &pd, sizeof(pd));
+        first += entries[i].nwords;
+        nameoff += strlen(entries[i].name) + 1;
+    }
+    offset += sizeof(pd) * (uint64_t)ndocs;
+
+    header.ids = offset;
+    for (i = 0; ok && i < ndocs; i++)
+    {
+        for (j = 0; ok && j < entries[i].nwords; j++)
+            ok = putbytes(out, &entries[i].words[j]->id, 4);
+    }
+    offset = align(out, offset + 4 * first);
+
+    header.names = offset;
+    for (i = 0; ok && i < ndocs; i++)
+        ok = putbytes(out, entries[i].name, strlen(entries[i].name) + 1);
+    header.size = offset + nameoff;
+
+    /* Now that the offsets are known, fill in the header */
+    if (ok)
+        ok = fseek(out, 0, SEEK_SET) == 0 && putbytes(out, &header, sizeof(header));
+    if (fclose(out) != 0)
+        ok = 0;
+
+    for (i = 0; i < ndocs; i++)
+        free(entries[i].words);
+    free(entries);
+    for (i = 0; i < nwords; i++)
+    {
+        free(words[i]->word);
+        free(words[i]);
+    }
+    free(words);
+    map_destroy(c.dictionary);
+    return ok;
+}
+
+pack_t *pack_open(char *filename)
+{
+    struct packheader *h;
+    struct stat st;
+    pack_t *pack;
+    uint32_t i;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct packheader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    pack = malloc(sizeof(pack_t));
+    if (pack == NULL)
+        ERROR_PRINT("out of memory\n");
+    pack->size = st.st_size;
+    pack->data = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pack->data == MAP_FAILED)
+    {
+        free(pack);
+        return NULL;
+    }
+
+    /* Check that every section lies within the file */
+    h = pack->header = (struct packheader *)pack->data;
+    if (h->magic != PACK_MAGIC || h->version != PACK_VERSION || h->size != pack->size ||
+        h->dict + 4 * (uint64_t)h->nwords > h->strings || h->strings > h->docs ||
+        h->docs + sizeof(struct packdoc) * (uint64_t)h->ndocs > h->ids ||
+        h->ids > h->names || h->names > h->size)
+    {
+        pack_close(pack);
+        return NULL;
+    }
+    pack->dict = (uint32_t *)(pack->data + h->dict);
+    pack->strings = pack->data + h->strings;
+    pack->docs = (struct packdoc *)(pack->data + h->docs);
+    pack->ids = (uint32_t *)(pack->data + h->ids);
+    pack->names = pack->data + h->names;
+    for (i = 0; i < h->ndocs; i++)
+    {
+        if (pack->docs[i].first + pack->docs[i].nids > (h->names - h->ids) / 4 ||
+            pack->docs[i].name >= h->size - h->names)
+        {
+            pack_close(pack);
+            return NULL;
+        }
+    }
+
+    madvise(pack->data, pack->size, MADV_WILLNEED);
+    return pack;
+}
+
+void pack_close(pack_t *pack)
+{
+    munmap(pack->data, pack->size);
+    free(pack);
+}
+
+int pack_size(pack_t *pack)
+{
+    return pack->header->ndocs;
+}
+
+char *pack_docname(pack_t *pack, int doc)
+{
+    return pack->names + pack->docs[doc].name;
+}
+
+set_t *pack_docwords(pack_t *pack, int doc)
+{
+    set_t *words = set_create(compare_strings);
+    uint32_t *ids = pack->ids + pack->docs[doc].first;
+    uint32_t i;
+
+    /* The IDs are sorted, and so are the words they stand for */
+    for (i = 0; i < pack->docs[doc].nids; i++)
+    {
+        if (ids[i] >= pack->header->nwords ||
+            pack->dict[ids[i]] >= pack->header->docs - pack->header->strings)
+        {
+            ERROR_PRINT("corrupt pack\n");
+            continue;
+        }
+        set_add(words, pack->strings + pack->dict[ids[i]]);
+    }
+    return words;
+}
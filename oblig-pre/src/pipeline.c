@@ -0,0 +1,192 @@
+#include "pipeline.h"
+#include "common.h"
+#include "printing.h"
+#include "queue.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * Number of bytes of a mail scanned before its spamwords are checked
+ * against the threshold.
+ */
+#define PIPELINE_BLOCK 65536
+
+/*
+ * A mail on its way through the pipeline.
+ */
+typedef struct job
+{
+    char *path;
+    char *data;
+    size_t len;
+    int failed; /* Set if the mail could not be read */
+    int count;
+    int partial;
+} job_t;
+
+typedef struct pipeline
+{
+    walker_t *walker;
+    queue_t *mails;   /* Read mails, waiting to be scanned */
+    queue_t *results; /* Scanned mails, waiting to be reported */
+    automaton_t *automaton;
+    dedup_t *dedup;
+    int threshold;
+    atomic_int readers;  /* Readers still running */
+    atomic_int scanners; /* Scanners still running */
+} pipeline_t;
+
+static void *read_stage(void *arg)
+{
+    pipeline_t *p = arg;
+    char *path;
+    job_t *job;
+
+    while ((path = walk_next(p->walker)) != NULL)
+    {
+        job = calloc(1, sizeof(job_t));
+        if (job == NULL)
+            ERROR_PRINT("out of memory\n");
+        job->path = path;
+        job->data = read_file(path, &job->len);
+        job->failed = job->data == NULL;
+        STATS_COUNT(COUNTER_FILES, 1);
+        queue_push(p->mails, job);
+    }
+    /* The last reader out tells the scanners that no more mails come */
+    if (atomic_fetch_sub(&p->readers, 1) == 1)
+        queue_close(p->mails);
+    return NULL;
+}
+
+/*
+ * Counts the spamwords in a mail that has been read.
+ */
+static void scan(pipeline_t *p, scanner_t *scanner, job_t *job)
+{
+    uint64_t hash = 0;
+    size_t pos, n;
+
+    if (p->dedup != NULL)
+    {
+        hash = dedup_hash(job->data, job->len);
+        if (dedup_get(p->dedup, hash, &job->count))
+        {
+            STATS_COUNT(COUNTER_DEDUP_HITS, 1);
+            return;
+        }
+    }
+    for (pos = 0; pos < job->len; pos += n)
+    {
+        n = job->len - pos < PIPELINE_BLOCK ? job->len - pos : PIPELINE_BLOCK;
+        scanner_feed(scanner, job->data + pos, n);
+        if (p->threshold > 0 && scanner_hits(scanner) >= p->threshold)
+        {
+            job->partial = pos + n < job->len;
+            pos += n;
+            break;
+        }
+    }
+    STATS_COUNT(COUNTER_BYTES, pos);
+    job->count = scanner_finish(scanner);
+    /* Only whole mails give counts that hold for their duplicates */
+    if (p->dedup != NULL && !job->partial)
+        dedup_put(p->dedup, hash, job->count);
+}
+
+static void *scan_stage(void *arg)
+{
+    pipeline_t *p = arg;
+    scanner_t *scanner = scanner_create(p->automaton);
+    job_t *job;
+
+    while ((job = queue_pop(p->mails)) != NULL)
+    {
+        if (!job->failed)
+        {
+            scan(p, scanner, job);
+            free(job->data);
+        }
+        queue_push(p->results, job);
+    }
+    scanner_destroy(scanner);
+    if (atomic_fetch_sub(&p->scanners, 1) == 1)
+        queue_close(p->results);
+    return NULL;
+}
+
+/*
+ * Starts n threads running the given stage.
+ */
+static pthread_t *start_stage(int n, void *(*stage)(void *), pipeline_t *p)
+{
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    int i;
+
+    if (threads == NULL)
+        ERROR_PRINT("out of memory\n");
+    for (i = 0; i < n; i++)
+    {
+        if (pthread_create(&threads[i], NULL, stage, p) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+    return threads;
+}
+
+static void join_stage(int n, pthread_t *threads)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+void pipeline_classify(char *root, automaton_t *automaton, dedup_t *dedup, int threshold,
+                       pipeline_config_t *config, resultfunc_t done, void *ctx)
+{
+    uint64_t start = STATS_START();
+    int readers = config->readers > 0 ? config->readers : 1;
+    int scanners = config->scanners > 0 ? config->scanners : 1;
+    int depth = config->depth > 0 ? config->depth : 1;
+    pthread_t *reading, *scanning;
+    uint64_t mails = 0;
+    pipeline_t p;
+    job_t *job;
+
+    p.walker = walk_start(root, config->walkers);
+    p.mails = queue_create(depth);
+    p.results = queue_create(depth);
+    if (p.mails == NULL || p.results == NULL)
+        ERROR_PRINT("out of memory\n");
+    p.automaton = automaton;
+    p.dedup = dedup;
+    p.threshold = threshold;
+    atomic_init(&p.readers, readers);
+    atomic_init(&p.scanners, scanners);
+
+    reading = start_stage(readers, read_stage, &p);
+    scanning = start_stage(scanners, scan_stage, &p);
+
+    /* The output stage */
+    while ((job = queue_pop(p.results)) != NULL)
+    {
+        if (job->failed)
+            ERROR_PRINT("reading %s failed\n", job->path);
+        done(job->path, job->count, job->partial, ctx);
+        free(job->path);
+        free(job);
+        mails++;
+    }
+
+    join_stage(readers, reading);
+    join_stage(scanners, scanning);
+    walk_destroy(p.walker);
+    queue_destroy(p.mails);
+    queue_destroy(p.results);
+    STATS_COUNT(COUNTER_MAILS, mails);
+    STATS_STOP(TIMER_CLASSIFY, start);
+}
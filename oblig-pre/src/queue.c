@@ -0,0 +1,306 @@
+#include "queue.h"
+#include "list.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * Number of times a full or empty bounded queue is retried before the
+ * calling thread goes to sleep.
+ */
+#define QUEUE_SPINS 64
+
+/*
+ * A slot of a bounded queue.  The sequence number tells whose turn it
+ * is: a pusher may fill the slot at position pos when it equals pos,
+ * and a popper may empty it when it equals pos + 1.
+ */
+typedef struct cell
+{
+    atomic_size_t seq;
+    void *elem;
+} cell_t;
+
+/*
+ * Bounded queues are rings of cells that pushers and poppers claim with
+ * compare-and-swap (Dmitry Vyukov's MPMC queue), and only take the lock
+ * to sleep when the ring is full or empty.  Unbounded queues are lists
+ * guarded by the lock.
+ */
+struct queue
+{
+    list_t *elems; /* Unbounded queues only */
+    cell_t *cells; /* Bounded queues only */
+    int capacity;
+    atomic_size_t head; /* Next position to pop */
+    atomic_size_t tail; /* Next position to push */
+    atomic_int closed;
+    atomic_int sleepers; /* Threads waiting on a bounded queue */
+    atomic_int pushing;  /* Threads pushing onto a bounded queue */
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+};
+
+queue_t *queue_create(int capacity)
+{
+    queue_t *queue = calloc(1, sizeof(queue_t));
+    int i;
+
+    if (queue == NULL)
+        return NULL;
+
+    if (capacity > 0)
+    {
+        /* With one cell, a full ring looks just like an empty one, so a
+         * ring always has at least two */
+        if (capacity < 2)
+            capacity = 2;
+        queue->cells = malloc(capacity * sizeof(cell_t));
+        if (queue->cells == NULL)
+        {
+            free(queue);
+            return NULL;
+        }
+        for (i = 0; i < capacity; i++)
+            atomic_init(&queue->cells[i].seq, i);
+    }
+    else
+    {
+        queue->elems = list_create(NULL);
+        if (queue->elems == NULL)
+        {
+            free(queue);
+            return NULL;
+        }
+    }
+    queue->capacity = capacity;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->closed, 0);
+    atomic_init(&queue->sleepers, 0);
+    atomic_init(&queue->pushing, 0);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->nonempty, NULL);
+    pthread_cond_init(&queue->nonfull, NULL);
+    return queue;
+}
+
+void queue_destroy(queue_t *queue)
+{
+    pthread_cond_destroy(&queue->nonfull);
+    pthread_cond_destroy(&queue->nonempty);
+    pthread_mutex_destroy(&queue->lock);
+    if (queue->elems != NULL)
+        list_destroy(queue->elems);
+    free(queue->cells);
+    free(queue);
+}
+
+/*
+ * Pushes an element onto a bounded queue without waiting.  Returns 0 if
+ * the queue is full.
+ */
+static int ring_push(queue_t *queue, void *elem)
+{
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    cell_t *cell;
+    size_t seq;
+
+    for (;;)
+    {
+        cell = &queue->cells[pos % queue->capacity];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == pos)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    cell->elem = elem;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Pops an element off a bounded queue without waiting.  Returns NULL if
+ * the queue is empty.
+ */
+static void *ring_pop(queue_t *queue)
+{
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    cell_t *cell;
+    void *elem;
+    size_t seq;
+
+    for (;;)
+    {
+        cell = &queue->cells[pos % queue->capacity];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == pos + 1)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if ((ptrdiff_t)(seq - (pos + 1)) < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+    elem = cell->elem;
+    atomic_store_explicit(&cell->seq, pos + queue->capacity, memory_order_release);
+    return elem;
+}
+
+/*
+ * Wakes the threads sleeping on a bounded queue, if there are any, after
+ * an element was pushed or popped.  Sleepers announce themselves before
+ * they check the queue a last time, so either they see the change or it
+ * sees them.
+ */
+static void ring_wake(queue_t *queue)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->sleepers, memory_order_relaxed) > 0)
+    {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->nonempty);
+        pthread_cond_broadcast(&queue->nonfull);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+static int ring_push_wait(queue_t *queue, void *elem)
+{
+    int spins = 0, ok;
+
+    /* Announce the push before checking that the queue is open, so that
+     * a popper that sees the queue closed waits for it */
+    atomic_fetch_add(&queue->pushing, 1);
+    for (;;)
+    {
+        if (atomic_load(&queue->closed))
+        {
+            ok = 0;
+            break;
+        }
+        if ((ok = ring_push(queue, elem)))
+            break;
+        if (++spins < QUEUE_SPINS)
+        {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&queue->lock);
+        atomic_fetch_add(&queue->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        ok = !atomic_load(&queue->closed) && ring_push(queue, elem);
+        if (!ok && !atomic_load(&queue->closed))
+            pthread_cond_wait(&queue->nonfull, &queue->lock);
+        atomic_fetch_sub(&queue->sleepers, 1);
+        pthread_mutex_unlock(&queue->lock);
+        if (ok)
+            break;
+    }
+    atomic_fetch_sub(&queue->pushing, 1);
+    if (ok)
+        ring_wake(queue);
+    return ok;
+}
+
+static void *ring_pop_wait(queue_t *queue)
+{
+    int spins = 0;
+    void *elem;
+
+    for (;;)
+    {
+        if ((elem = ring_pop(queue)) != NULL)
+            break;
+        /* Nothing is pushed once the queue is closed, but pushes under
+         * way may still land */
+        if (atomic_load(&queue->closed))
+        {
+            while (atomic_load(&queue->pushing) > 0)
+                sched_yield();
+            if ((elem = ring_pop(queue)) != NULL)
+                break;
+            return NULL;
+        }
+        if (++spins < QUEUE_SPINS)
+        {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&queue->lock);
+        atomic_fetch_add(&queue->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        elem = ring_pop(queue);
+        if (elem == NULL && !atomic_load(&queue->closed))
+            pthread_cond_wait(&queue->nonempty, &queue->lock);
+        atomic_fetch_sub(&queue->sleepers, 1);
+        pthread_mutex_unlock(&queue->lock);
+        if (elem != NULL)
+            break;
+    }
+    ring_wake(queue);
+    return elem;
+}
+
+int queue_push(queue_t *queue, void *elem)
+{
+    int ok = 0;
+
+    if (queue->cells != NULL)
+        return ring_push_wait(queue, elem);
+
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->closed)
+    {
+        ok = list_addlast(queue->elems, elem);
+        pthread_cond_signal(&queue->nonempty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok;
+}
+
+void *queue_pop(queue_t *queue)
+{
+    void *elem;
+
+    if (queue->cells != NULL)
+        return ring_pop_wait(queue);
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->closed && list_size(queue->elems) == 0)
+        pthread_cond_wait(&queue->nonempty, &queue->lock);
+    elem = list_popfirst(queue->elems);
+    pthread_mutex_unlock(&queue->lock);
+    return elem;
+}
+
+void queue_close(queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->closed, 1);
+    pthread_cond_broadcast(&queue->nonempty);
+    pthread_cond_broadcast(&queue->nonfull);
+    pthread_mutex_unlock(&queue->lock);
+}
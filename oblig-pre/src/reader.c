@@ -0,0 +1,535 @@
+#include "reader.h"
+#include "printing.h"
+#include "queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(NO_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define USE_IO_URING
+#endif
+
+/*
+ * A file being read into memory.
+ */
+typedef struct slot
+{
+    int fd;
+    readbuf_t buf;
+    size_t size; /* Size of the file when it was opened */
+#ifdef USE_IO_URING
+    struct iovec iov;
+#endif
+} slot_t;
+
+#ifdef USE_IO_URING
+/*
+ * The rings shared with the kernel.
+ */
+typedef struct ring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned unsubmitted; /* Entries queued but not yet passed to the kernel */
+} ring_t;
+#endif
+
+struct reader
+{
+    char **files;
+    int nfiles;
+    int depth;
+    int next;          /* Next file to start reading */
+    int handed;        /* Files handed out so far */
+    pthread_mutex_t lock;
+    pthread_cond_t ready; /* Signalled when a file was opened or the kernel waited on */
+
+    /* io_uring */
+    int uring;         /* Set if reads go through io_uring */
+    int inflight;      /* Reads queued and not yet completed */
+    int opening;       /* Files being opened, outside the lock */
+    int waiting;       /* Set while a thread waits in the kernel */
+    slot_t *slots;     /* One per read in flight */
+    int *free_slots;
+    int nfree;
+#ifdef USE_IO_URING
+    ring_t ring;
+#endif
+
+    /* Thread pool */
+    queue_t *done;     /* Files read, waiting to be handed out */
+    pthread_t *threads;
+    int nthreads;
+    int running;       /* Threads still reading */
+    int stopping;
+};
+
+/*
+ * Opens the given file of the list and allocates a buffer for its
+ * contents.  Returns 1 if the file remains to be read into the buffer,
+ * and 0 if the slot is already complete (empty or failed).
+ */
+static int open_slot(reader_t *r, slot_t *s, int index)
+{
+    struct stat st;
+
+    memset(s, 0, sizeof(slot_t));
+    s->buf.index = index;
+    s->fd = open(r->files[index], O_RDONLY);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0)
+    {
+        s->buf.error = errno;
+        if (s->fd >= 0)
+            close(s->fd);
+        s->fd = -1;
+        return 0;
+    }
+    s->size = st.st_size;
+    /* One extra byte, so that the contents can be terminated */
+    s->buf.data = malloc(s->size + 1);
+    if (s->buf.data == NULL)
+        ERROR_PRINT("out of memory\n");
+    if (s->size == 0)
+    {
+        close(s->fd);
+        s->fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+static void close_slot(slot_t *s)
+{
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+}
+
+/*
+ * Reads a whole file with blocking reads.
+ */
+static void read_blocking(reader_t *r, slot_t *s, int index)
+{
+    ssize_t n;
+
+    if (!open_slot(r, s, index))
+        return;
+    while (s->buf.len < s->size)
+    {
+        n = read(s->fd, s->buf.data + s->buf.len, s->size - s->buf.len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            s->buf.error = errno;
+            free(s->buf.data);
+            s->buf.data = NULL;
+            break;
+        }
+        if (n == 0)
+            break; /* The file shrank */
+        s->buf.len += n;
+    }
+    close_slot(s);
+}
+
+/*
+ * Reads files until there are none left, queueing their contents.
+ */
+static void *read_worker(void *arg)
+{
+    reader_t *r = arg;
+    readbuf_t *buf;
+    slot_t slot;
+    int index;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&r->lock);
+        index = r->stopping ? r->nfiles : r->next++;
+        pthread_mutex_unlock(&r->lock);
+        if (index >= r->nfiles)
+            break;
+        read_blocking(r, &slot, index);
+        buf = malloc(sizeof(readbuf_t));
+        if (buf == NULL)
+            ERROR_PRINT("out of memory\n");
+        *buf = slot.buf;
+        if (!queue_push(r->done, buf))
+        {
+            free(buf->data);
+            free(buf);
+        }
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (--r->running == 0)
+        queue_close(r->done);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/*
+ * Starts the threads doing blocking reads: one per read in flight, but
+ * no more than there are CPUs.
+ */
+static void start_threads(reader_t *r)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    r->nthreads = ncpus > 0 && ncpus < r->depth ? ncpus : r->depth;
+    r->done = queue_create(r->depth);
+    r->threads = malloc(r->nthreads * sizeof(pthread_t));
+    if (r->done == NULL || r->threads == NULL)
+        ERROR_PRINT("out of memory\n");
+    r->running = r->nthreads;
+    for (i = 0; i < r->nthreads; i++)
+    {
+        if (pthread_create(&r->threads[i], NULL, read_worker, r) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+}
+
+#ifdef USE_IO_URING
+static int ring_setup(ring_t *ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(ring_t));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return 0;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        close(ring->fd);
+        return 0;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_map = ring->sq_map;
+    else
+        ring->cq_map = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+            munmap(ring->cq_map, ring->cq_size);
+        munmap(ring->sq_map, ring->sq_size);
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_map + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_map + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_map + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_map + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_map + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_map + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_map + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + p.cq_off.cqes);
+    return 1;
+}
+
+static void ring_teardown(ring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_size);
+    munmap(ring->sq_map, ring->sq_size);
+    close(ring->fd);
+}
+
+/*
+ * Queues a read of the rest of the slot's file.  The ring has an entry
+ * for every slot, so there is always room.
+ */
+static void ring_queue_read(ring_t *ring, slot_t *s, int slot)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[i];
+
+    s->iov.iov_base = s->buf.data + s->buf.len;
+    s->iov.iov_len = s->size - s->buf.len;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&s->iov;
+    sqe->len = 1;
+    sqe->off = s->buf.len;
+    sqe->user_data = slot;
+    ring->sq_array[i] = i;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
+
+/*
+ * Passes the given number of queued reads to the kernel and waits for a
+ * completion.  Returns the number of reads passed, or -1 if the kernel
+ * refused.
+ */
+static int ring_enter(ring_t *ring, unsigned submit)
+{
+    int n;
+
+    do
+    {
+        n = syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+    return n < (int)submit ? n : (int)submit;
+}
+
+/*
+ * Takes the next completion off the ring, if there is one.
+ */
+static int ring_reap(ring_t *ring, int *slot, int *res)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *slot = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Hands out the next file read through io_uring.  Called with the lock
+ * held, which is dropped while a file is opened and while waiting in the
+ * kernel.  Only one thread waits in the kernel at a time, and only it
+ * takes completions meanwhile, so that the completion it waits for
+ * cannot be taken by another thread; the others wait for it to return.
+ */
+static int uring_next(reader_t *r, readbuf_t *buf)
+{
+    int index, slot, res, ok, n;
+    unsigned submit;
+    slot_t *s;
+
+    for (;;)
+    {
+        if (r->waiting)
+        {
+            pthread_cond_wait(&r->ready, &r->lock);
+            continue;
+        }
+
+        /* Keep the ring full */
+        if (r->nfree > 0 && r->next < r->nfiles)
+        {
+            index = r->next++;
+            slot = r->free_slots[--r->nfree];
+            s = &r->slots[slot];
+            r->opening++;
+            pthread_mutex_unlock(&r->lock);
+            ok = open_slot(r, s, index);
+            pthread_mutex_lock(&r->lock);
+            r->opening--;
+            pthread_cond_broadcast(&r->ready);
+            if (!ok)
+            {
+                /* Nothing to read; hand it out right away */
+                r->free_slots[r->nfree++] = slot;
+                *buf = s->buf;
+                return 1;
+            }
+            r->inflight++;
+            ring_queue_read(&r->ring, s, slot);
+            continue;
+        }
+
+        if (!ring_reap(&r->ring, &slot, &res))
+        {
+            if (r->inflight == 0)
+            {
+                if (r->opening == 0)
+                    return 0;
+                pthread_cond_wait(&r->ready, &r->lock);
+                continue;
+            }
+            submit = r->ring.unsubmitted;
+            r->ring.unsubmitted = 0;
+            r->waiting = 1;
+            pthread_mutex_unlock(&r->lock);
+            n = ring_enter(&r->ring, submit);
+            pthread_mutex_lock(&r->lock);
+            r->waiting = 0;
+            pthread_cond_broadcast(&r->ready);
+            if (n < 0)
+                ERROR_PRINT("io_uring_enter() failed\n");
+            r->ring.unsubmitted += submit - n;
+            continue;
+        }
+
+        s = &r->slots[slot];
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            ring_queue_read(&r->ring, s, slot);
+            continue;
+        }
+        if (res < 0)
+        {
+            s->buf.error = -res;
+            free(s->buf.data);
+            s->buf.data = NULL;
+        }
+        else
+        {
+            s->buf.len += res;
+            if (res > 0 && s->buf.len < s->size)
+            {
+                /* Short read; ask for the rest */
+                ring_queue_read(&r->ring, s, slot);
+                continue;
+            }
+        }
+        close_slot(s);
+        r->inflight--;
+        r->free_slots[r->nfree++] = slot;
+        *buf = s->buf;
+        return 1;
+    }
+}
+#endif
+
+reader_t *reader_start(char **files, int nfiles, int depth)
+{
+    reader_t *r = calloc(1, sizeof(reader_t));
+    int i;
+
+    if (r == NULL)
+        ERROR_PRINT("out of memory\n");
+    r->files = files;
+    r->nfiles = nfiles;
+    r->depth = depth > 0 ? depth : 1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+
+#ifdef USE_IO_URING
+    if (ring_setup(&r->ring, r->depth))
+    {
+        r->uring = 1;
+        r->slots = malloc(r->depth * sizeof(slot_t));
+        r->free_slots = malloc(r->depth * sizeof(int));
+        if (r->slots == NULL || r->free_slots == NULL)
+            ERROR_PRINT("out of memory\n");
+        for (i = 0; i < r->depth; i++)
+            r->free_slots[i] = i;
+        r->nfree = r->depth;
+        return r;
+    }
+#endif
+    (void)i;
+    start_threads(r);
+    return r;
+}
+
+int reader_next(reader_t *r, readbuf_t *buf)
+{
+    readbuf_t *done;
+    int ok = 0;
+
+    if (r->uring)
+    {
+#ifdef USE_IO_URING
+        pthread_mutex_lock(&r->lock);
+        ok = uring_next(r, buf);
+        pthread_mutex_unlock(&r->lock);
+#endif
+        return ok;
+    }
+
+    done = queue_pop(r->done);
+    if (done == NULL)
+        return 0;
+    *buf = *done;
+    free(done);
+    return 1;
+}
+
+void reader_destroy(reader_t *r)
+{
+    readbuf_t *done;
+    int i;
+
+    if (r->uring)
+    {
+#ifdef USE_IO_URING
+        int slot, res, n;
+
+        /* Let the reads in flight finish before freeing their buffers */
+        while (r->inflight > 0)
+        {
+            if (!ring_reap(&r->ring, &slot, &res))
+            {
+                n = ring_enter(&r->ring, r->ring.unsubmitted);
+                if (n < 0)
+                    break;
+                r->ring.unsubmitted -= n;
+                continue;
+            }
+            close_slot(&r->slots[slot]);
+            free(r->slots[slot].buf.data);
+            r->inflight--;
+        }
+        ring_teardown(&r->ring);
+        free(r->slots);
+        free(r->free_slots);
+#endif
+    }
+    else
+    {
+        pthread_mutex_lock(&r->lock);
+        r->stopping = 1;
+        pthread_mutex_unlock(&r->lock);
+        /* Drain the queue so that no thread stays blocked on it */
+        while ((done = queue_pop(r->done)) != NULL)
+        {
+            free(done->data);
+            free(done);
+        }
+        for (i = 0; i < r->nthreads; i++)
+            pthread_join(r->threads[i], NULL);
+        queue_destroy(r->done);
+        free(r->threads);
+    }
+    pthread_cond_destroy(&r->ready);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
@@ -0,0 +1,457 @@
+#include "scheduler.h"
+#include "printing.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Number of tasks a deque holds before it grows.
+ */
+#define DEQUE_SIZE 256
+
+/*
+ * Number of times an idle thread looks for work before it sleeps.
+ */
+#define IDLE_SPINS 64
+
+typedef struct task
+{
+    taskfunc_t func;
+    void *arg;
+    taskgroup_t *group;
+} task_t;
+
+struct taskgroup
+{
+    atomic_int pending;
+};
+
+/*
+ * The tasks of a deque, in a ring.  Replaced arrays are kept until the
+ * deque is destroyed, since a thief may still be reading them.
+ */
+typedef struct array array_t;
+struct array
+{
+    long size;
+    array_t *retired;
+    _Atomic(task_t *) tasks[];
+};
+
+/*
+ * A Chase-Lev deque, with the memory orders of Le et al., "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).  Only
+ * its owner pushes and takes at the bottom; anyone steals at the top.
+ */
+typedef struct deque
+{
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(array_t *) array;
+} deque_t;
+
+typedef struct worker
+{
+    scheduler_t *scheduler;
+    deque_t deque;
+    unsigned seed; /* For picking victims */
+    pthread_t thread;
+} worker_t;
+
+struct scheduler
+{
+    int nthreads;
+    worker_t *workers; /* nthreads - 1 threads of its own */
+    deque_t inject;    /* Tasks spawned by other threads */
+    pthread_mutex_t inject_lock;
+    atomic_int stopping;
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+};
+
+/*
+ * The worker run by the current thread, if any.
+ */
+static _Thread_local worker_t *self;
+
+static array_t *array_create(long size)
+{
+    array_t *a = malloc(sizeof(array_t) + size * sizeof(a->tasks[0]));
+
+    if (a == NULL)
+        ERROR_PRINT("out of memory\n");
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+static void deque_init(deque_t *d)
+{
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, array_create(DEQUE_SIZE));
+}
+
+static void deque_free(deque_t *d)
+{
+    array_t *a = atomic_load(&d->array), *next;
+
+    for (; a != NULL; a = next)
+    {
+        next = a->retired;
+        free(a);
+    }
+}
+
+static array_t *deque_grow(deque_t *d, array_t *a, long top, long bottom)
+{
+    array_t *grown = array_create(a->size * 2);
+    long i;
+
+    for (i = top; i < bottom; i++)
+        atomic_store_explicit(&grown->tasks[i & (grown->size - 1)],
+                              atomic_load_explicit(&a->tasks[i & (a->size - 1)], memory_order_relaxed),
+                              memory_order_relaxed);
+    grown->retired = a;
+    atomic_store_explicit(&d->array, grown, memory_order_release);
+    return grown;
+}
+
+static void deque_push(deque_t *d, task_t *task)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+    if (b - t > a->size - 1)
+        a = deque_grow(d, a, t, b);
+    atomic_store_explicit(&a->tasks[b & (a->size - 1)], task, memory_order_relaxed);
+    /* Publishes the task to thieves, who read bottom with acquire */
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
+
+static task_t *deque_take(deque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    array_t *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    task_t *task = NULL;
+    long t;
+
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t <= b)
+    {
+        task = atomic_load_explicit(&a->tasks[b & (a->size - 1)], memory_order_relaxed);
+        if (t == b)
+        {
+            /* The last task; race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed))
+                task = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/*
+ * Steals the oldest task of the given deque.  Returns NULL if the deque
+ * is empty, or if another thread got the task first.
+ */
+static task_t *deque_steal(deque_t *d)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    array_t *a;
+    task_t *task;
+    long b;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    a = atomic_load_explicit(&d->array, memory_order_acquire);
+    task = atomic_load_explicit(&a->tasks[t & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+static int deque_empty(deque_t *d)
+{
+    return atomic_load(&d->top) >= atomic_load(&d->bottom);
+}
+
+/*
+ * Returns 1 if any deque of the scheduler holds a task.
+ */
+static int has_work(scheduler_t *s)
+{
+    int i;
+
+    if (!deque_empty(&s->inject))
+        return 1;
+    for (i = 0; i < s->nthreads - 1; i++)
+    {
+        if (!deque_empty(&s->workers[i].deque))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Finds a task to run: one of the calling thread's own, or else one
+ * stolen from a random victim.  Returns NULL if none was found.
+ */
+static task_t *find_task(scheduler_t *s)
+{
+    worker_t *me = self != NULL && self->scheduler == s ? self : NULL;
+    int nvictims = s->nthreads, first, i, v;
+    unsigned seed = (unsigned)(size_t)&seed;
+    task_t *task;
+
+    if (me != NULL)
+    {
+        if ((task = deque_take(&me->deque)) != NULL)
+            return task;
+        seed = me->seed = me->seed * 1103515245 + 12345;
+    }
+    else if (!deque_empty(&s->inject))
+    {
+        /* Threads outside the pool share the owner's end of inject */
+        pthread_mutex_lock(&s->inject_lock);
+        task = deque_take(&s->inject);
+        pthread_mutex_unlock(&s->inject_lock);
+        if (task != NULL)
+            return task;
+    }
+
+    /* Victim nthreads - 1 is the inject deque */
+    first = (seed >> 16) % nvictims;
+    for (i = 0; i < nvictims; i++)
+    {
+        v = (first + i) % nvictims;
+        task = deque_steal(v == nvictims - 1 ? &s->inject : &s->workers[v].deque);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/*
+ * Takes the newest task at the calling thread's end of the deques, if
+ * it belongs to the given group.  Since tasks wait for the tasks they
+ * spawn before they return, the tasks of the group being waited for
+ * that were not stolen are the newest there.  Tasks of other groups are
+ * put back, so that a thread waiting for a few small tasks never takes
+ * on a large task that merely happens to be queued.
+ */
+static task_t *take_own(scheduler_t *s, taskgroup_t *group)
+{
+    worker_t *me = self != NULL && self->scheduler == s ? self : NULL;
+    deque_t *d = me != NULL ? &me->deque : &s->inject;
+    task_t *task;
+
+    if (me == NULL)
+        pthread_mutex_lock(&s->inject_lock);
+    task = deque_take(d);
+    if (task != NULL && task->group != group)
+    {
+        deque_push(d, task);
+        task = NULL;
+    }
+    if (me == NULL)
+        pthread_mutex_unlock(&s->inject_lock);
+    return task;
+}
+
+static void run(task_t *task)
+{
+    taskgroup_t *group = task->group;
+
+    task->func(task->arg);
+    free(task);
+    atomic_fetch_sub_explicit(&group->pending, 1, memory_order_release);
+}
+
+/*
+ * Wakes a sleeping worker, if there is one, after a task was spawned.
+ * Sleepers announce themselves before they look for work a last time,
+ * so either they see the task or the spawner sees them.
+ */
+static void wake(scheduler_t *s)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&s->sleepers, memory_order_relaxed) > 0)
+    {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->wakeup);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    scheduler_t *s = w->scheduler;
+    task_t *task;
+    int spins = 0;
+
+    self = w;
+    while (!atomic_load(&s->stopping))
+    {
+        if ((task = find_task(s)) != NULL)
+        {
+            run(task);
+            spins = 0;
+            continue;
+        }
+        if (++spins < IDLE_SPINS)
+        {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        atomic_fetch_add(&s->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!has_work(s) && !atomic_load(&s->stopping))
+            pthread_cond_wait(&s->wakeup, &s->lock);
+        atomic_fetch_sub(&s->sleepers, 1);
+        pthread_mutex_unlock(&s->lock);
+        spins = 0;
+    }
+    return NULL;
+}
+
+scheduler_t *scheduler_create(int nthreads)
+{
+    scheduler_t *s = calloc(1, sizeof(scheduler_t));
+    int i;
+
+    if (s == NULL)
+        return NULL;
+    s->nthreads = nthreads > 0 ? nthreads : 1;
+    s->workers = calloc(s->nthreads, sizeof(worker_t));
+    if (s->workers == NULL)
+    {
+        free(s);
+        return NULL;
+    }
+    deque_init(&s->inject);
+    pthread_mutex_init(&s->inject_lock, NULL);
+    atomic_init(&s->stopping, 0);
+    atomic_init(&s->sleepers, 0);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wakeup, NULL);
+    for (i = 0; i < s->nthreads - 1; i++)
+    {
+        s->workers[i].scheduler = s;
+        s->workers[i].seed = i + 1;
+        deque_init(&s->workers[i].deque);
+    }
+    for (i = 0; i < s->nthreads - 1; i++)
+    {
+        if (pthread_create(&s->workers[i].thread, NULL, worker_main, &s->workers[i]) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+    return s;
+}
+
+void scheduler_destroy(scheduler_t *s)
+{
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->stopping, 1);
+    pthread_cond_broadcast(&s->wakeup);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nthreads - 1; i++)
+        pthread_join(s->workers[i].thread, NULL);
+    for (i = 0; i < s->nthreads - 1; i++)
+        deque_free(&s->workers[i].deque);
+    deque_free(&s->inject);
+    pthread_cond_destroy(&s->wakeup);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->inject_lock);
+    free(s->workers);
+    free(s);
+}
+
+int scheduler_threads(scheduler_t *s)
+{
+    return s->nthreads;
+}
+
+taskgroup_t *taskgroup_create(void)
+{
+    taskgroup_t *group = malloc(sizeof(taskgroup_t));
+
+    if (group == NULL)
+        ERROR_PRINT("out of memory\n");
+    atomic_init(&group->pending, 0);
+    return group;
+}
+
+void taskgroup_destroy(taskgroup_t *group)
+{
+    free(group);
+}
+
+void scheduler_spawn(scheduler_t *s, taskgroup_t *group, taskfunc_t func, void *arg)
+{
+    task_t *task = malloc(sizeof(task_t));
+
+    if (task == NULL)
+        ERROR_PRINT("out of memory\n");
+    task->func = func;
+    task->arg = arg;
+    task->group = group;
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+    if (self != NULL && self->scheduler == s)
+    {
+        deque_push(&self->deque, task);
+    }
+    else
+    {
+        pthread_mutex_lock(&s->inject_lock);
+        deque_push(&s->inject, task);
+        pthread_mutex_unlock(&s->inject_lock);
+    }
+    wake(s);
+}
+
+void scheduler_wait(scheduler_t *s, taskgroup_t *group)
+{
+    struct timespec nap = {0, 50000};
+    task_t *task;
+    int spins = 0;
+
+    while (atomic_load_explicit(&group->pending, memory_order_acquire) > 0)
+    {
+        /* Help with the group's own tasks; the others may be running
+         * elsewhere */
+        if ((task = take_own(s, group)) != NULL)
+        {
+            run(task);
+            spins = 0;
+        }
+        else if (++spins < IDLE_SPINS)
+        {
+            sched_yield();
+        }
+        else
+        {
+            nanosleep(&nap, NULL);
+        }
+    }
+}
@@ -0,0 +1,572 @@
+#include "server.h"
+#include "automaton.h"
+#include "common.h"
+#include "cset.h"
+#include "model.h"
+#include "printing.h"
+#include "queue.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Largest mail body a client may send with MAIL.
+ */
+#define MAX_MAIL_SIZE (64 * 1024 * 1024)
+
+/*
+ * Longest request line.
+ */
+#define MAX_LINE 4096
+
+/*
+ * Latencies are kept in a log-linear histogram: each power of two of
+ * microseconds is split into 8 buckets, so a reported percentile is
+ * within 12.5% of the true value.
+ */
+#define SUB_BUCKETS 8
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+
+typedef struct histogram
+{
+    atomic_ulong counts[NUM_BUCKETS];
+    atomic_ulong total;
+} histogram_t;
+
+/*
+ * A model being served, and what is needed to classify mails with it.
+ */
+typedef struct served
+{
+    automaton_t *automaton;
+    dedup_t *dedup;           /* Counts of mails seen before, if set */
+    model_t *model;           /* Owned by the server if reloaded, or NULL */
+    unsigned long generation; /* Number of reloads before this model */
+} served_t;
+
+/*
+ * The spamword set of the server is published with the served model as
+ * its data, so that a worker reading a snapshot of the set also gets the
+ * model compiled from it.  A reload swaps both at once, and the old model
+ * is destroyed with the old snapshot, once no worker can be using it.
+ */
+typedef struct server
+{
+    cset_t *spamwords; /* Snapshots carry a served_t */
+    char *modelfile;  /* Loaded again on SIGHUP, if set */
+    int threshold;    /* Number of spamwords that makes a mail spam */
+    queue_t *clients; /* Accepted connections, as fd + 1 */
+    histogram_t latency;
+    pthread_mutex_t lock;
+    int closing; /* Set once the server shuts down */
+    int *fds;    /* The client each worker serves, or -1 */
+} server_t;
+
+/*
+ * A thread serving clients, and its slot in the server's fds.
+ */
+typedef struct worker
+{
+    server_t *server;
+    int slot;
+    pthread_t thread;
+    scanner_t *scanner;
+    unsigned long generation; /* Of the model the scanner was made for */
+} worker_t;
+
+static volatile sig_atomic_t stopping;
+static volatile sig_atomic_t reloading;
+
+/*
+ * A pipe the signal handler writes to, so that the accept loop wakes up
+ * even if a signal arrives just before it starts waiting.
+ */
+static int wakeup[2] = {-1, -1};
+
+static int bucket_of(uint64_t us)
+{
+    int msb;
+
+    if (us < SUB_BUCKETS)
+        return us;
+    msb = 63 - __builtin_clzll(us);
+    return (msb - 2) * SUB_BUCKETS + ((us >> (msb - 3)) & (SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the largest latency that falls in the given bucket.
+ */
+static uint64_t bucket_limit(int bucket)
+{
+    int msb;
+
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    msb = bucket / SUB_BUCKETS + 2;
+    return ((uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (msb - 3)) - 1;
+}
+
+static void record(histogram_t *h, uint64_t us)
+{
+    atomic_fetch_add(&h->counts[bucket_of(us)], 1);
+    atomic_fetch_add(&h->total, 1);
+}
+
+/*
+ * Returns the latency, in microseconds, below which the given fraction
+ * of the requests fall.
+ */
+static uint64_t percentile(histogram_t *h, double fraction)
+{
+    unsigned long total = atomic_load(&h->total);
+    unsigned long seen = 0;
+    int i;
+
+    for (i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += atomic_load(&h->counts[i]);
+        if (seen > 0 && seen >= fraction * total)
+            return bucket_limit(i);
+    }
+    return 0;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void served_destroy(void *arg)
+{
+    served_t *served = arg;
+
+    automaton_destroy(served->automaton);
+    if (served->model != NULL)
+        model_destroy(served->model);
+    free(served);
+}
+
+/*
+ * Counts the spamwords of the given mail with the model of the current
+ * spamword snapshot, which is not destroyed while it is in use here.
+ */
+static int count_spamwords(worker_t *w, char *mail, size_t size)
+{
+    server_t *server = w->server;
+    served_t *served;
+    uint64_t hash;
+    int token, count;
+    void *data;
+
+    cset_acquire_data(server->spamwords, &token, &data);
+    served = data;
+    if (w->scanner == NULL || w->generation != served->generation)
+    {
+        /* The model was reloaded since the last mail */
+        if (w->scanner != NULL)
+            scanner_destroy(w->scanner);
+        w->scanner = scanner_create(served->automaton);
+        w->generation = served->generation;
+    }
+    hash = served->dedup != NULL ? dedup_hash(mail, size) : 0;
+    if (served->dedup != NULL && dedup_get(served->dedup, hash, &count))
+    {
+        STATS_COUNT(COUNTER_DEDUP_HITS, 1);
+    }
+    else
+    {
+        scanner_feed(w->scanner, mail, size);
+        count = scanner_finish(w->scanner);
+        if (served->dedup != NULL)
+            dedup_put(served->dedup, hash, count);
+    }
+    cset_release(server->spamwords, token);
+    return count;
+}
+
+/*
+ * Answers one request line.  Returns 0 if the connection should be
+ * closed, and 1 otherwise.
+ */
+static int handle(worker_t *w, char *line, FILE *in, FILE *out)
+{
+    server_t *server = w->server;
+    char name[MAX_LINE];
+    unsigned long length;
+    uint64_t start = now_us();
+    size_t size;
+    char *mail;
+    int count;
+
+    if (strncmp(line, "FILE ", 5) == 0)
+    {
+        mail = read_file(line + 5, &size);
+        if (mail == NULL)
+        {
+            fprintf(out, "ERROR cannot read %s\n", line + 5);
+            return 1;
+        }
+        fprintf(out, "%s: ", line + 5);
+    }
+    else if (sscanf(line, "MAIL %4095s %lu", name, &length) == 2)
+    {
+        if (length > MAX_MAIL_SIZE)
+        {
+            fprintf(out, "ERROR mail too large\n");
+            return 0;
+        }
+        mail = malloc(length + 1);
+        if (mail == NULL)
+            ERROR_PRINT("out of memory\n");
+        size = fread(mail, 1, length, in);
+        if (size != length)
+        {
+            free(mail);
+            return 0;
+        }
+        fprintf(out, "%s: ", name);
+    }
+    else if (strcmp(line, "STATS") == 0)
+    {
+        fprintf(out, "requests %lu p50 %lluus p99 %lluus spamwords %d\n",
+                atomic_load(&server->latency.total),
+                (unsigned long long)percentile(&server->latency, 0.50),
+                (unsigned long long)percentile(&server->latency, 0.99),
+                cset_size(server->spamwords));
+        return 1;
+    }
+    else if (strcmp(line, "QUIT") == 0)
+    {
+        return 0;
+    }
+    else
+    {
+        fprintf(out, "ERROR unknown request\n");
+        return 1;
+    }
+
+    count = count_spamwords(w, mail, size);
+    free(mail);
+    fprintf(out, "%d spam word(s) -> %s\n", count, count >= server->threshold ? "SPAM" : "Not spam");
+    record(&server->latency, now_us() - start);
+    return 1;
+}
+
+/*
+ * Marks the given worker as serving the client on fd, or as idle with
+ * fd -1.  Returns 0 if the server is shutting down, so that no new
+ * client may be served.
+ */
+static int set_client(worker_t *w, int fd)
+{
+    server_t *server = w->server;
+    int open;
+
+    pthread_mutex_lock(&server->lock);
+    open = !server->closing || fd < 0;
+    server->fds[w->slot] = open ? fd : -1;
+    pthread_mutex_unlock(&server->lock);
+    return open;
+}
+
+/*
+ * Serves one client until it hangs up, or until the server shuts down.
+ */
+static void serve(worker_t *w, int fd)
+{
+    char line[MAX_LINE];
+    FILE *in, *out;
+    size_t len;
+    int dupfd;
+
+    dupfd = dup(fd);
+    in = fdopen(fd, "r");
+    out = dupfd >= 0 ? fdopen(dupfd, "w") : NULL;
+    if (in == NULL || out == NULL)
+    {
+        if (in != NULL)
+            fclose(in);
+        else
+            close(fd);
+        if (dupfd >= 0)
+            close(dupfd);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = 0;
+        if (len > 0 && line[len - 1] == '\r')
+            line[--len] = 0;
+        if (!handle(w, line, in, out))
+            break;
+        if (fflush(out) != 0)
+            break;
+    }
+    /* The fd is no longer ours to shut down once it is closed */
+    set_client(w, -1);
+    fclose(out);
+    fclose(in);
+}
+
+static void *server_worker(void *arg)
+{
+    worker_t *w = arg;
+    void *client;
+    int fd;
+
+    while ((client = queue_pop(w->server->clients)) != NULL)
+    {
+        fd = (int)(intptr_t)client - 1;
+        if (set_client(w, fd))
+            serve(w, fd);
+        else
+            close(fd);
+    }
+    if (w->scanner != NULL)
+        scanner_destroy(w->scanner);
+    return NULL;
+}
+
+/*
+ * Stops serving: cuts off the clients being served, closes the ones
+ * still waiting, and waits for the workers to finish.
+ */
+static void shutdown_workers(server_t *server, worker_t *workers, int nthreads)
+{
+    int i;
+
+    pthread_mutex_lock(&server->lock);
+    server->closing = 1;
+    for (i = 0; i < nthreads; i++)
+    {
+        /* Wakes the worker from reading the request or the mail */
+        if (server->fds[i] >= 0)
+            shutdown(server->fds[i], SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&server->lock);
+    queue_close(server->clients);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+/*
+ * Loads the model file again and serves the new model.  The old one is
+ * destroyed once no worker can be using it.  The dedup cache holds
+ * counts taken with the old spamwords, so it is not used any more.
+ */
+static void reload(server_t *server)
+{
+    model_t *model = model_load(server->modelfile);
+    served_t *served;
+    int token;
+    void *data;
+
+    if (model == NULL)
+    {
+        fprintf(stderr, "%s is not a model file; keeping the old model\n", server->modelfile);
+        return;
+    }
+    served = malloc(sizeof(served_t));
+    if (served == NULL)
+        ERROR_PRINT("out of memory\n");
+    served->automaton = automaton_create(model_spamwords(model));
+    served->dedup = NULL;
+    served->model = model;
+    /* Only this thread swaps snapshots, so the current one stays current */
+    cset_acquire_data(server->spamwords, &token, &data);
+    served->generation = ((served_t *)data)->generation + 1;
+    cset_release(server->spamwords, token);
+    cset_swap_data(server->spamwords, set_copy(model_spamwords(model)), served);
+    printf("Reloaded %s with %d spamwords\n", server->modelfile, set_size(model_spamwords(model)));
+    fflush(stdout);
+}
+
+static void on_signal(int sig)
+{
+    int saved = errno;
+    ssize_t n;
+
+    if (sig == SIGHUP)
+        reloading = 1;
+    else
+        stopping = 1;
+    /* If the pipe is full, a wakeup is pending anyway */
+    n = write(wakeup[1], "", 1);
+    (void)n;
+    errno = saved;
+}
+
+int server_run(char *socketpath, char *modelfile, set_t *spamwords, int threshold, dedup_t *dedup,
+               int nthreads)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct pollfd ready[2];
+    sigset_t signals, unblocked;
+    struct stat st;
+    char drain[64];
+    worker_t *workers;
+    server_t *server;
+    served_t *served;
+    int fd, client, i;
+
+    if (strlen(socketpath) >= sizeof(addr.sun_path))
+    {
+        DEBUG_PRINT("socket path too long\n");
+        return 1;
+    }
+    /* Replace a socket left behind by an earlier server, but nothing else */
+    if (lstat(socketpath, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            DEBUG_PRINT("%s exists and is not a socket\n", socketpath);
+            return 1;
+        }
+        unlink(socketpath);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketpath);
+    /* Only the owner may connect, since requests can name any file the
+     * server can read; nobody can connect before listen() */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(socketpath, 0600) < 0 ||
+        listen(fd, 128) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    {
+        perror(socketpath);
+        close(fd);
+        return 1;
+    }
+
+    /* SIGINT, SIGTERM and SIGHUP wake the accept loop through the pipe,
+     * so a signal is acted on at once rather than after the next client
+     * connects.  A client hanging up must not kill the daemon. */
+    if (pipe(wakeup) < 0 || fcntl(wakeup[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(wakeup[1], F_SETFL, O_NONBLOCK) < 0)
+    {
+        perror("pipe");
+        close(fd);
+        return 1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (modelfile != NULL)
+        sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    server = calloc(1, sizeof(server_t));
+    served = calloc(1, sizeof(served_t));
+    workers = calloc(nthreads, sizeof(worker_t));
+    if (server == NULL || served == NULL || workers == NULL)
+        ERROR_PRINT("out of memory\n");
+    server->fds = malloc(nthreads * sizeof(int));
+    if (server->fds == NULL)
+        ERROR_PRINT("out of memory\n");
+    served->automaton = automaton_create(spamwords);
+    served->dedup = dedup;
+    server->spamwords = cset_create_data(set_copy(spamwords), served, served_destroy);
+    server->modelfile = modelfile;
+    server->threshold = threshold;
+    server->clients = queue_create(0);
+    pthread_mutex_init(&server->lock, NULL);
+    /* The workers inherit a mask that keeps the signals away from them,
+     * so that a signal never interrupts a client's read */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, &unblocked);
+    for (i = 0; i < nthreads; i++)
+    {
+        server->fds[i] = -1;
+        workers[i].server = server;
+        workers[i].slot = i;
+        if (pthread_create(&workers[i].thread, NULL, server_worker, &workers[i]) != 0)
+            ERROR_PRINT("pthread_create() failed\n");
+    }
+    pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+
+    printf("Listening on %s with %d threads\n", socketpath, nthreads);
+    fflush(stdout);
+    while (!stopping)
+    {
+        if (reloading)
+        {
+            reloading = 0;
+            reload(server);
+            continue;
+        }
+        ready[0].fd = fd;
+        ready[0].events = POLLIN;
+        ready[1].fd = wakeup[0];
+        ready[1].events = POLLIN;
+        if (poll(ready, 2, -1) < 0)
+        {
+            if (errno != EINTR)
+                perror("poll");
+            continue;
+        }
+        if (ready[1].revents & POLLIN)
+        {
+            while (read(wakeup[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if (!(ready[0].revents & POLLIN))
+            continue;
+        client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+            /* The client may have given up since poll() returned */
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            continue;
+        }
+        queue_push(server->clients, (void *)(intptr_t)(client + 1));
+    }
+    close(fd);
+    unlink(socketpath);
+    shutdown_workers(server, workers, nthreads);
+    close(wakeup[0]);
+    close(wakeup[1]);
+    wakeup[0] = wakeup[1] = -1;
+
+    printf("Served %lu requests, p50 %lluus, p99 %lluus\n",
+           atomic_load(&server->latency.total),
+           (unsigned long long)percentile(&server->latency, 0.50),
+           (unsigned long long)percentile(&server->latency, 0.99));
+
+    queue_destroy(server->clients);
+    cset_destroy(server->spamwords);
+    pthread_mutex_destroy(&server->lock);
+    free(server->fds);
+    free(server);
+    free(workers);
+    return 0;
+}
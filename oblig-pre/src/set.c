@@ -1,6 +1,7 @@
 #include "common.h"
 #include "../include/set.h"
 #include "../include/printing.h"
+#include "../include/stats.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -125,29 +126,43 @@ static int set_addlast(set_t *set, void *elem)
 void set_add(set_t *set, void *elem)
 {
     SetNode *iter = set->head;
+    int cmp = 0;
 
+    STATS_COUNT(COUNTER_SET_ADD, 1);
     if (iter == NULL)
     {
         set_addfirst(set, elem);
     }
-    else if (set->cmp(elem, set->head->elem) <= 0)
+    else if ((cmp = set->cmp(elem, set->head->elem)) <= 0)
     {
-        set_addfirst(set, elem);
+        // Elements already in the set are not added again
+        if (cmp != 0)
+        {
+            set_addfirst(set, elem);
+        }
     }
-    else if (set->cmp(elem, set->tail->elem) > 0)
+    else if ((cmp = set->cmp(elem, set->tail->elem)) >= 0)
     {
-        set_addlast(set, elem);
+        if (cmp != 0)
+        {
+            set_addlast(set, elem);
+        }
     }
     else
     {
         while (iter->next != NULL)
         {
-            if (set->cmp(elem, iter->next->elem) <= 0)
+            cmp = set->cmp(elem, iter->next->elem);
+            if (cmp <= 0)
             {
                 break;
             }
             iter = iter->next;
         }
+        if (cmp == 0)
+        {
+            return;
+        }
         SetNode *node = node_create(elem);
         node->next = iter->next;
         iter->next->prev = node;
@@ -171,6 +186,7 @@ int set_contains(set_t *set, void *elem) {
 }
 
 set_t *set_union(set_t *a, set_t *b) {
+    uint64_t start = STATS_START();
     set_t *result = set_create(a->cmp);
 
     SetNode *node = a->head;
@@ -187,10 +203,12 @@ set_t *set_union(set_t *a, set_t *b) {
         node = node->next;
     }
 
+    STATS_STOP(TIMER_UNION, start);
     return result;
 }
 
 set_t *set_intersection(set_t *a, set_t *b) {
+    uint64_t start = STATS_START();
     set_t *result = set_create(a->cmp);
 
     SetNode *node = a->head;
@@ -201,10 +219,12 @@ set_t *set_intersection(set_t *a, set_t *b) {
         node = node->next;
     }
 
+    STATS_STOP(TIMER_INTERSECTION, start);
     return result;
 }
 
 set_t *set_difference(set_t *a, set_t *b) {
+    uint64_t start = STATS_START();
     set_t *result = set_create(a->cmp);
 
     SetNode *node = a->head;
@@ -215,6 +235,7 @@ set_t *set_difference(set_t *a, set_t *b) {
         node = node->next;
     }
 
+    STATS_STOP(TIMER_DIFFERENCE, start);
     return result;
 }
 
@@ -230,6 +251,17 @@ set_t *set_copy(set_t *set) {
     return result;
 }
 
+int set_threadsafe(void)
+{
+    return 0;
+}
+
+void set_usescheduler(scheduler_t *scheduler)
+{
+    /* Set operations are single merges, which are not split */
+    (void)scheduler;
+}
+
 set_iter_t *set_createiter(set_t *set)
 {
     set_iter_t *iter = (set_iter_t *)malloc(sizeof(set_iter_t));
@@ -1,14 +1,34 @@
 #include "../include/set.h"
 #include "../include/printing.h"
+#include "../include/scheduler.h"
+#include "../include/stats.h"
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+/*
+ * Set operations fork their subproblems into tasks while these are
+ * expected to hold at least this many elements.
+ */
+#define SETOP_CUTOFF 4096
+
+/*
+ * Sets are persistent treaps: binary search trees on the elements that
+ * are also heaps on random node priorities, which keeps them balanced
+ * in expectation.  Nodes are never changed once they are shared, so
+ * copies of a set share all their nodes, and an insertion copies only
+ * the O(log n) nodes on its path that are shared (path copying).  The
+ * reference counts are atomic, so copies may be used and destroyed by
+ * different threads.
+ */
 typedef struct setnode SetNode;
 struct setnode {
     void *data;
     SetNode *left;
     SetNode *right;
-    SetNode *parent;
+    uint32_t priority;
+    atomic_int refs;
 };
 
 struct set {
@@ -17,65 +37,296 @@ struct set {
     cmpfunc_t cmp;
 };
 
+/*
+ * Iterators walk the tree in order with a stack of the nodes whose
+ * right subtrees are still to be visited.  An iterator holds on to the
+ * tree it started on, so it is not disturbed by later insertions.
+ */
 struct set_iter {
-    SetNode *node;
-    set_t *set;
+    SetNode *root;
+    SetNode **stack;
+    int top;
+    int capacity;
 };
 
-static SetNode *setnode_create(void *data) {
+static uint32_t random_priority(void) {
+    static _Thread_local uint32_t seed;
+
+    if (seed == 0) {
+        seed = (uint32_t)(uintptr_t)&seed | 1;
+    }
+    // xorshift32
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static SetNode *setnode_create(void *data, uint32_t priority, SetNode *left, SetNode *right) {
     SetNode *node = malloc(sizeof(SetNode));
+    if (node == NULL) {
+        ERROR_PRINT("out of memory\n");
+    }
     node->data = data;
-    node->left = NULL;
-    node->right = NULL;
-    node->parent = NULL;
+    node->left = left;
+    node->right = right;
+    node->priority = priority;
+    atomic_init(&node->refs, 1);
     return node;
 }
 
-static void setnode_destroy(SetNode *node) {
+static SetNode *setnode_retain(SetNode *node) {
     if (node) {
-        setnode_destroy(node->left);
-        setnode_destroy(node->right);
+        atomic_fetch_add_explicit(&node->refs, 1, memory_order_relaxed);
+    }
+    return node;
+}
+
+// Drops a reference, destroying the node and its subtrees with the last one
+static void setnode_release(SetNode *node) {
+    while (node && atomic_fetch_sub_explicit(&node->refs, 1, memory_order_acq_rel) == 1) {
+        SetNode *right = node->right;
+        setnode_release(node->left);
         //free(node->data);
         free(node);
+        node = right;
     }
 }
 
-static void setnode_copy(set_t *set, SetNode *node) {
-    if (node) {
-        set_add(set, node->data);    
-        setnode_copy(set, node->left);
-        setnode_copy(set, node->right);  
+/*
+ * Returns a node with the contents of the given one that only the
+ * caller refers to, taking over the caller's reference to the given
+ * node: the node itself if nothing else refers to it, or else a copy.
+ */
+static SetNode *setnode_own(SetNode *node) {
+    SetNode *copy;
+
+    if (atomic_load_explicit(&node->refs, memory_order_acquire) == 1) {
+        return node;
     }
+    copy = setnode_create(node->data, node->priority,
+                          setnode_retain(node->left), setnode_retain(node->right));
+    setnode_release(node);
+    return copy;
 }
 
-static void traverse_union(set_t *unionset, SetNode *node) {
-    if (node) {
-        set_add(unionset, node->data);
-        traverse_union(unionset, node->left);
-        traverse_union(unionset, node->right);  
+static SetNode *rotate_right(SetNode *node) {
+    SetNode *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    return left;
+}
+
+static SetNode *rotate_left(SetNode *node) {
+    SetNode *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    return right;
+}
+
+/*
+ * Inserts data, which is not in the tree, into the given tree.  Takes
+ * over the caller's reference to the tree and returns one to the new
+ * tree, whose nodes on the path to data only the caller refers to.
+ */
+static SetNode *setnode_insert(set_t *set, SetNode *node, void *data) {
+    if (node == NULL) {
+        return setnode_create(data, random_priority(), NULL, NULL);
+    }
+    node = setnode_own(node);
+    if (set->cmp(data, node->data) < 0) {
+        node->left = setnode_insert(set, node->left, data);
+        if (node->left->priority > node->priority) {
+            node = rotate_right(node);
+        }
+    }
+    else {
+        node->right = setnode_insert(set, node->right, data);
+        if (node->right->priority > node->priority) {
+            node = rotate_left(node);
+        }
     }
+    return node;
 }
 
-static void traverse_intersect(set_t *intersectionset, set_t *set, SetNode *node) {
-    if (node) {
-        if (set_contains(set, node->data)) {
-            set_add(intersectionset, node->data);
-        }   
-        traverse_intersect(intersectionset, set, node->left);
-        traverse_intersect(intersectionset, set, node->right);  
+/*
+ * Splits the given tree into the elements less than key (left) and
+ * greater than key (right), sharing the subtrees off the path to key.
+ * Returns 1 and stores the element equal to key in match if the tree
+ * holds one, and returns 0 otherwise.
+ */
+static int setnode_split(set_t *set, SetNode *node, void *key, SetNode **left, SetNode **right, void **match) {
+    SetNode *sub;
+    int found, cmp;
+
+    if (node == NULL) {
+        *left = *right = NULL;
+        return 0;
+    }
+    cmp = set->cmp(key, node->data);
+    if (cmp == 0) {
+        *left = setnode_retain(node->left);
+        *right = setnode_retain(node->right);
+        *match = node->data;
+        return 1;
+    }
+    if (cmp < 0) {
+        found = setnode_split(set, node->left, key, left, &sub, match);
+        *right = setnode_create(node->data, node->priority, sub, setnode_retain(node->right));
     }
+    else {
+        found = setnode_split(set, node->right, key, &sub, right, match);
+        *left = setnode_create(node->data, node->priority, setnode_retain(node->left), sub);
+    }
+    return found;
 }
 
-static void traverse_difference(set_t *differenceset, set_t *set, SetNode *node) {
-    if (node) {
-        if (!set_contains(set, node->data)) {
-            set_add(differenceset, node->data);
+/*
+ * Joins two trees where every element of left is less than every
+ * element of right.  Takes over the caller's references to both.
+ */
+static SetNode *setnode_join(SetNode *left, SetNode *right) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    if (left->priority > right->priority) {
+        left = setnode_own(left);
+        left->right = setnode_join(left->right, right);
+        return left;
+    }
+    right = setnode_own(right);
+    right->left = setnode_join(left, right->left);
+    return right;
+}
+
+enum setop_kind { SETOP_UNION, SETOP_INTERSECTION, SETOP_DIFFERENCE };
+
+/*
+ * A set operation on two subtrees, which it only reads.  The result is
+ * a new tree that shares what it can of the two, and common is the
+ * number of elements found in both.
+ */
+typedef struct setop {
+    enum setop_kind kind;
+    set_t *set;
+    SetNode *a;
+    SetNode *b;
+    scheduler_t *scheduler; // NULL to run on the calling thread only
+    int expected; // Number of elements the two subtrees are expected to hold
+    SetNode *result;
+    int common;
+} setop_t;
+
+// The scheduler given to set_usescheduler(), if any
+static _Atomic(scheduler_t *) setop_scheduler;
+
+// An operation is forked while its subtrees hold enough elements to be worth a task
+static int setop_forks(setop_t *op) {
+    return op->scheduler != NULL && op->expected >= SETOP_CUTOFF;
+}
+
+/*
+ * Splits the tree with the higher-priority root (for intersection and
+ * difference, always a) around that root, and recurses on the two
+ * sides, forking the left side off as a task near the top.  The root's
+ * element goes into the result, or not, depending on the operation and
+ * whether the other tree holds it.  Elements of a are kept over equal
+ * elements of b.
+ */
+static void setop_run(void *arg) {
+    setop_t *op = arg, left = *op, right = *op;
+    SetNode *a = op->a, *b = op->b, *root, *other, *lo, *hi;
+    taskgroup_t *group;
+    void *match = NULL;
+    int found;
+
+    op->common = 0;
+    if (a == NULL || b == NULL) {
+        if (op->kind == SETOP_UNION) {
+            op->result = setnode_retain(a != NULL ? a : b);
         }
-        traverse_difference(differenceset, set, node->left);
-        traverse_difference(differenceset, set, node->right); 
+        else if (op->kind == SETOP_DIFFERENCE) {
+            op->result = setnode_retain(a);
+        }
+        else {
+            op->result = NULL;
+        }
+        return;
+    }
+
+    root = a;
+    other = b;
+    if (op->kind == SETOP_UNION && b->priority > a->priority) {
+        root = b;
+        other = a;
+    }
+    found = setnode_split(op->set, other, root->data, &lo, &hi, &match);
+    // Each side holds about half of the elements of a balanced treap
+    left.expected = right.expected = op->expected / 2;
+    if (root == a) {
+        left.a = a->left;
+        left.b = lo;
+        right.a = a->right;
+        right.b = hi;
+    }
+    else {
+        left.a = lo;
+        left.b = b->left;
+        right.a = hi;
+        right.b = b->right;
+    }
+
+    if (setop_forks(op)) {
+        group = taskgroup_create();
+        scheduler_spawn(op->scheduler, group, setop_run, &left);
+        setop_run(&right);
+        scheduler_wait(op->scheduler, group);
+        taskgroup_destroy(group);
+    }
+    else {
+        setop_run(&left);
+        setop_run(&right);
+    }
+    setnode_release(lo);
+    setnode_release(hi);
+
+    op->common = left.common + right.common + found;
+    if (op->kind == SETOP_UNION) {
+        op->result = setnode_create(root == a || !found ? root->data : match, root->priority,
+                                    left.result, right.result);
+    }
+    else if ((op->kind == SETOP_INTERSECTION) == found) {
+        op->result = setnode_create(root->data, root->priority, left.result, right.result);
+    }
+    else {
+        op->result = setnode_join(left.result, right.result);
     }
 }
 
+// Runs the given operation on two whole sets
+static set_t *setop(enum setop_kind kind, set_t *a, set_t *b) {
+    setop_t op = {kind, a, a->root, b->root, atomic_load(&setop_scheduler), a->size + b->size, NULL, 0};
+    set_t *result = set_create(a->cmp);
+
+    if (op.scheduler != NULL && scheduler_threads(op.scheduler) == 1) {
+        op.scheduler = NULL;
+    }
+    setop_run(&op);
+    result->root = op.result;
+    if (kind == SETOP_UNION) {
+        result->size = a->size + b->size - op.common;
+    }
+    else if (kind == SETOP_INTERSECTION) {
+        result->size = op.common;
+    }
+    else {
+        result->size = a->size - op.common;
+    }
+    return result;
+}
 
 // Create a new set
 set_t *set_create(cmpfunc_t cmpfunc) {
@@ -89,56 +340,26 @@ set_t *set_create(cmpfunc_t cmpfunc) {
     return set;
 }
 
-// Destroy a set
+// Destroy a set; nodes still shared with copies live on
 void set_destroy(set_t *set) {
     if (set) {
-        setnode_destroy(set->root);
+        setnode_release(set->root);
         free(set);
     }
 }
 
-// Insert an element into the set sorted
+// Insert an element into the set, copying the shared nodes on its path
 void set_add(set_t *set, void *data) {
+    STATS_COUNT(COUNTER_SET_ADD, 1);
     if (set == NULL) {
         ERROR_PRINT("An error occured");
         return;}
 
-    SetNode *tmp = setnode_create(data);
-    if (tmp == NULL) {
-        ERROR_PRINT("An error occured");
-        return;}
-
-    if (set->root == NULL) {
-        set->root = tmp;
-        set->size++;
+    if (set_contains(set, data)) {
         return;
     }
-
-    SetNode *current = set->root;
-    SetNode *parent = NULL;
-
-    while (current != NULL) {
-        parent = current;
-        if (set->cmp(current->data, tmp->data) < 0 ) {
-            current = current->right;
-        }
-        else if (set->cmp(current->data, tmp->data) > 0) {
-            current = current->left;
-        }
-        else {
-            break;
-        }
-    } 
-    if (set->cmp(parent->data, tmp->data) < 0) {
-        parent->right = tmp;
-        tmp->parent = parent;
-        set->size++;
-    } 
-    else if (set->cmp(parent->data, tmp->data) > 0) {
-        parent->left = tmp;
-        tmp->parent = parent;
-        set->size++;
-    }
+    set->root = setnode_insert(set, set->root, data);
+    set->size++;
 }
 
 int set_size(set_t *set) {
@@ -153,10 +374,11 @@ int set_contains(set_t *set, void *elem) {
     SetNode *current = set->root;
 
     while (current != NULL) {
-        if (set->cmp(current->data, elem) < 0 ) {
+        int cmp = set->cmp(current->data, elem);
+        if (cmp < 0) {
             current = current->right;
         }
-        else if (set->cmp(current->data, elem) > 0) {
+        else if (cmp > 0) {
             current = current->left;
         }
         else {
@@ -172,9 +394,9 @@ int set_contains(set_t *set, void *elem) {
  * a or b.
  */
 set_t *set_union(set_t *a, set_t *b) {
-    set_t *unionset = set_create(a->cmp);
-    traverse_union(unionset, a->root);
-    traverse_union(unionset, b->root);
+    uint64_t start = STATS_START();
+    set_t *unionset = setop(SETOP_UNION, a, b);
+    STATS_STOP(TIMER_UNION, start);
     return unionset;
 }
 
@@ -184,9 +406,9 @@ set_t *set_union(set_t *a, set_t *b) {
  * in both a and b.
  */
 set_t *set_intersection(set_t *a, set_t *b) {
-    set_t *intersectionset = set_create(a->cmp);
-    SetNode *current = a->root;
-    traverse_intersect(intersectionset, b, current);
+    uint64_t start = STATS_START();
+    set_t *intersectionset = setop(SETOP_INTERSECTION, a, b);
+    STATS_STOP(TIMER_INTERSECTION, start);
     return intersectionset;
 }
 
@@ -196,33 +418,64 @@ set_t *set_intersection(set_t *a, set_t *b) {
  * in a and not in b.
  */
 set_t *set_difference(set_t *a, set_t *b) {
-    set_t *differenceset = set_create(a->cmp);
-    traverse_difference(differenceset, b, a->root);
+    uint64_t start = STATS_START();
+    set_t *differenceset = setop(SETOP_DIFFERENCE, a, b);
+    STATS_STOP(TIMER_DIFFERENCE, start);
     return differenceset;
 }
 
+// Set operations on sets of at least SETOP_CUTOFF elements fork onto the scheduler
+void set_usescheduler(scheduler_t *scheduler) {
+    atomic_store(&setop_scheduler, scheduler);
+}
+
 /*
- * Returns a copy of the given set.
+ * Returns a copy of the given set.  The copy shares the tree of the
+ * given set, so this takes constant time.
  */
 set_t *set_copy(set_t *set) {
     set_t *newset = set_create(set->cmp);
-    setnode_copy(newset, set->root);
+    newset->root = setnode_retain(set->root);
+    newset->size = set->size;
     return newset;
 }
 
+/*
+ * Returns 1 if this set implementation lets several threads call
+ * set_add() and set_contains() on the same set at once, 0 otherwise.
+ */
+int set_threadsafe(void) {
+    return 0;
+}
+
+// Push a node and the left spine below it onto the iterator's stack
+static void iter_pushleft(set_iter_t *it, SetNode *node) {
+    while (node) {
+        if (it->top == it->capacity) {
+            it->capacity = it->capacity ? it->capacity * 2 : 32;
+            it->stack = realloc(it->stack, it->capacity * sizeof(SetNode *));
+            if (it->stack == NULL) {
+                ERROR_PRINT("out of memory\n");
+            }
+        }
+        it->stack[it->top++] = node;
+        node = node->left;
+    }
+}
 
 /*
  * Creates a new set iterator for iterating over the given set.
  */
 set_iter_t *set_createiter(set_t *set) {
     set_iter_t *it = (set_iter_t *)malloc(sizeof(set_iter_t));
-    SetNode *current = set->root;
-    while (current && current->left) {
-        current = current->left;}
-    SetNode *tmp = setnode_create(NULL);
-    tmp->parent = current;
-    it->node = tmp;
-    it->set = set;
+    if (it == NULL) {
+        return NULL;
+    }
+    it->root = setnode_retain(set->root);
+    it->stack = NULL;
+    it->top = 0;
+    it->capacity = 0;
+    iter_pushleft(it, it->root);
     return it;
 }   
 
@@ -230,6 +483,8 @@ set_iter_t *set_createiter(set_t *set) {
  * Destroys the given set iterator.
  */
 void set_destroyiter(set_iter_t *iter) {
+    setnode_release(iter->root);
+    free(iter->stack);
     free(iter);
 }
 
@@ -241,16 +496,7 @@ int set_hasnext(set_iter_t *iter) {
     if (!iter) {
         return 0;
     }
-    if (!set_size(iter->set)) {
-        return 0;
-    }
-    SetNode *temp = iter->set->root;
-    while (temp && temp->right) {
-        temp = temp->right;
-    }
-    if (iter->node == temp) {
-        return 0;}
-    return 1;
+    return iter->top > 0;
 }
 
 /*
@@ -258,26 +504,12 @@ int set_hasnext(set_iter_t *iter) {
  * set iterator.
  */
 void *set_next(set_iter_t *iter) {
-    if (!iter->node) {
+    if (iter->top == 0) {
         return NULL;
     }
-    SetNode *current = iter->node;
-    SetNode *next = NULL;
-
-    if (current->right) {
-        next = current->right;
-        while (next->left) {
-            next = next->left;
-        }
-    } 
-    else {
-        while (current->parent && current == current->parent->right) {
-            current = current->parent;
-        }
-        next = current->parent;
-    }
-    iter->node = next; 
-    return next->data;
+    SetNode *current = iter->stack[--iter->top];
+    iter_pushleft(iter, current->right);
+    return current->data;
 }
 
 /*
@@ -0,0 +1,367 @@
+#include "set.h"
+#include "printing.h"
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Number of levels of the skip list.  A node reaches each level above
+ * the first with probability 1/4, so this covers sets of billions of
+ * elements.
+ */
+#define SKIPLIST_LEVELS 16
+
+/*
+ * A node of the skip list, linked into its first height levels.  Since
+ * elements are never removed, a node is never unlinked, and a link only
+ * ever changes to point at a node inserted right after it.
+ */
+typedef struct skipnode skipnode_t;
+struct skipnode
+{
+    void *elem;
+    int height;
+    _Atomic(skipnode_t *) next[];
+};
+
+/*
+ * A lock-free skip list (after Fraser, and Herlihy and Shavit).  Nodes
+ * are inserted with compare-and-swap, first into the bottom level, which
+ * decides membership, and then into the levels above, which only speed
+ * up searches.  Lookups never wait.
+ */
+struct set
+{
+    skipnode_t *head; /* Sentinel, linked into every level */
+    atomic_int size;
+    cmpfunc_t cmp;
+};
+
+struct set_iter
+{
+    skipnode_t *node;
+};
+
+static skipnode_t *node_create(void *elem, int height)
+{
+    skipnode_t *node = malloc(sizeof(skipnode_t) + height * sizeof(node->next[0]));
+    int i;
+
+    if (node == NULL)
+        ERROR_PRINT("out of memory\n");
+    node->elem = elem;
+    node->height = height;
+    for (i = 0; i < height; i++)
+        atomic_init(&node->next[i], NULL);
+    return node;
+}
+
+/*
+ * Returns a random node height: 1, plus one for every two random bits
+ * that are both zero, up to SKIPLIST_LEVELS.
+ */
+static int random_height(void)
+{
+    static _Thread_local uint32_t seed;
+    uint32_t r;
+    int height = 1;
+
+    if (seed == 0)
+        seed = (uint32_t)(uintptr_t)&seed | 1;
+    /* xorshift32 */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    for (r = seed; height < SKIPLIST_LEVELS && (r & 3) == 0; r >>= 2)
+        height++;
+    return height;
+}
+
+set_t *set_create(cmpfunc_t cmpfunc)
+{
+    set_t *set = malloc(sizeof(set_t));
+
+    if (set == NULL)
+        return NULL;
+    set->head = node_create(NULL, SKIPLIST_LEVELS);
+    atomic_init(&set->size, 0);
+    set->cmp = cmpfunc;
+    return set;
+}
+
+void set_destroy(set_t *set)
+{
+    skipnode_t *node = set->head, *next;
+
+    while (node != NULL)
+    {
+        next = atomic_load_explicit(&node->next[0], memory_order_relaxed);
+        free(node);
+        node = next;
+    }
+    free(set);
+}
+
+int set_size(set_t *set)
+{
+    return atomic_load(&set->size);
+}
+
+int set_threadsafe(void)
+{
+    return 1;
+}
+
+void set_usescheduler(scheduler_t *scheduler)
+{
+    /* Set operations are single merges, which are not split */
+    (void)scheduler;
+}
+
+/*
+ * Finds, on every level, the last node before elem (preds) and the node
+ * after it (succs).  Returns 1 if elem is in the set.
+ */
+static int find(set_t *set, void *elem, skipnode_t **preds, skipnode_t **succs)
+{
+    skipnode_t *pred = set->head, *cur = NULL;
+    int level;
+
+    for (level = SKIPLIST_LEVELS - 1; level >= 0; level--)
+    {
+        cur = atomic_load_explicit(&pred->next[level], memory_order_acquire);
+        while (cur != NULL && set->cmp(cur->elem, elem) < 0)
+        {
+            pred = cur;
+            cur = atomic_load_explicit(&cur->next[level], memory_order_acquire);
+        }
+        preds[level] = pred;
+        succs[level] = cur;
+    }
+    return cur != NULL && set->cmp(cur->elem, elem) == 0;
+}
+
+void set_add(set_t *set, void *elem)
+{
+    skipnode_t *preds[SKIPLIST_LEVELS], *succs[SKIPLIST_LEVELS];
+    skipnode_t *node = NULL, *expected;
+    int level;
+
+    STATS_COUNT(COUNTER_SET_ADD, 1);
+    for (;;)
+    {
+        if (find(set, elem, preds, succs))
+        {
+            /* Elements already in the set are not added again */
+            free(node);
+            return;
+        }
+        if (node == NULL)
+            node = node_create(elem, random_height());
+        for (level = 0; level < node->height; level++)
+            atomic_store_explicit(&node->next[level], succs[level], memory_order_relaxed);
+        /* Linking the bottom level adds the element */
+        expected = succs[0];
+        if (atomic_compare_exchange_strong_explicit(&preds[0]->next[0], &expected, node,
+                                                    memory_order_release, memory_order_relaxed))
+            break;
+    }
+    atomic_fetch_add_explicit(&set->size, 1, memory_order_relaxed);
+
+    for (level = 1; level < node->height; level++)
+    {
+        for (;;)
+        {
+            expected = succs[level];
+            if (atomic_compare_exchange_strong_explicit(&preds[level]->next[level], &expected, node,
+                                                        memory_order_release, memory_order_relaxed))
+                break;
+            /* Another node went in next to ours; look again */
+            find(set, elem, preds, succs);
+            atomic_store_explicit(&node->next[level], succs[level], memory_order_relaxed);
+        }
+    }
+}
+
+int set_contains(set_t *set, void *elem)
+{
+    skipnode_t *pred = set->head, *cur = NULL;
+    int level, cmp;
+
+    for (level = SKIPLIST_LEVELS - 1; level >= 0; level--)
+    {
+        cur = atomic_load_explicit(&pred->next[level], memory_order_acquire);
+        while (cur != NULL && (cmp = set->cmp(cur->elem, elem)) <= 0)
+        {
+            if (cmp == 0)
+                return 1;
+            pred = cur;
+            cur = atomic_load_explicit(&cur->next[level], memory_order_acquire);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builds a new set from elements that arrive in increasing order, by
+ * appending each one after the last node of every level it reaches.
+ */
+typedef struct builder
+{
+    set_t *set;
+    skipnode_t *last[SKIPLIST_LEVELS];
+} builder_t;
+
+static void builder_init(builder_t *b, cmpfunc_t cmp)
+{
+    int level;
+
+    b->set = set_create(cmp);
+    if (b->set == NULL)
+        ERROR_PRINT("out of memory\n");
+    for (level = 0; level < SKIPLIST_LEVELS; level++)
+        b->last[level] = b->set->head;
+}
+
+static void builder_append(builder_t *b, void *elem)
+{
+    skipnode_t *node = node_create(elem, random_height());
+    int level;
+
+    for (level = 0; level < node->height; level++)
+    {
+        atomic_store_explicit(&b->last[level]->next[level], node, memory_order_relaxed);
+        b->last[level] = node;
+    }
+    atomic_fetch_add_explicit(&b->set->size, 1, memory_order_relaxed);
+}
+
+static skipnode_t *first(set_t *set)
+{
+    return atomic_load_explicit(&set->head->next[0], memory_order_acquire);
+}
+
+static skipnode_t *after(skipnode_t *node)
+{
+    return atomic_load_explicit(&node->next[0], memory_order_acquire);
+}
+
+/*
+ * Set operations merge the bottom levels of the two sets, which hold
+ * their elements in order, in O(m + n) time.
+ */
+set_t *set_union(set_t *a, set_t *b)
+{
+    uint64_t start = STATS_START();
+    skipnode_t *x = first(a), *y = first(b);
+    builder_t result;
+    int cmp;
+
+    builder_init(&result, a->cmp);
+    while (x != NULL || y != NULL)
+    {
+        cmp = x == NULL ? 1 : y == NULL ? -1 : a->cmp(x->elem, y->elem);
+        if (cmp <= 0)
+        {
+            builder_append(&result, x->elem);
+            x = after(x);
+            if (cmp == 0)
+                y = after(y);
+        }
+        else
+        {
+            builder_append(&result, y->elem);
+            y = after(y);
+        }
+    }
+    STATS_STOP(TIMER_UNION, start);
+    return result.set;
+}
+
+set_t *set_intersection(set_t *a, set_t *b)
+{
+    uint64_t start = STATS_START();
+    skipnode_t *x = first(a), *y = first(b);
+    builder_t result;
+    int cmp;
+
+    builder_init(&result, a->cmp);
+    while (x != NULL && y != NULL)
+    {
+        cmp = a->cmp(x->elem, y->elem);
+        if (cmp == 0)
+            builder_append(&result, x->elem);
+        if (cmp <= 0)
+            x = after(x);
+        if (cmp >= 0)
+            y = after(y);
+    }
+    STATS_STOP(TIMER_INTERSECTION, start);
+    return result.set;
+}
+
+set_t *set_difference(set_t *a, set_t *b)
+{
+    uint64_t start = STATS_START();
+    skipnode_t *x = first(a), *y = first(b);
+    builder_t result;
+    int cmp;
+
+    builder_init(&result, a->cmp);
+    while (x != NULL)
+    {
+        cmp = y == NULL ? -1 : a->cmp(x->elem, y->elem);
+        if (cmp < 0)
+            builder_append(&result, x->elem);
+        if (cmp <= 0)
+            x = after(x);
+        if (cmp >= 0)
+            y = after(y);
+    }
+    STATS_STOP(TIMER_DIFFERENCE, start);
+    return result.set;
+}
+
+set_t *set_copy(set_t *set)
+{
+    skipnode_t *node;
+    builder_t result;
+
+    builder_init(&result, set->cmp);
+    for (node = first(set); node != NULL; node = after(node))
+        builder_append(&result, node->elem);
+    return result.set;
+}
+
+set_iter_t *set_createiter(set_t *set)
+{
+    set_iter_t *iter = malloc(sizeof(set_iter_t));
+
+    if (iter == NULL)
+        return NULL;
+    iter->node = first(set);
+    return iter;
+}
+
+void set_destroyiter(set_iter_t *iter)
+{
+    free(iter);
+}
+
+int set_hasnext(set_iter_t *iter)
+{
+    return iter->node != NULL;
+}
+
+void *set_next(set_iter_t *iter)
+{
+    void *elem;
+
+    if (iter->node == NULL)
+        return NULL;
+    elem = iter->node->elem;
+    iter->node = after(iter->node);
+    return elem;
+}
@@ -1,26 +1,96 @@
 /* Author: Steffen Viken Valvaag <steffenv@cs.uit.no> */
+#include "automaton.h"
+#include "bayes.h"
+#include "cache.h"
 #include "common.h"
+#include "dedup.h"
+#include "document.h"
 #include "list.h"
+#include "mbox.h"
+#include "model.h"
+#include "pack.h"
+#include "pipeline.h"
 #include "printing.h"
+#include "reader.h"
+#include "scheduler.h"
+#include "server.h"
 #include "set.h"
+#include "stats.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 /*
- * Case-insensitive comparison function for strings.
+ * Number of clients the daemon serves at once, unless -j is given.
  */
-static int compare_words(void *a, void *b)
+#define SERVE_THREADS 8
+
+/*
+ * Number of file reads kept in flight, unless --io-depth is given.
+ */
+#define IO_DEPTH 16
+
+/*
+ * Number of mails whose counts are remembered by content, unless
+ * --dedup-size is given.
+ */
+#define DEDUP_SIZE 65536
+
+/*
+ * Threads walking, reading and scanning in the pipeline, unless
+ * --pipeline gives other counts.
+ */
+#define PIPELINE_WALKERS 2
+#define PIPELINE_READERS 8
+#define PIPELINE_SCANNERS 2
+
+/*
+ * A corpus of mails: either the files under a directory, or the
+ * documents in a corpus pack made by corpuspack.
+ */
+typedef struct corpus
 {
-    return strcasecmp(a, b);
+    pack_t *pack;
+    char **files;
+    int size;
+    int io_depth; /* Reads of the files to keep in flight; 0 to read in turn */
+} corpus_t;
+
+/*
+ * Adds a word to the word set, unless it is already there.  Only words
+ * that are new to the set are copied.
+ */
+static void addword(const char *word, size_t len, void *ctx)
+{
+    set_t *wordset = ctx;
+    char buf[101];
+    char *copy;
+
+    /* The tokenizer never produces words longer than 100 characters */
+    memcpy(buf, word, len);
+    buf[len] = 0;
+    if (!set_contains(wordset, buf))
+    {
+        copy = strdup(buf);
+        if (copy == NULL)
+        {
+            ERROR_PRINT("out of memory\n");
+        }
+        set_add(wordset, copy);
+    }
 }
 
 /*
- * Returns the set of (unique) words found in the given file.
+ * Returns the set of (unique) words found in the given file.  The words
+ * are lower-cased by the tokenizer, so the set compares them bytewise.
  */
 static set_t *tokenize(char *filename)
 {
-    set_t *wordset = set_create(compare_words);
-    list_t *wordlist = list_create(compare_words);
-    list_iter_t *it;
+    set_t *wordset = set_create(compare_strings);
     FILE *f;
 
     f = fopen(filename, "r");
@@ -29,18 +99,570 @@ static set_t *tokenize(char *filename)
         perror("fopen");
         ERROR_PRINT("fopen() failed");
     }
-    tokenize_file(f, wordlist);
+    tokenize_file_cb_opt(f, addword, wordset, TOKENIZE_FOLDCASE);
+    fclose(f);
+    return wordset;
+}
+
+/*
+ * Returns the set of (unique) words found in the given file.  If a
+ * cache is given, the words come from the cache.  Otherwise, if docs is
+ * not NULL, the file is memory-mapped instead of read, and the document
+ * that owns the words is added to docs.
+ */
+static set_t *file_words(char *filename, list_t *docs, cache_t *cache)
+{
+    document_t *doc;
+    set_t *words;
+
+    if (cache != NULL)
+    {
+        words = cache_words(cache, filename);
+        if (words == NULL)
+        {
+            perror("cache");
+            ERROR_PRINT("cache_words() failed");
+        }
+        return words;
+    }
+
+    if (docs == NULL)
+    {
+        return tokenize(filename);
+    }
 
-    it = list_createiter(wordlist);
-    while (list_hasnext(it))
+    doc = document_map(filename);
+    if (doc == NULL)
     {
-        set_add(wordset, list_next(it));
+        perror("mmap");
+        ERROR_PRINT("document_map() failed");
     }
-    list_destroyiter(it);
-    list_destroy(wordlist);
+    list_addlast(docs, doc);
+    return document_words(doc);
+}
+
+/*
+ * Returns the set of (unique) words in a file that a reader has read,
+ * and frees the file's contents.  A large file is tokenized in chunks,
+ * as tasks of the given scheduler.
+ */
+static set_t *buffer_words(char *filename, readbuf_t *buf, scheduler_t *scheduler)
+{
+    set_t *wordset;
+
+    if (buf->data == NULL)
+    {
+        errno = buf->error;
+        perror(filename);
+        ERROR_PRINT("reading %s failed\n", filename);
+    }
+    wordset = set_create(compare_strings);
+    tokenize_buffer_parallel(buf->data, buf->len, addword, wordset, TOKENIZE_FOLDCASE, scheduler);
+    free(buf->data);
     return wordset;
 }
 
+/*
+ * Opens the corpus at the given path, which is either a directory or a
+ * corpus pack.  The files of a directory are read with io_depth reads in
+ * flight, where that helps.
+ */
+static corpus_t *corpus_open(char *path, int io_depth)
+{
+    corpus_t *corpus = malloc(sizeof(corpus_t));
+    struct stat st;
+    list_t *files;
+    int i;
+
+    if (corpus == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    corpus->pack = NULL;
+    corpus->files = NULL;
+    corpus->io_depth = io_depth;
+
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        corpus->pack = pack_open(path);
+        if (corpus->pack == NULL)
+        {
+            ERROR_PRINT("%s is not a corpus pack\n", path);
+        }
+        corpus->size = pack_size(corpus->pack);
+        return corpus;
+    }
+
+    files = find_files(path);
+    corpus->size = list_size(files);
+    corpus->files = malloc((corpus->size + 1) * sizeof(char *));
+    if (corpus->files == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    for (i = 0; i < corpus->size; i++)
+    {
+        corpus->files[i] = list_popfirst(files);
+    }
+    list_destroy(files);
+    return corpus;
+}
+
+/*
+ * Returns the name of the given mail of the corpus.
+ */
+static char *corpus_name(corpus_t *corpus, int i)
+{
+    if (corpus->pack != NULL)
+    {
+        return pack_docname(corpus->pack, i);
+    }
+    return corpus->files[i];
+}
+
+/*
+ * Returns the set of (unique) words in the given mail of the corpus.
+ * See file_words() for docs and cache; a pack needs neither.
+ */
+static set_t *corpus_words(corpus_t *corpus, int i, list_t *docs, cache_t *cache)
+{
+    if (corpus->pack != NULL)
+    {
+        return pack_docwords(corpus->pack, i);
+    }
+    return file_words(corpus->files[i], docs, cache);
+}
+
+/*
+ * The type of set operations that combine the word sets of mails.
+ */
+typedef set_t *(*combinefunc_t)(set_t *, set_t *);
+
+/*
+ * A training run over a corpus, shared by the threads doing it.
+ */
+typedef struct trainer
+{
+    corpus_t *corpus;
+    combinefunc_t combine;
+    cache_t *cache;
+    int mapped; /* Set if word sets belong to mapped documents */
+    int next;   /* Next mail to be tokenized */
+    pthread_mutex_t lock;
+    reader_t *reader; /* Reads the mails ahead, if set */
+    scheduler_t *scheduler; /* Runs the tasks of the training run */
+    set_t *shared;          /* Union of the mails so far, if shared by the threads */
+} trainer_t;
+
+/*
+ * Takes the next mail of a training run, and returns its words, or NULL
+ * once there are none left.  With a reader, mails are taken in the order
+ * their reads complete.  See file_words() for docs.
+ */
+static set_t *trainer_next(trainer_t *t, list_t *docs)
+{
+    readbuf_t buf;
+    int i;
+
+    if (t->reader != NULL)
+    {
+        if (!reader_next(t->reader, &buf))
+        {
+            return NULL;
+        }
+        return buffer_words(t->corpus->files[buf.index], &buf, t->scheduler);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    i = t->next++;
+    pthread_mutex_unlock(&t->lock);
+    if (i >= t->corpus->size)
+    {
+        return NULL;
+    }
+    return corpus_words(t->corpus, i, docs, t->cache);
+}
+
+/*
+ * Starts reading the mails of a training run ahead of the threads that
+ * tokenize them, if they are plain files.
+ */
+static void trainer_startreading(trainer_t *t)
+{
+    corpus_t *corpus = t->corpus;
+
+    if (corpus->pack == NULL && t->cache == NULL && !t->mapped && corpus->io_depth > 0)
+    {
+        t->reader = reader_start(corpus->files, corpus->size, corpus->io_depth);
+    }
+}
+
+/*
+ * One of the tasks of a training run, and its partial result.
+ */
+typedef struct trainworker
+{
+    trainer_t *trainer;
+    set_t *partial;
+    int partial_owned; /* Set unless partial belongs to a document */
+    list_t *docs;
+} trainworker_t;
+
+/*
+ * Adds every element of the given set to the shared result of a
+ * training run.
+ */
+static void add_shared(trainer_t *t, set_t *words)
+{
+    set_iter_t *it = set_createiter(words);
+
+    while (set_hasnext(it))
+    {
+        set_add(t->shared, set_next(it));
+    }
+    set_destroyiter(it);
+}
+
+/*
+ * Tokenizes mails of the corpus until there are none left, combining
+ * their word sets into the worker's partial result, or adding them to
+ * the shared result if there is one.
+ */
+static void train_worker(void *arg)
+{
+    trainworker_t *w = arg;
+    trainer_t *t = w->trainer;
+    set_t *words, *combined;
+
+    while ((words = trainer_next(t, w->docs)) != NULL)
+    {
+        if (t->shared != NULL)
+        {
+            add_shared(t, words);
+            if (!t->mapped)
+            {
+                set_destroy(words);
+            }
+            continue;
+        }
+        if (w->partial == NULL)
+        {
+            w->partial = words;
+            w->partial_owned = !t->mapped;
+            continue;
+        }
+        combined = t->combine(w->partial, words);
+        if (w->partial_owned)
+        {
+            set_destroy(w->partial);
+        }
+        if (!t->mapped)
+        {
+            set_destroy(words);
+        }
+        w->partial = combined;
+        w->partial_owned = 1;
+    }
+}
+
+/*
+ * A run of the partial results of a training run, to be combined into
+ * one.
+ */
+typedef struct reduction
+{
+    scheduler_t *scheduler;
+    combinefunc_t combine;
+    trainworker_t **parts;
+    int nparts;
+    set_t *result;
+    int result_owned;
+} reduction_t;
+
+/*
+ * Combines a run of partial results, splitting it in halves that are
+ * combined in parallel, so that idle threads can steal the merges.
+ */
+static void reduce(void *arg)
+{
+    reduction_t *r = arg, left = *r, right = *r;
+    taskgroup_t *group;
+    set_t *combined;
+
+    if (r->nparts == 1)
+    {
+        r->result = r->parts[0]->partial;
+        r->result_owned = r->parts[0]->partial_owned;
+        return;
+    }
+    left.nparts = r->nparts / 2;
+    right.parts = r->parts + left.nparts;
+    right.nparts = r->nparts - left.nparts;
+
+    group = taskgroup_create();
+    scheduler_spawn(r->scheduler, group, reduce, &left);
+    reduce(&right);
+    scheduler_wait(r->scheduler, group);
+    taskgroup_destroy(group);
+
+    combined = r->combine(left.result, right.result);
+    if (left.result_owned)
+    {
+        set_destroy(left.result);
+    }
+    if (right.result_owned)
+    {
+        set_destroy(right.result);
+    }
+    r->result = combined;
+    r->result_owned = 1;
+}
+
+/*
+ * Combines the word sets of all mails in the corpus with the given set
+ * operation, using nthreads threads.  Each of nthreads tasks combines
+ * the mails it tokenizes into a partial result, and the partial results
+ * are combined at the end in a tree of tasks.  Since the operation is
+ * associative and commutative, the result does not depend on the number
+ * of threads.
+ *
+ * A union over a set implementation that is thread-safe is instead
+ * built by all tasks in one shared set, and needs no combining.
+ *
+ * See file_words() for docs and cache.
+ */
+static set_t *train(corpus_t *corpus, combinefunc_t combine, int nthreads, list_t *docs, cache_t *cache)
+{
+    int mapped = docs != NULL && cache == NULL && corpus->pack == NULL;
+    trainer_t trainer = {corpus, combine, cache, mapped, 0, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL};
+    uint64_t start = STATS_START();
+    reduction_t reduction = {NULL, combine, NULL, 0, NULL, 0};
+    trainworker_t *workers;
+    set_t *result = NULL;
+    taskgroup_t *group;
+    int i;
+
+    workers = calloc(nthreads, sizeof(trainworker_t));
+    reduction.parts = malloc(nthreads * sizeof(trainworker_t *));
+    if (workers == NULL || reduction.parts == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    if (combine == set_union && set_threadsafe())
+    {
+        trainer.shared = set_create(mapped ? compare_views : compare_strings);
+    }
+    trainer_startreading(&trainer);
+    reduction.scheduler = trainer.scheduler = scheduler_create(nthreads);
+    set_usescheduler(reduction.scheduler);
+    group = taskgroup_create();
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].trainer = &trainer;
+        workers[i].docs = docs != NULL ? list_create(NULL) : NULL;
+        scheduler_spawn(reduction.scheduler, group, train_worker, &workers[i]);
+    }
+    scheduler_wait(reduction.scheduler, group);
+    taskgroup_destroy(group);
+
+    /* Reduce the partial results */
+    for (i = 0; i < nthreads; i++)
+    {
+        if (workers[i].partial != NULL)
+        {
+            reduction.parts[reduction.nparts++] = &workers[i];
+        }
+        if (docs != NULL)
+        {
+            /* The mapped mails must outlive the training run */
+            while (list_size(workers[i].docs) > 0)
+            {
+                list_addlast(docs, list_popfirst(workers[i].docs));
+            }
+            list_destroy(workers[i].docs);
+        }
+    }
+    if (trainer.shared != NULL)
+    {
+        result = trainer.shared;
+    }
+    else if (reduction.nparts > 0)
+    {
+        reduce(&reduction);
+        result = reduction.result;
+    }
+    set_usescheduler(NULL);
+    scheduler_destroy(reduction.scheduler);
+    free(reduction.parts);
+    free(workers);
+    if (trainer.reader != NULL)
+    {
+        reader_destroy(trainer.reader);
+    }
+
+    if (result == NULL)
+    {
+        result = set_create(mapped ? compare_views : compare_strings);
+    }
+    STATS_STOP(TIMER_TRAIN, start);
+    return result;
+}
+
+/*
+ * One of the tasks of a naive Bayes training run, and the counts of the
+ * mails it tokenized.
+ */
+typedef struct bayesworker
+{
+    trainer_t *trainer;
+    bayes_t *bayes;
+    int spam;
+} bayesworker_t;
+
+/*
+ * Tokenizes mails of the corpus until there are none left, counting
+ * their words in the worker's classifier.
+ */
+static void bayes_worker(void *arg)
+{
+    bayesworker_t *w = arg;
+    trainer_t *t = w->trainer;
+    set_t *words;
+
+    while ((words = trainer_next(t, NULL)) != NULL)
+    {
+        bayes_add(w->bayes, words, w->spam);
+        set_destroy(words);
+    }
+}
+
+/*
+ * Counts the words of all mails in the corpus in the given classifier,
+ * using nthreads threads.  Each of nthreads tasks counts into a
+ * classifier of its own, and these are merged at the end, so the tasks
+ * never contend for the counts.
+ */
+static void train_bayes(corpus_t *corpus, int spam, bayes_t *bayes, int nthreads, cache_t *cache)
+{
+    trainer_t trainer = {corpus, NULL, cache, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL};
+    uint64_t start = STATS_START();
+    bayesworker_t *workers;
+    scheduler_t *scheduler;
+    taskgroup_t *group;
+    int i;
+
+    workers = calloc(nthreads, sizeof(bayesworker_t));
+    if (workers == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    trainer_startreading(&trainer);
+    scheduler = trainer.scheduler = scheduler_create(nthreads);
+    group = taskgroup_create();
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].trainer = &trainer;
+        workers[i].bayes = i == 0 ? bayes : bayes_create();
+        workers[i].spam = spam;
+        scheduler_spawn(scheduler, group, bayes_worker, &workers[i]);
+    }
+    scheduler_wait(scheduler, group);
+    taskgroup_destroy(group);
+    scheduler_destroy(scheduler);
+
+    for (i = 1; i < nthreads; i++)
+    {
+        bayes_merge(bayes, workers[i].bayes);
+    }
+    free(workers);
+    if (trainer.reader != NULL)
+    {
+        reader_destroy(trainer.reader);
+    }
+    STATS_STOP(TIMER_TRAIN, start);
+}
+
+/*
+ * Prints the score and naive Bayes verdict of every mail in the corpus.
+ */
+static void score_mails(bayes_t *bayes, corpus_t *mail, cache_t *cache)
+{
+    uint64_t start = STATS_START();
+    set_t *words;
+    double score;
+    int i;
+
+    for (i = 0; i < mail->size; i++)
+    {
+        words = corpus_words(mail, i, NULL, cache);
+        score = bayes_score(bayes, words);
+        printf("%s: score %.2f -> %s\n", corpus_name(mail, i), score, score > 0 ? "SPAM" : "Not spam");
+        set_destroy(words);
+    }
+    STATS_COUNT(COUNTER_MAILS, mail->size);
+    STATS_STOP(TIMER_CLASSIFY, start);
+}
+
+/*
+ * Trains a naive Bayes classifier on the given spam and nonspam corpora,
+ * and prints the score and verdict of every mail in the mail corpus.
+ */
+static void classify_bayes(corpus_t *spam, corpus_t *nonspam, corpus_t *mail, int njobs, cache_t *cache)
+{
+    bayes_t *bayes = bayes_create();
+
+    train_bayes(spam, 1, bayes, njobs, cache);
+    train_bayes(nonspam, 0, bayes, njobs, cache);
+    printf("Trained on %d spam and %d nonspam mails, %d words\n",
+           bayes_mails(bayes, 1), bayes_mails(bayes, 0), bayes_words(bayes));
+    score_mails(bayes, mail, cache);
+    bayes_destroy(bayes);
+}
+
+/*
+ * What the word counts of a model say about its spamwords.
+ */
+typedef struct summary
+{
+    int nspam;    /* Spam mails counted */
+    int allspam;  /* Words found in every spam mail */
+    int nonspam;  /* Words found in some nonspam mail */
+    int refined;  /* Words found in every spam mail and no nonspam mail */
+} summary_t;
+
+static void summarize_word(const char *word, int spam, int ham, void *ctx)
+{
+    summary_t *s = ctx;
+
+    (void)word;
+    if (s->nspam > 0 && spam == s->nspam)
+    {
+        s->allspam++;
+        if (ham == 0)
+        {
+            s->refined++;
+        }
+    }
+    if (ham > 0)
+    {
+        s->nonspam++;
+    }
+}
+
+/*
+ * Returns what the given word counts say about their spamwords.  The
+ * intersection of all spam mails is the set of words counted in as many
+ * spam mails as there are, and the union of all nonspam mails is the
+ * set of words counted in any nonspam mail.
+ */
+static summary_t summarize(bayes_t *counts)
+{
+    summary_t s = {bayes_mails(counts, 1), 0, 0, 0};
+
+    bayes_foreach(counts, summarize_word, &s);
+    return s;
+}
+
 /*
  * Prints a set of words.
 
@@ -60,73 +682,816 @@ static void printwords(char *prefix, set_t *words)
 */
 
 /*
- * Main entry point.
+ * Returns a set holding the words of the given set of views, as
+ * lower-cased strings.
  */
-int main(int argc, char **argv)
+static set_t *views_to_strings(set_t *views)
 {
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    set_t *strings = set_create(compare_strings);
+    set_iter_t *it = set_createiter(views);
+    wordview_t *view;
+    char *word;
+    size_t i;
+
+    while (set_hasnext(it))
+    {
+        view = set_next(it);
+        word = malloc(view->len + 1);
+        if (word == NULL)
+        {
+            ERROR_PRINT("out of memory\n");
+        }
+        for (i = 0; i < view->len; i++)
+        {
+            word[i] = tolower((unsigned char)view->word[i]);
+        }
+        word[view->len] = 0;
+        set_add(strings, word);
+    }
+    set_destroyiter(it);
+    return strings;
+}
+
+/*
+ * Returns a set of views of the words in the given set of strings, so
+ * that they can be compared with the words of mapped mails.
+ */
+static set_t *strings_to_views(set_t *strings)
+{
+    set_t *views = set_create(compare_views);
+    set_iter_t *it = set_createiter(strings);
+    wordview_t *view;
+
+    while (set_hasnext(it))
+    {
+        view = malloc(sizeof(wordview_t));
+        if (view == NULL)
+        {
+            ERROR_PRINT("out of memory\n");
+        }
+        view->word = set_next(it);
+        view->len = strlen(view->word);
+        set_add(views, view);
+    }
+    set_destroyiter(it);
+    return views;
+}
+
+/*
+ * Trains on the given spam and nonspam corpora, and returns the refined
+ * spamword set: the words found in every spam mail and in no nonspam
+ * mail.
+ */
+static set_t *refine(corpus_t *spam, corpus_t *nonspam, int njobs, list_t *docs, cache_t *cache)
+{
+    set_t *spamwords = train(spam, set_intersection, njobs, docs, cache);
+    printf("Words contained in all spam mails %d\n", set_size(spamwords));
+
+    set_t *nonspamwords = train(nonspam, set_union, njobs, docs, cache);
+    printf("Unique words in non spam mails %d\n", set_size(nonspamwords));
+
+    set_t *refined_spamword = set_difference(spamwords, nonspamwords);
+    printf("Words contained in all spam mails and in none of the nonspam mails %d\n", set_size(refined_spamword));
+
+    return refined_spamword;
+}
+
+/*
+ * How mails are classified and reported.
+ */
+typedef struct verdict
+{
+    int brief;     /* Only report spam mails, without their names */
+    int threshold; /* Number of spamwords that makes a mail spam */
+    int early;     /* Stop reading a mail once it reaches the threshold */
+} verdict_t;
+
+/*
+ * Prints the verdict for one mail.  With partial set, the mail was not
+ * read to the end, and count is only a lower bound.
+ */
+static void report(char *name, int count, int partial, verdict_t *v)
+{
+    const char *more = partial ? "+" : "";
+
+    if (!v->brief)
+    {
+        printf("%s: %d%s spam word(s) -> %s\n", name, count, more, count >= v->threshold ? "SPAM" : "Not spam");
+    }
+    else if (count >= v->threshold)
+    {
+        printf("Mail is spam! Mail contained %d%s spamwords\n", count, more);
+    }
+}
+
+/*
+ * Number of bytes of a mail read before its spamwords are checked
+ * against the threshold.
+ */
+#define CLASSIFY_BLOCK 65536
+
+/*
+ * Counts the distinct spamwords in the given file, reading it a block at
+ * a time through the scanner.  With stop greater than 0, no more blocks
+ * are read once stop spamwords have been found.
+ */
+static int count_file(char *filename, scanner_t *scanner, int stop)
+{
+    char *buf = malloc(CLASSIFY_BLOCK);
+    size_t n;
+    FILE *f;
+
+    if (buf == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    f = fopen(filename, "r");
+    if (f == NULL)
+    {
+        perror("fopen");
+        ERROR_PRINT("fopen() failed");
+    }
+    while ((n = fread(buf, 1, CLASSIFY_BLOCK, f)) > 0)
+    {
+        STATS_COUNT(COUNTER_BYTES, n);
+        scanner_feed(scanner, buf, n);
+        if (stop > 0 && scanner_hits(scanner) >= stop)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    free(buf);
+    return scanner_finish(scanner);
+}
+
+/*
+ * Scans every mail in the corpus with the scanner, as a reader completes
+ * them, and reports the counts in the order of the corpus.  Mails found
+ * in the dedup cache, if given, are not scanned.
+ */
+static void classify_read(corpus_t *mail, scanner_t *scanner, dedup_t *dedup, verdict_t *v)
+{
+    reader_t *reader;
+    int *counts;
+    int reported = 0;
+    readbuf_t buf;
+    uint64_t hash;
+
+    /* malloc(0) may return NULL, which is no lack of memory */
+    if (mail->size == 0)
+    {
+        return;
+    }
+    reader = reader_start(mail->files, mail->size, mail->io_depth);
+    counts = malloc(mail->size * sizeof(int));
+    if (counts == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    memset(counts, -1, mail->size * sizeof(int));
+    while (reader_next(reader, &buf))
+    {
+        if (buf.data == NULL)
+        {
+            errno = buf.error;
+            perror(mail->files[buf.index]);
+            ERROR_PRINT("reading %s failed\n", mail->files[buf.index]);
+        }
+        hash = dedup != NULL ? dedup_hash(buf.data, buf.len) : 0;
+        if (dedup != NULL && dedup_get(dedup, hash, &counts[buf.index]))
+        {
+            STATS_COUNT(COUNTER_DEDUP_HITS, 1);
+        }
+        else
+        {
+            STATS_COUNT(COUNTER_BYTES, buf.len);
+            scanner_feed(scanner, buf.data, buf.len);
+            counts[buf.index] = scanner_finish(scanner);
+            if (dedup != NULL)
+            {
+                dedup_put(dedup, hash, counts[buf.index]);
+            }
+        }
+        free(buf.data);
+        /* Report every mail up to the first one still being read */
+        while (reported < mail->size && counts[reported] >= 0)
+        {
+            report(corpus_name(mail, reported), counts[reported], 0, v);
+            reported++;
+        }
+    }
+    reader_destroy(reader);
+    free(counts);
+}
+
+/*
+ * Classifies every mail in the corpus against the refined spamword set.
+ *
+ * Plain files are scanned with an automaton compiled from the spamword
+ * set as they are read, without collecting their words, and can be cut
+ * short by the threshold.  Without a threshold, several files are read
+ * at once, and duplicates of mails in the dedup cache are not scanned.
+ * Mapped, cached and packed mails are intersected with the
+ * spamword set as a whole.
+ */
+static void classify(corpus_t *mail, set_t *refined_spamword, list_t *maildocs, cache_t *cache,
+                     dedup_t *dedup, verdict_t *v)
+{
+    uint64_t start = STATS_START();
+    set_t *check_mail, *tmp;
+    automaton_t *automaton = NULL;
+    scanner_t *scanner = NULL;
+    int i, count;
 
-    char *spamdir, *nonspamdir, *maildir;
+    if (mail->pack == NULL && maildocs == NULL && cache == NULL) {
+        automaton = automaton_create(refined_spamword);
+        scanner = scanner_create(automaton);
+    }
+    if (scanner != NULL && !v->early && mail->io_depth > 0) {
+        classify_read(mail, scanner, dedup, v);
+        i = mail->size;
+    } else {
+        i = 0;
+    }
+    for (; i < mail->size; i++) {
+        if (scanner != NULL) {
+            count = count_file(mail->files[i], scanner, v->early ? v->threshold : 0);
+            report(corpus_name(mail, i), count, v->early && count >= v->threshold, v);
+            continue;
+        }
+        tmp = corpus_words(mail, i, maildocs, cache);
+        check_mail = set_intersection(tmp, refined_spamword);
+        report(corpus_name(mail, i), set_size(check_mail), 0, v);
+        /* The mail's words are no longer needed */
+        set_destroy(check_mail);
+        if (maildocs != NULL && cache == NULL && mail->pack == NULL) {
+            document_destroy(list_poplast(maildocs));
+        } else {
+            set_destroy(tmp);
+        }
+    }
+    if (scanner != NULL) {
+        scanner_destroy(scanner);
+        automaton_destroy(automaton);
+    }
+    STATS_COUNT(COUNTER_MAILS, mail->size);
+    STATS_STOP(TIMER_CLASSIFY, start);
+}
 
-    if (argc != 4)
+/*
+ * Returns 1 if the mails to classify at the given path are an mbox
+ * stream: standard input, given as "-", or a file that is not a corpus
+ * pack.
+ */
+static int is_mbox(char *path)
+{
+    struct stat st;
+    pack_t *pack;
+
+    if (strcmp(path, "-") == 0)
     {
-        DEBUG_PRINT("usage: %s <spamdir> <nonspamdir> <maildir>\n", argv[0]);
         return 1;
     }
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return 0;
+    }
+    pack = pack_open(path);
+    if (pack != NULL)
+    {
+        pack_close(pack);
+        return 0;
+    }
+    return 1;
+}
+
+typedef struct mboxclassifier
+{
+    char *path;
+    char *name; /* Room for the path and a message number */
+    spamcount_t *counter;
+    verdict_t *verdict;
+} mboxclassifier_t;
 
-    spamdir = argv[1];
-    nonspamdir = argv[2];
-    maildir = argv[3];
+/*
+ * Counts a word of the current message, unless the message has already
+ * reached the threshold.  The rest of such a message still has to be
+ * read to find the next one, but its words are not looked up.
+ */
+static void count_message_word(const char *word, size_t len, void *ctx)
+{
+    mboxclassifier_t *c = ctx;
 
-    list_t *spam_files = find_files(spamdir);
-    list_t *nonspam_files = find_files(nonspamdir);
-    list_t *mail_files = find_files(maildir);
+    if (c->verdict->early && spamcount_hits(c->counter) >= c->verdict->threshold)
+    {
+        return;
+    }
+    spamcount_word(word, len, c->counter);
+}
 
-    list_iter_t *it = list_createiter(spam_files);
-    set_t *spamwords = set_create(compare_words);
-    set_t *tmp = set_create(compare_words);
+/*
+ * Reports the verdict for one message of an mbox, named after the mbox
+ * and the message's number.
+ */
+static void classify_message(int message, void *ctx)
+{
+    mboxclassifier_t *c = ctx;
+    verdict_t *v = c->verdict;
+    int count = spamcount_reset(c->counter);
 
-    while (list_hasnext(it)) {
-        tmp = tokenize(list_next(it));
-        if (!set_size(spamwords)) {
-            spamwords = tmp;
+    sprintf(c->name, "%s#%d", c->path, message);
+    report(c->name, count, v->early && count >= v->threshold, v);
+    /* Let a reader at the other end of a pipe see each verdict at once */
+    fflush(stdout);
+}
+
+/*
+ * Classifies the messages of the mbox at the given path, or of standard
+ * input, as they are read.  The refined spamword set must hold strings.
+ */
+static void classify_mbox(char *path, set_t *refined_spamword, verdict_t *v)
+{
+    mboxclassifier_t c = {path, malloc(strlen(path) + 16), spamcount_create(refined_spamword), v};
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    uint64_t start = STATS_START();
+    int messages;
+
+    if (c.name == NULL)
+    {
+        ERROR_PRINT("out of memory\n");
+    }
+    if (file == NULL)
+    {
+        perror(path);
+        ERROR_PRINT("cannot open %s\n", path);
+    }
+    messages = mbox_tokenize(file, count_message_word, classify_message, &c, TOKENIZE_FOLDCASE);
+    STATS_COUNT(COUNTER_MAILS, messages);
+    STATS_STOP(TIMER_CLASSIFY, start);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    spamcount_destroy(c.counter);
+    free(c.name);
+}
+
+static void report_result(char *path, int count, int partial, void *ctx)
+{
+    report(path, count, partial, ctx);
+}
+
+/*
+ * Returns 1 if the given path is a directory.
+ */
+static int is_directory(char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Classifies the mails under the given directory in a pipeline.
+ */
+static void classify_pipeline(char *path, set_t *refined_spamword, dedup_t *dedup,
+                              pipeline_config_t *config, verdict_t *v)
+{
+    automaton_t *automaton = automaton_create(refined_spamword);
+
+    pipeline_classify(path, automaton, dedup, v->early ? v->threshold : 0, config, report_result, v);
+    automaton_destroy(automaton);
+}
+
+/*
+ * Opens the dedup cache for counts taken with the given spamword set, or
+ * returns NULL if mails are not to be remembered.
+ */
+static dedup_t *open_dedup(char *filename, int size, set_t *spamwords)
+{
+    dedup_t *dedup;
+
+    if (size == 0)
+    {
+        return NULL;
+    }
+    dedup = dedup_open(filename, size, spamwords);
+    if (dedup == NULL)
+    {
+        ERROR_PRINT("dedup_open() failed\n");
+    }
+    return dedup;
+}
+
+static void usage(char *prog)
+{
+    DEBUG_PRINT("usage: %s [options] <spamdir> <nonspamdir> <maildir>\n", prog);
+    DEBUG_PRINT("       %s [options] train <spamdir> <nonspamdir> <modelfile>\n", prog);
+    DEBUG_PRINT("       %s [options] classify <modelfile> <maildir>\n", prog);
+    DEBUG_PRINT("       %s [options] add-spam|add-nonspam <modelfile> <file>...\n", prog);
+    DEBUG_PRINT("       %s [options] serve [<modelfile> | <spamdir> <nonspamdir>] <socket>\n", prog);
+    DEBUG_PRINT("options: [-m] [-b] [-c cachefile] [-j threads] [--threshold K [--exact]]\n");
+    DEBUG_PRINT("         [--stats[=json]] [--io-depth N] [--dedup-size N] [--dedup-file file]\n");
+    DEBUG_PRINT("         [--pipeline[=W,R,S]]\n");
+    DEBUG_PRINT("-b scores mails with a naive Bayes classifier; with the first form or classify.\n");
+    DEBUG_PRINT("--threshold K makes K spamwords a spam verdict, and stops reading a mail\n");
+    DEBUG_PRINT("once they are found; --exact reads every mail to the end.\n");
+    DEBUG_PRINT("--stats[=json] prints per-stage timers and counters to stderr.\n");
+    DEBUG_PRINT("--io-depth N keeps N file reads in flight (default %d); 0 reads in turn.\n", IO_DEPTH);
+    DEBUG_PRINT("--dedup-size N remembers the counts of the last N distinct mails (default %d),\n", DEDUP_SIZE);
+    DEBUG_PRINT("so duplicates are not scanned again; --dedup-file keeps them between runs.\n");
+    DEBUG_PRINT("--pipeline[=W,R,S] classifies a mail directory with W threads walking it, R\n");
+    DEBUG_PRINT("reading and S scanning (default %d,%d,%d), and reports mails as they finish.\n",
+                PIPELINE_WALKERS, PIPELINE_READERS, PIPELINE_SCANNERS);
+    DEBUG_PRINT("Each directory may also be a corpus pack made by corpuspack.\n");
+    DEBUG_PRINT("The mails to classify may also be an mbox file, or - for standard input.\n");
+    DEBUG_PRINT("A daemon serving a model file loads it again on SIGHUP.\n");
+}
+
+/*
+ * Main entry point.
+ */
+int main(int argc, char **argv)
+{
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    char *command;
+    list_t *docs = NULL, *maildocs = NULL;
+    cache_t *cache = NULL;
+    dedup_t *dedup = NULL;
+    char *dedup_file = NULL;
+    int dedup_size = DEDUP_SIZE;
+    int njobs = 0;
+    int use_bayes = 0;
+    int opt, nargs;
+    verdict_t verdict = {0, 1, 0};
+    int exact = 0;
+    int stats_json = 0;
+    int io_depth = IO_DEPTH;
+    pipeline_config_t pipeline = {0, 0, 0, 0};
+    static struct option options[] = {
+        {"threshold", required_argument, NULL, 't'},
+        {"exact", no_argument, NULL, 'e'},
+        {"stats", optional_argument, NULL, 's'},
+        {"io-depth", required_argument, NULL, 'd'},
+        {"dedup-size", required_argument, NULL, 'D'},
+        {"dedup-file", required_argument, NULL, 'F'},
+        {"pipeline", optional_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0}};
+
+    while ((opt = getopt_long(argc, argv, "mbc:j:t:e", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            /* Decide on spam at K spamwords, without reading further */
+            verdict.threshold = atoi(optarg);
+            verdict.early = 1;
+            if (verdict.threshold < 1)
+            {
+                argc = 0;
+            }
+            break;
+        case 'e':
+            /* Read every mail to the end, to report exact counts */
+            exact = 1;
+            break;
+        case 's':
+            /* Time the stages of the run, and print them at the end */
+            stats_enable();
+            if (optarg != NULL)
+            {
+                stats_json = strcmp(optarg, "json") == 0;
+                if (!stats_json && strcmp(optarg, "table") != 0)
+                {
+                    argc = 0;
+                }
+            }
+            break;
+        case 'd':
+            /* Keep this many file reads in flight; 0 reads in turn */
+            io_depth = atoi(optarg);
+            if (io_depth < 0)
+            {
+                argc = 0;
+            }
+            break;
+        case 'D':
+            /* Remember the counts of this many mails; 0 forgets them */
+            dedup_size = atoi(optarg);
+            if (dedup_size < 0)
+            {
+                argc = 0;
+            }
+            break;
+        case 'F':
+            /* Keep the remembered counts between runs */
+            dedup_file = optarg;
+            break;
+        case 'P':
+            /* Classify in stages, each with its own threads */
+            pipeline.walkers = PIPELINE_WALKERS;
+            pipeline.readers = PIPELINE_READERS;
+            pipeline.scanners = PIPELINE_SCANNERS;
+            if (optarg != NULL &&
+                (sscanf(optarg, "%d,%d,%d", &pipeline.walkers, &pipeline.readers, &pipeline.scanners) != 3 ||
+                 pipeline.walkers < 1 || pipeline.readers < 1 || pipeline.scanners < 1))
+            {
+                argc = 0;
+            }
+            break;
+        case 'b':
+            /* Score mails by word frequencies instead of spamwords */
+            use_bayes = 1;
+            break;
+        case 'm':
+            /* Memory-map the files and use word views into them */
+            docs = list_create(NULL);
+            maildocs = list_create(NULL);
+            break;
+        case 'c':
+            /* Only tokenize files that changed since the last run */
+            cache = cache_open(optarg);
+            if (cache == NULL)
+            {
+                ERROR_PRINT("cache_open() failed");
+            }
+            break;
+        case 'j':
+            /* Tokenize the training mails, or serve clients, with this
+             * many threads */
+            njobs = atoi(optarg);
+            if (njobs < 1)
+            {
+                argc = 0;
+            }
+            break;
+        default:
+            argc = 0;
+            break;
         }
-        spamwords = set_intersection(spamwords, tmp);
     }
 
-    printf("Words contained in all spam mails %d\n", set_size(spamwords));
+    if (exact)
+    {
+        verdict.early = 0;
+    }
+    pipeline.depth = io_depth > 0 ? io_depth : 1;
 
-    it = list_createiter(nonspam_files);
-    set_t *nonspamwords = set_create(compare_words);
+    if (argc - optind < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    command = argv[optind];
+    if (strcmp(command, "train") == 0 || strcmp(command, "classify") == 0 ||
+        strcmp(command, "serve") == 0 || strcmp(command, "add-spam") == 0 ||
+        strcmp(command, "add-nonspam") == 0)
+    {
+        optind++;
+    }
+    else
+    {
+        command = NULL;
+    }
+    nargs = argc - optind;
+    if ((command == NULL && nargs != 3) ||
+        (command != NULL && strcmp(command, "train") == 0 && nargs != 3) ||
+        (command != NULL && strcmp(command, "classify") == 0 && nargs != 2) ||
+        (command != NULL && strcmp(command, "serve") == 0 && nargs != 2 && nargs != 3) ||
+        (command != NULL && strncmp(command, "add-", 4) == 0 && nargs < 2) ||
+        (command != NULL && use_bayes && strcmp(command, "classify") != 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (command != NULL && strcmp(command, "serve") == 0)
+    {
+        if (njobs == 0)
+        {
+            njobs = SERVE_THREADS;
+        }
+        /* The daemon counts spamwords as strings */
+        if (docs != NULL)
+        {
+            ERROR_PRINT("-m cannot be used with serve\n");
+        }
+    }
+    else if (njobs == 0)
+    {
+        njobs = 1;
+    }
 
-    while (list_hasnext(it)) {
-        tmp = tokenize(list_next(it));
-        if (!set_size(nonspamwords)) {
-            nonspamwords = tmp;
+    if (command != NULL && strcmp(command, "serve") == 0 && nargs == 2)
+    {
+        /* Serve a saved model */
+        model_t *model = model_load(argv[optind]);
+        if (model == NULL)
+        {
+            ERROR_PRINT("%s is not a model file\n", argv[optind]);
+        }
+        dedup = open_dedup(dedup_file, dedup_size, model_spamwords(model));
+        if (server_run(argv[optind + 1], argv[optind], model_spamwords(model), verdict.threshold, dedup,
+                       njobs) != 0)
+        {
+            return 1;
         }
-        nonspamwords = set_union(nonspamwords, tmp);
+        model_destroy(model);
     }
-    printf("Unique words in non spam mails %d\n", set_size(nonspamwords));
+    else if (command != NULL && strncmp(command, "add-", 4) == 0)
+    {
+        /* Count more training mails into a saved model */
+        int spam = strcmp(command, "add-spam") == 0;
+        model_t *model = model_load(argv[optind]);
+        if (model == NULL)
+        {
+            ERROR_PRINT("%s is not a model file\n", argv[optind]);
+        }
+        bayes_t *counts = model_counts(model);
+        if (counts == NULL)
+        {
+            ERROR_PRINT("%s holds no word counts; train it again\n", argv[optind]);
+        }
+        for (int i = optind + 1; i < argc; i++)
+        {
+            set_t *words = file_words(argv[i], NULL, cache);
+            bayes_add(counts, words, spam);
+            set_destroy(words);
+        }
+        if (!model_save(argv[optind], counts))
+        {
+            perror(argv[optind]);
+            ERROR_PRINT("model_save() failed\n");
+        }
+        summary_t summary = summarize(counts);
+        printf("Model has %d spam and %d nonspam mails, %d spamwords\n",
+               bayes_mails(counts, 1), bayes_mails(counts, 0), summary.refined);
+        model_destroy(model);
+    }
+    else if (command != NULL && strcmp(command, "train") == 0)
+    {
+        /* Count the words of the training mails, and save the counts */
+        if (docs != NULL)
+        {
+            ERROR_PRINT("-m cannot be used with train\n");
+        }
+        bayes_t *counts = bayes_create();
+        train_bayes(corpus_open(argv[optind], io_depth), 1, counts, njobs, cache);
+        train_bayes(corpus_open(argv[optind + 1], io_depth), 0, counts, njobs, cache);
+        summary_t summary = summarize(counts);
+        printf("Words contained in all spam mails %d\n", summary.allspam);
+        printf("Unique words in non spam mails %d\n", summary.nonspam);
+        printf("Words contained in all spam mails and in none of the nonspam mails %d\n", summary.refined);
+        if (!model_save(argv[optind + 2], counts))
+        {
+            perror(argv[optind + 2]);
+            ERROR_PRINT("model_save() failed\n");
+        }
+        printf("Saved %d spamwords to %s\n", summary.refined, argv[optind + 2]);
+        bayes_destroy(counts);
+    }
+    else if (command != NULL && strcmp(command, "classify") == 0 && use_bayes)
+    {
+        /* Score against the word counts of a saved model */
+        model_t *model = model_load(argv[optind]);
+        if (model == NULL)
+        {
+            ERROR_PRINT("%s is not a model file\n", argv[optind]);
+        }
+        if (model_counts(model) == NULL)
+        {
+            ERROR_PRINT("%s holds no word counts; train it again\n", argv[optind]);
+        }
+        if (docs != NULL)
+        {
+            ERROR_PRINT("-m cannot be used with -b\n");
+        }
+        if (is_mbox(argv[optind + 1]))
+        {
+            ERROR_PRINT("-b cannot classify an mbox\n");
+        }
+        score_mails(model_counts(model), corpus_open(argv[optind + 1], io_depth), cache);
+        model_destroy(model);
+    }
+    else if (command != NULL && strcmp(command, "classify") == 0)
+    {
+        /* Classify against a saved model; no training needed */
+        model_t *model = model_load(argv[optind]);
+        if (model == NULL)
+        {
+            ERROR_PRINT("%s is not a model file\n", argv[optind]);
+        }
+        set_t *refined_spamword = model_spamwords(model);
+        if (is_mbox(argv[optind + 1]))
+        {
+            classify_mbox(argv[optind + 1], refined_spamword, &verdict);
+        }
+        else if (pipeline.readers > 0 && docs == NULL && cache == NULL && is_directory(argv[optind + 1]))
+        {
+            dedup = open_dedup(dedup_file, dedup_size, refined_spamword);
+            classify_pipeline(argv[optind + 1], refined_spamword, dedup, &pipeline, &verdict);
+        }
+        else
+        {
+            corpus_t *mail = corpus_open(argv[optind + 1], io_depth);
+            if (docs != NULL && mail->pack != NULL)
+            {
+                ERROR_PRINT("-m cannot be used with corpus packs\n");
+            }
+            if (docs != NULL && cache == NULL)
+            {
+                refined_spamword = strings_to_views(refined_spamword);
+            }
+            /* Mapped mails are not scanned whole, so are never deduplicated */
+            dedup = docs == NULL ? open_dedup(dedup_file, dedup_size, refined_spamword) : NULL;
+            classify(mail, refined_spamword, maildocs, cache, dedup, &verdict);
+        }
+    }
+    else if (use_bayes)
+    {
+        /* The classifier counts words as strings */
+        if (docs != NULL)
+        {
+            ERROR_PRINT("-m cannot be used with -b\n");
+        }
+        if (is_mbox(argv[optind + 2]))
+        {
+            ERROR_PRINT("-b cannot classify an mbox\n");
+        }
+        classify_bayes(corpus_open(argv[optind], io_depth), corpus_open(argv[optind + 1], io_depth),
+                       corpus_open(argv[optind + 2], io_depth), njobs, cache);
+    }
+    else
+    {
+        corpus_t *spam = corpus_open(argv[optind], io_depth);
+        corpus_t *nonspam = corpus_open(argv[optind + 1], io_depth);
 
-    set_t *refined_spamword = set_difference(spamwords, nonspamwords);
-    printf("Words contained in all spam mails and in none of the nonspam mails %d\n", set_size(refined_spamword));
+        if (docs != NULL && (spam->pack || nonspam->pack))
+        {
+            /* Pack words are strings, which cannot be mixed with views */
+            ERROR_PRINT("-m cannot be used with corpus packs\n");
+        }
 
-    it = list_createiter(mail_files);
-    set_t *check_mail = set_create(compare_words);
+        set_t *refined_spamword = refine(spam, nonspam, njobs, docs, cache);
 
-    while (list_hasnext(it)) {
-        tmp = tokenize(list_next(it));
-        check_mail = set_intersection(tmp, refined_spamword);
-        if (set_size(check_mail)) {
-            printf("Mail is spam! Mail contained %d spamwords\n", set_size(check_mail));
-        }     
+        if (command != NULL && strcmp(command, "serve") == 0)
+        {
+            /* Train once, then serve until stopped */
+            dedup = open_dedup(dedup_file, dedup_size, refined_spamword);
+            if (server_run(argv[optind + 2], NULL, refined_spamword, verdict.threshold, dedup, njobs) != 0)
+            {
+                return 1;
+            }
+        }
+        else if (is_mbox(argv[optind + 2]))
+        {
+            if (docs != NULL && cache == NULL)
+            {
+                refined_spamword = views_to_strings(refined_spamword);
+            }
+            verdict.brief = 1;
+            classify_mbox(argv[optind + 2], refined_spamword, &verdict);
+        }
+        else if (pipeline.readers > 0 && docs == NULL && cache == NULL && is_directory(argv[optind + 2]))
+        {
+            verdict.brief = 1;
+            dedup = open_dedup(dedup_file, dedup_size, refined_spamword);
+            classify_pipeline(argv[optind + 2], refined_spamword, dedup, &pipeline, &verdict);
+        }
+        else
+        {
+            corpus_t *mail = corpus_open(argv[optind + 2], io_depth);
+            if (docs != NULL && mail->pack != NULL)
+            {
+                ERROR_PRINT("-m cannot be used with corpus packs\n");
+            }
+            verdict.brief = 1;
+            /* Mapped mails are not scanned whole, so are never deduplicated */
+            dedup = docs == NULL ? open_dedup(dedup_file, dedup_size, refined_spamword) : NULL;
+            classify(mail, refined_spamword, maildocs, cache, dedup, &verdict);
+        }
     }
-     clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    if (cache != NULL && !cache_save(cache)) {
+        perror("cache");
+    }
+    if (dedup != NULL) {
+        if (!dedup_save(dedup)) {
+            perror("dedup");
+        }
+        dedup_destroy(dedup);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
 
     double elapsed_time = (end_time.tv_sec - start_time.tv_sec) +
                           (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
 
     printf("Elapsed time: %.9f seconds\n", elapsed_time);
+    if (stats_enabled)
+    {
+        stats_print(stderr, stats_json);
+    }
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,92 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+int stats_enabled;
+
+static const char *timer_names[NUM_TIMERS] = {
+    "find_files",
+    "tokenize",
+    "set_union",
+    "set_intersection",
+    "set_difference",
+    "train",
+    "classify",
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "files",
+    "bytes_read",
+    "tokens",
+    "set_add",
+    "comparisons",
+    "mails",
+    "dedup_hits",
+};
+
+static atomic_uint_least64_t timer_calls[NUM_TIMERS];
+static atomic_uint_least64_t timer_ns[NUM_TIMERS];
+static atomic_uint_least64_t counters[NUM_COUNTERS];
+
+void stats_enable(void)
+{
+    stats_enabled = 1;
+}
+
+void stats_add(stat_counter_t counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_stop(stat_timer_t timer, uint64_t start)
+{
+    uint64_t elapsed = stats_now() - start;
+
+    atomic_fetch_add_explicit(&timer_calls[timer], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&timer_ns[timer], elapsed, memory_order_relaxed);
+}
+
+void stats_print(FILE *out, int json)
+{
+    int i;
+
+    if (json)
+    {
+        fprintf(out, "{\"timers\": {");
+        for (i = 0; i < NUM_TIMERS; i++)
+        {
+            fprintf(out, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu}", i > 0 ? ", " : "", timer_names[i],
+                    (unsigned long long)atomic_load(&timer_calls[i]),
+                    (unsigned long long)atomic_load(&timer_ns[i]));
+        }
+        fprintf(out, "}, \"counters\": {");
+        for (i = 0; i < NUM_COUNTERS; i++)
+        {
+            fprintf(out, "%s\"%s\": %llu", i > 0 ? ", " : "", counter_names[i],
+                    (unsigned long long)atomic_load(&counters[i]));
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "%-20s %12s %14s\n", "timer", "calls", "total ms");
+    for (i = 0; i < NUM_TIMERS; i++)
+    {
+        fprintf(out, "%-20s %12llu %14.3f\n", timer_names[i],
+                (unsigned long long)atomic_load(&timer_calls[i]),
+                atomic_load(&timer_ns[i]) / 1e6);
+    }
+    fprintf(out, "%-20s %12s\n", "counter", "value");
+    for (i = 0; i < NUM_COUNTERS; i++)
+    {
+        fprintf(out, "%-20s %12llu\n", counter_names[i], (unsigned long long)atomic_load(&counters[i]));
+    }
+}